@@ -0,0 +1,157 @@
+/* MIT License
+
+Copyright (c) 2020 Dheeraj R Reddy
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+==============================================================================*/
+
+#include <benchmark/benchmark.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <random>
+#include <thread>
+#include <vector>
+
+#include "shadesmar/memory/allocator.h"
+#include "shadesmar/memory/lockless_allocator.h"
+#include "shadesmar/memory/slab_allocator.h"
+
+#define HEAP_SIZE (64 * 1024 * 1024)
+
+// Shared by all the threads of one benchmark run.
+template <class AllocatorT>
+AllocatorT *shared_alloc = nullptr;
+
+// Alloc + free of a single block, the pattern of `Topic::write`.
+template <class AllocatorT>
+void AllocFreeBench(benchmark::State &state) {  // NOLINT
+  if (state.thread_index() == 0) {
+    shared_alloc<AllocatorT> =
+        shm::memory::new_local_allocator<AllocatorT>(HEAP_SIZE);
+  }
+  uint32_t size = state.range(0);
+  for (auto _ : state) {
+    auto *alloc = shared_alloc<AllocatorT>;
+    uint8_t *ptr;
+    while ((ptr = alloc->alloc(size)) == nullptr) {
+      std::this_thread::yield();
+    }
+    benchmark::DoNotOptimize(ptr);
+    alloc->free(ptr);
+  }
+  if (state.thread_index() == 0) {
+    free(shared_alloc<AllocatorT>);
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+
+enum Distribution { UNIFORM, BIMODAL, HEAVY_TAILED };
+
+// Message sizes of one publisher, between 64B and 1MB.
+std::vector<uint32_t> message_sizes(Distribution dist, uint32_t seed) {
+  std::mt19937 gen(seed);
+  std::uniform_int_distribution<uint32_t> uniform(64, 4096);
+  std::uniform_int_distribution<uint32_t> small(64, 128);
+  std::bernoulli_distribution large(0.1);
+  // Pareto with alpha = 1.2, most messages are small, a few are huge.
+  std::uniform_real_distribution<double> unit(0.0, 1.0);
+
+  std::vector<uint32_t> sizes(4096);
+  for (auto &size : sizes) {
+    switch (dist) {
+      case UNIFORM:
+        size = uniform(gen);
+        break;
+      case BIMODAL:
+        size = large(gen) ? 4096 : small(gen);
+        break;
+      case HEAVY_TAILED:
+        size = std::min(64.0 / std::pow(1.0 - unit(gen), 1.0 / 1.2),
+                        1024.0 * 1024.0);
+        break;
+    }
+  }
+  return sizes;
+}
+
+// Every thread keeps its last 64 messages alive like a topic queue, and
+// frees the oldest one for every new one.
+template <class AllocatorT, Distribution dist>
+void SizeDistributionBench(benchmark::State &state) {  // NOLINT
+  if (state.thread_index() == 0) {
+    shared_alloc<AllocatorT> =
+        shm::memory::new_local_allocator<AllocatorT>(HEAP_SIZE);
+  }
+  auto sizes = message_sizes(dist, state.thread_index());
+  std::deque<uint8_t *> in_flight;
+  size_t i = 0;
+  int64_t failed = 0;
+  for (auto _ : state) {
+    auto *alloc = shared_alloc<AllocatorT>;
+    if (in_flight.size() == 64) {
+      alloc->free(in_flight.front());
+      in_flight.pop_front();
+    }
+    uint8_t *ptr = alloc->alloc(sizes[i++ & (sizes.size() - 1)]);
+    if (ptr == nullptr) {
+      failed++;
+      continue;
+    }
+    in_flight.push_back(ptr);
+  }
+  if (state.thread_index() == 0) {
+    // Blocks still in flight go with the heap.
+    free(shared_alloc<AllocatorT>);
+  }
+  state.counters["failed"] = failed;
+  state.SetItemsProcessed(state.iterations());
+}
+
+#define SHM_ALLOC_BENCHMARK(a)                      \
+  BENCHMARK_TEMPLATE(AllocFreeBench, a)             \
+      ->RangeMultiplier(64)                         \
+      ->Range(64, 256 * 1024)                       \
+      ->ThreadRange(1, 4)                           \
+      ->UseRealTime();
+
+#define SHM_DIST_BENCHMARK(a, d)                    \
+  BENCHMARK_TEMPLATE(SizeDistributionBench, a, d)   \
+      ->ThreadRange(1, 4)                           \
+      ->UseRealTime();
+
+SHM_ALLOC_BENCHMARK(shm::memory::Allocator);
+SHM_ALLOC_BENCHMARK(shm::memory::Allocator64);
+SHM_ALLOC_BENCHMARK(shm::memory::LocklessAllocator);
+SHM_ALLOC_BENCHMARK(shm::memory::SlabAllocator);
+
+SHM_DIST_BENCHMARK(shm::memory::Allocator, UNIFORM);
+SHM_DIST_BENCHMARK(shm::memory::LocklessAllocator, UNIFORM);
+SHM_DIST_BENCHMARK(shm::memory::SlabAllocator, UNIFORM);
+SHM_DIST_BENCHMARK(shm::memory::Allocator, BIMODAL);
+SHM_DIST_BENCHMARK(shm::memory::LocklessAllocator, BIMODAL);
+SHM_DIST_BENCHMARK(shm::memory::SlabAllocator, BIMODAL);
+SHM_DIST_BENCHMARK(shm::memory::Allocator, HEAVY_TAILED);
+SHM_DIST_BENCHMARK(shm::memory::LocklessAllocator, HEAVY_TAILED);
+SHM_DIST_BENCHMARK(shm::memory::SlabAllocator, HEAVY_TAILED);
+
+BENCHMARK_MAIN();
@@ -0,0 +1,165 @@
+/* MIT License
+
+Copyright (c) 2020 Dheeraj R Reddy
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+==============================================================================*/
+
+#include <sys/mman.h>
+#include <sys/resource.h>
+
+#include <atomic>
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifdef SINGLE_HEADER
+#include "shadesmar.h"
+#else
+#include "shadesmar/executor.h"
+#include "shadesmar/pubsub/publisher.h"
+#include "shadesmar/pubsub/subscriber.h"
+#include "shadesmar/stats.h"
+#endif
+
+// 100 topics on 4 executor workers, against a thread per subscriber. The
+// publisher sends 64 byte messages round robin over the topics, or with
+// half of them to one hot topic. CPU is the whole process, publisher
+// included.
+
+using Clock = std::chrono::steady_clock;
+
+const int TOPICS = 100;
+const int WORKERS = 4;
+const int RATE = 100000;  // messages per second, over all topics
+const auto DURATION = std::chrono::seconds(2);
+
+int64_t now_ns() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             Clock::now().time_since_epoch())
+      .count();
+}
+
+double cpu_seconds() {
+  struct rusage usage {};
+  getrusage(RUSAGE_SELF, &usage);
+  return usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6 +
+         usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+}
+
+struct Message {
+  int64_t timestamp;
+  uint8_t payload[56];
+};
+
+void run(const std::string &name, bool executor, bool hot) {
+  std::mutex mu;
+  shm::stats::Welford lag;
+  shm::stats::Percentile tail;
+  std::atomic<uint64_t> received{0};
+  auto callback = [&](shm::memory::Memblock *memblock) {
+    double msg_lag =
+        (now_ns() - reinterpret_cast<Message *>(memblock->ptr)->timestamp) /
+        1e3;
+    received++;
+    std::unique_lock<std::mutex> lock(mu);
+    lag.add(msg_lag);
+    tail.add(msg_lag);
+  };
+
+  std::vector<std::string> topics;
+  std::vector<std::unique_ptr<shm::pubsub::Publisher>> pubs;
+  for (int t = 0; t < TOPICS; ++t) {
+    topics.push_back("raw_benchmark_topic_executor_" + std::to_string(t));
+    pubs.push_back(std::make_unique<shm::pubsub::Publisher>(topics[t]));
+  }
+
+  shm::Executor exec(WORKERS);
+  std::vector<std::unique_ptr<shm::pubsub::Subscriber>> subs;
+  std::vector<std::thread> threads;
+  for (auto &topic : topics) {
+    auto sub = std::make_unique<shm::pubsub::Subscriber>(topic, callback);
+    if (executor) {
+      exec.add(std::move(sub));
+    } else {
+      subs.push_back(std::move(sub));
+    }
+  }
+  if (executor) {
+    threads.emplace_back([&exec]() { exec.spin(); });
+  } else {
+    for (auto &sub : subs) {
+      threads.emplace_back([&sub]() { sub->spin(); });
+    }
+  }
+
+  double cpu_start = cpu_seconds();
+  Message msg{};
+  uint64_t sent = 0;
+  auto interval = std::chrono::nanoseconds(1000000000 / RATE);
+  auto start = Clock::now();
+  auto next = start;
+  while (next < start + DURATION) {
+    int topic = (hot && sent % 2 == 0) ? 0 : sent % TOPICS;
+    msg.timestamp = now_ns();
+    pubs[topic]->publish(&msg, sizeof(msg));
+    sent++;
+    next += interval;
+    while (Clock::now() < next) {
+    }
+  }
+  std::this_thread::sleep_for(std::chrono::milliseconds(50));
+  double wall = std::chrono::duration<double>(Clock::now() - start).count();
+  double cpu = cpu_seconds() - cpu_start;
+
+  if (executor) {
+    exec.stop();
+  } else {
+    for (auto &sub : subs) {
+      sub->stop();
+    }
+  }
+  for (auto &th : threads) {
+    th.join();
+  }
+  for (auto &topic : topics) {
+    shm_unlink(("/SHM_" + topic).c_str());
+  }
+
+  std::cout << std::left << std::setw(22) << name << std::right
+            << " | received " << received << "/" << sent << " | lag " << lag
+            << " | p50 " << tail.get(50) << " p99 " << tail.get(99)
+            << " | cpu " << std::fixed << std::setprecision(2) << cpu / wall
+            << " cores" << std::defaultfloat << std::setprecision(6)
+            << std::endl;
+}
+
+int main() {
+  std::cout << TOPICS << " topics, " << RATE << " msg/s, time unit = us"
+            << std::endl;
+  run("thread per topic", false, false);
+  run("executor", true, false);
+  run("thread per topic, hot", false, true);
+  run("executor, hot", true, true);
+}
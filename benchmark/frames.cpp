@@ -0,0 +1,110 @@
+/* MIT License
+
+Copyright (c) 2020 Dheeraj R Reddy
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+==============================================================================*/
+
+#include <benchmark/benchmark.h>
+
+#include <cstdlib>
+#include <random>
+#include <vector>
+
+#include "shadesmar/memory/allocator.h"
+#include "shadesmar/memory/buddy_allocator.h"
+
+// Large frames of varying size (camera images, point clouds) through the
+// ring allocator and the buddy allocator.
+
+#define HEAP_SIZE (256 * 1024 * 1024)
+#define MIN_FRAME (1024 * 1024)
+#define MAX_FRAME (16 * 1024 * 1024)
+
+/*
+ * Keeps up to `state.range(0)` frames in flight. Every iteration releases a
+ * random one of them (several subscribers or topics let go of frames in
+ * any order) and allocates a new frame. If the frame doesn't fit, more
+ * frames are released until it does.
+ *
+ * Counters:
+ *  - failed: failed allocations per frame.
+ *  - free_at_failure: free memory of the heap when an allocation failed,
+ *    as a fraction of the heap. Memory that is free but can't be used is
+ *    the fragmentation.
+ *  - in_flight: average size of the frames in flight, as a fraction of
+ *    the heap.
+ */
+template <class AllocatorT>
+void FramesBench(benchmark::State &state) {  // NOLINT
+  auto *alloc = shm::memory::new_local_allocator<AllocatorT>(HEAP_SIZE);
+  size_t max_in_flight = state.range(0);
+
+  std::mt19937 gen(0);
+  std::uniform_int_distribution<uint32_t> frame_size(MIN_FRAME, MAX_FRAME);
+  std::vector<std::pair<uint8_t *, uint32_t>> frames;
+
+  int64_t failed = 0;
+  double free_at_failure = 0, in_flight = 0;
+  size_t bytes_in_flight = 0;
+  auto release_one = [&]() {
+    size_t victim = gen() % frames.size();
+    alloc->free(frames[victim].first);
+    bytes_in_flight -= frames[victim].second;
+    frames[victim] = frames.back();
+    frames.pop_back();
+  };
+
+  for (auto _ : state) {
+    if (frames.size() == max_in_flight) {
+      release_one();
+    }
+
+    uint32_t size = frame_size(gen);
+    uint8_t *ptr;
+    while ((ptr = alloc->alloc(size)) == nullptr) {
+      failed++;
+      free_at_failure +=
+          static_cast<double>(alloc->get_free_memory()) / HEAP_SIZE;
+      if (frames.empty()) {
+        // Doesn't fit even in an empty heap, nothing is recorded.
+        break;
+      }
+      release_one();
+    }
+    if (ptr != nullptr) {
+      frames.emplace_back(ptr, size);
+      bytes_in_flight += size;
+    }
+    in_flight += static_cast<double>(bytes_in_flight) / HEAP_SIZE;
+  }
+  free(alloc);
+
+  state.counters["failed"] = static_cast<double>(failed) / state.iterations();
+  state.counters["free_at_failure"] = failed ? free_at_failure / failed : 0;
+  state.counters["in_flight"] = in_flight / state.iterations();
+  state.SetItemsProcessed(state.iterations());
+}
+
+BENCHMARK_TEMPLATE(FramesBench, shm::memory::Allocator)
+    ->DenseRange(4, 28, 8);
+BENCHMARK_TEMPLATE(FramesBench, shm::memory::BuddyAllocator)
+    ->DenseRange(4, 28, 8);
+
+BENCHMARK_MAIN();
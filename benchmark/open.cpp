@@ -0,0 +1,133 @@
+/* MIT License
+
+Copyright (c) 2020 Dheeraj R Reddy
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+==============================================================================*/
+
+#include <sys/mman.h>
+
+#include <chrono>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifdef SINGLE_HEADER
+#include "shadesmar.h"
+#else
+#include "shadesmar/pubsub/publisher.h"
+#include "shadesmar/pubsub/subscriber.h"
+#include "shadesmar/stats.h"
+#endif
+
+// Latency of opening topics from many threads in parallel: first creating
+// N distinct topics, then N participants joining the same topic.
+
+using Clock = std::chrono::steady_clock;
+
+const char topic_prefix[] = "raw_benchmark_topic_open_";
+
+void report(const std::string &name, std::vector<double> *latencies) {
+  shm::stats::Welford welford;
+  shm::stats::Percentile percentile;
+  for (auto latency : *latencies) {
+    welford.add(latency);
+    percentile.add(latency);
+  }
+  std::cout << name << ": " << welford << " | p50 " << percentile.get(50)
+            << " p99 " << percentile.get(99) << " max " << percentile.get(100)
+            << std::endl;
+}
+
+template <class OpenFn>
+void parallel_open(int n_threads, int n_rounds, OpenFn open_fn,
+                   std::vector<double> *latencies) {
+  latencies->assign(n_threads * n_rounds, 0.0);
+  for (int round = 0; round < n_rounds; ++round) {
+    std::vector<std::thread> threads;
+    for (int t = 0; t < n_threads; ++t) {
+      threads.emplace_back([&, t]() {
+        auto start = Clock::now();
+        auto pub = open_fn(round, t);
+        auto end = Clock::now();
+        (*latencies)[round * n_threads + t] =
+            std::chrono::duration_cast<std::chrono::nanoseconds>(end - start)
+                .count() /
+            1e3;
+      });
+    }
+    for (auto &th : threads) {
+      th.join();
+    }
+  }
+}
+
+std::string topic_name(int round, int idx) {
+  return topic_prefix + std::to_string(round) + "_" + std::to_string(idx);
+}
+
+int main() {
+  const int N_THREADS = 32;
+  const int N_ROUNDS = 10;
+
+  shm::memory::Options options;
+  options.queue_size = 64;
+  options.buffer_size = 64 * 1024;
+
+  std::cout << "Threads = " << N_THREADS << std::endl
+            << "Time unit = us" << std::endl;
+
+  std::vector<double> latencies;
+
+  parallel_open(
+      N_THREADS, N_ROUNDS,
+      [&](int round, int t) {
+        return std::make_unique<shm::pubsub::Publisher>(topic_name(round, t),
+                                                        nullptr, options);
+      },
+      &latencies);
+  report("create distinct topics", &latencies);
+
+  // The segments exist now, so every open is a join.
+  parallel_open(
+      N_THREADS, N_ROUNDS,
+      [&](int round, int t) {
+        return std::make_unique<shm::pubsub::Publisher>(topic_name(round, t),
+                                                        nullptr, options);
+      },
+      &latencies);
+  report("join distinct topics", &latencies);
+
+  parallel_open(
+      N_THREADS, N_ROUNDS,
+      [&](int round, int t) {
+        return std::make_unique<shm::pubsub::Publisher>(
+            topic_name(round, N_THREADS), nullptr, options);
+      },
+      &latencies);
+  report("create/join same topic", &latencies);
+
+  for (int round = 0; round < N_ROUNDS; ++round) {
+    for (int t = 0; t <= N_THREADS; ++t) {
+      shm_unlink(("/SHM_" + topic_name(round, t)).c_str());
+    }
+  }
+}
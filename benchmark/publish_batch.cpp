@@ -0,0 +1,73 @@
+/* MIT License
+
+Copyright (c) 2020 Dheeraj R Reddy
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+==============================================================================*/
+
+#include <benchmark/benchmark.h>
+
+#include <string>
+#include <vector>
+
+#include "shadesmar/pubsub/publisher.h"
+
+// Messages/sec of small messages through `publish` and `publish_batch`.
+// There are no subscribers, only the publisher's side is measured.
+
+#define MESSAGE_SIZE 64
+#define QUEUE_SIZE 1024
+
+shm::pubsub::Publisher new_publisher(const std::string &topic) {
+  shm::memory::Options options;
+  options.queue_size = QUEUE_SIZE;
+  return shm::pubsub::Publisher(topic, nullptr, options);
+}
+
+void PublishBench(benchmark::State &state) {  // NOLINT
+  auto pub = new_publisher("publish_bench");
+  std::vector<uint8_t> message(MESSAGE_SIZE);
+  for (auto _ : state) {
+    if (!pub.publish(message.data(), message.size())) {
+      state.SkipWithError("publish failed");
+      break;
+    }
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+
+// `state.range(0)` messages per batch.
+void PublishBatchBench(benchmark::State &state) {  // NOLINT
+  auto pub = new_publisher("publish_batch_bench");
+  std::vector<uint8_t> message(MESSAGE_SIZE);
+  std::vector<shm::memory::Memblock> batch(
+      state.range(0), shm::memory::Memblock(message.data(), message.size()));
+  for (auto _ : state) {
+    if (!pub.publish_batch(batch)) {
+      state.SkipWithError("publish_batch failed");
+      break;
+    }
+  }
+  state.SetItemsProcessed(state.iterations() * batch.size());
+}
+
+BENCHMARK(PublishBench);
+BENCHMARK(PublishBatchBench)->RangeMultiplier(4)->Range(1, QUEUE_SIZE);
+
+BENCHMARK_MAIN();
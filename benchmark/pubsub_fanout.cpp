@@ -0,0 +1,127 @@
+/* MIT License
+
+Copyright (c) 2020 Dheeraj R Reddy
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+==============================================================================*/
+
+#include <sys/mman.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifdef SINGLE_HEADER
+#include "shadesmar.h"
+#else
+#include "shadesmar/pubsub/publisher.h"
+#include "shadesmar/pubsub/subscriber.h"
+#include "shadesmar/stats.h"
+#endif
+
+// Per-message latency of one publisher fanning out small messages to a
+// growing number of subscribers, each spinning on its own thread.
+
+using Clock = std::chrono::steady_clock;
+
+struct Message {
+  uint64_t count;
+  int64_t timestamp;
+};
+
+int64_t now_ns() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             Clock::now().time_since_epoch())
+      .count();
+}
+
+void run(int seconds, int n_subs, size_t vector_size,
+         std::chrono::microseconds interval) {
+  const std::string topic =
+      "raw_benchmark_topic_fanout_" + std::to_string(n_subs);
+
+  std::mutex mu;
+  shm::stats::Welford lag;
+  shm::stats::Percentile tail;
+
+  std::vector<std::unique_ptr<shm::pubsub::Subscriber>> subs;
+  for (int s = 0; s < n_subs; ++s) {
+    auto callback = [&](shm::memory::Memblock *memblock) {
+      auto *msg = reinterpret_cast<Message *>(memblock->ptr);
+      double msg_lag = (now_ns() - msg->timestamp) / 1e3;
+      std::unique_lock<std::mutex> lock(mu);
+      lag.add(msg_lag);
+      tail.add(msg_lag);
+    };
+    subs.push_back(
+        std::make_unique<shm::pubsub::Subscriber>(topic, callback));
+  }
+
+  std::vector<std::thread> threads;
+  for (auto &sub : subs) {
+    threads.emplace_back([&sub]() { sub->spin(); });
+  }
+
+  auto *rawptr = malloc(vector_size);
+  std::memset(rawptr, 255, vector_size);
+  auto *msg = reinterpret_cast<Message *>(rawptr);
+  msg->count = 0;
+
+  shm::pubsub::Publisher pub(topic);
+  auto start = Clock::now();
+  auto next = start;
+  while (next < start + std::chrono::seconds(seconds)) {
+    msg->count++;
+    msg->timestamp = now_ns();
+    pub.publish(msg, vector_size);
+    next += interval;
+    while (Clock::now() < next) {
+    }
+  }
+
+  for (auto &sub : subs) {
+    sub->stop();
+  }
+  for (auto &th : threads) {
+    th.join();
+  }
+  free(rawptr);
+  shm_unlink(("/SHM_" + topic).c_str());
+
+  std::cout << n_subs << " subscribers | lag " << lag << " | p50 "
+            << tail.get(50) << " p99 " << tail.get(99) << std::endl;
+}
+
+int main() {
+  const int SECONDS = 3;
+  const size_t VECTOR_SIZE = 64;
+  const auto INTERVAL = std::chrono::microseconds(20);
+
+  std::cout << "Number of bytes = " << VECTOR_SIZE << std::endl
+            << "Time unit = us" << std::endl;
+  for (int n_subs : {1, 2, 4, 8}) {
+    run(SECONDS, n_subs, VECTOR_SIZE, INTERVAL);
+  }
+}
@@ -0,0 +1,113 @@
+/* MIT License
+
+Copyright (c) 2020 Dheeraj R Reddy
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+==============================================================================*/
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifdef SINGLE_HEADER
+#include "shadesmar.h"
+#else
+#include "shadesmar/memory/memory.h"
+#include "shadesmar/pubsub/publisher.h"
+#include "shadesmar/pubsub/subscriber.h"
+#include "shadesmar/stats.h"
+#endif
+
+// Compares copy throughput and tail latency of a topic backed by regular
+// 4kb pages against one backed by huge pages.
+
+struct Message {
+  uint64_t count;
+  uint64_t timestamp;
+};
+
+void run(int seconds, size_t vector_size, bool huge_pages) {
+  const std::string topic = "raw_benchmark_topic_huge_pages_" +
+                            std::to_string(vector_size) +
+                            (huge_pages ? "_huge" : "_small");
+
+  shm::memory::Options options;
+  options.queue_size = 16;
+  options.buffer_size = 2 * options.queue_size * (vector_size + 64);
+  options.huge_pages = huge_pages;
+
+  shm::stats::Welford lag;
+  shm::stats::Percentile tail;
+  uint64_t bytes = 0;
+
+  auto callback = [&](shm::memory::Memblock *memblock) {
+    auto *msg = reinterpret_cast<Message *>(memblock->ptr);
+    double msg_lag = shm::current_time() - msg->timestamp;
+    lag.add(msg_lag);
+    tail.add(msg_lag);
+    bytes += memblock->size;
+  };
+
+  shm::pubsub::Publisher pub(topic, nullptr, options);
+  shm::pubsub::Subscriber sub(topic, callback);
+  std::thread sub_thread([&]() { sub.spin(); });
+
+  auto *rawptr = malloc(vector_size);
+  std::memset(rawptr, 255, vector_size);
+  auto *msg = reinterpret_cast<Message *>(rawptr);
+  msg->count = 0;
+
+  auto start = std::chrono::steady_clock::now();
+  for (auto now = start; now < start + std::chrono::seconds(seconds);
+       now = std::chrono::steady_clock::now()) {
+    msg->count++;
+    msg->timestamp = shm::current_time();
+    pub.publish(msg, vector_size);
+  }
+  sub.stop();
+  sub_thread.join();
+  free(rawptr);
+
+  double mb_per_sec = bytes / (1024.0 * 1024.0) / seconds;
+  std::cout << (huge_pages ? "huge pages" : "4kb pages ") << " | "
+            << vector_size << " bytes | " << mb_per_sec << " MB/s | lag "
+            << lag << " | p50 " << tail.get(50) << " p99 " << tail.get(99)
+            << " p99.9 " << tail.get(99.9) << std::endl;
+
+  shm_unlink(("/SHM_" + topic).c_str());
+  unlink((options.hugetlbfs_mount + "/SHM_" + topic).c_str());
+}
+
+int main() {
+  const int SECONDS = 5;
+  const std::vector<size_t> VECTOR_SIZES = {32 * 1024, 1024 * 1024,
+                                            8 * 1024 * 1024};
+  std::cout << "Time unit = " << TIMESCALE_NAME << std::endl;
+  for (auto vector_size : VECTOR_SIZES) {
+    run(SECONDS, vector_size, false);
+    run(SECONDS, vector_size, true);
+  }
+}
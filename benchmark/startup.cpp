@@ -0,0 +1,107 @@
+/* MIT License
+
+Copyright (c) 2020 Dheeraj R Reddy
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+==============================================================================*/
+
+#include <sys/mman.h>
+
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#ifdef SINGLE_HEADER
+#include "shadesmar.h"
+#else
+#include "shadesmar/memory/memory.h"
+#include "shadesmar/pubsub/publisher.h"
+#include "shadesmar/pubsub/subscriber.h"
+#include "shadesmar/stats.h"
+#endif
+
+// Time-to-first-message on a fresh topic, with the segment faulted in
+// lazily, pre-faulted at open time, and pre-faulted + locked.
+
+using Clock = std::chrono::steady_clock;
+
+double elapsed_us(Clock::time_point start) {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() -
+                                                              start)
+             .count() /
+         1e3;
+}
+
+void run(const std::string &mode, const shm::memory::Options &options,
+         size_t vector_size, int iterations) {
+  shm::stats::Welford open_time, first_msg, second_msg;
+
+  auto *data = malloc(vector_size);
+  std::memset(data, 255, vector_size);
+
+  for (int iter = 0; iter < iterations; ++iter) {
+    const std::string topic = "raw_benchmark_topic_startup_" + mode;
+    shm_unlink(("/SHM_" + topic).c_str());
+
+    bool received = false;
+    auto callback = [&received](shm::memory::Memblock *) { received = true; };
+
+    auto start = Clock::now();
+    shm::pubsub::Publisher pub(topic, nullptr, options);
+    shm::pubsub::Subscriber sub(topic, callback, nullptr, options);
+    open_time.add(elapsed_us(start));
+
+    for (auto *stat : {&first_msg, &second_msg}) {
+      received = false;
+      start = Clock::now();
+      pub.publish(data, vector_size);
+      while (!received) {
+        sub.spin_once();
+      }
+      stat->add(elapsed_us(start));
+    }
+    shm_unlink(("/SHM_" + topic).c_str());
+  }
+  free(data);
+
+  std::cout << mode << std::endl
+            << "  open:           " << open_time << std::endl
+            << "  first message:  " << first_msg << std::endl
+            << "  second message: " << second_msg << std::endl;
+}
+
+int main() {
+  const int ITERATIONS = 20;
+  const size_t VECTOR_SIZE = 4 * 1024 * 1024;
+
+  shm::memory::Options options;
+  options.queue_size = 16;
+  options.buffer_size = 64 * 1024 * 1024;
+
+  std::cout << "Number of bytes = " << VECTOR_SIZE << std::endl
+            << "Time unit = us" << std::endl;
+
+  run("lazy", options, VECTOR_SIZE, ITERATIONS);
+  options.prefault = true;
+  run("prefault", options, VECTOR_SIZE, ITERATIONS);
+  options.lock_memory = true;
+  run("prefault_mlock", options, VECTOR_SIZE, ITERATIONS);
+}
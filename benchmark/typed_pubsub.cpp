@@ -0,0 +1,99 @@
+/* MIT License
+
+Copyright (c) 2020 Dheeraj R Reddy
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+==============================================================================*/
+
+
+#include <benchmark/benchmark.h>
+
+#include <cstring>
+#include <string>
+
+#include "shadesmar/pubsub/publisher.h"
+#include "shadesmar/pubsub/subscriber.h"
+#include "shadesmar/pubsub/typed_publisher.h"
+#include "shadesmar/pubsub/typed_subscriber.h"
+
+// A message published and read back on the same thread, through a typed
+// topic and through a regular one, for messages of 8 bytes to 1kb.
+
+template <size_t Size>
+struct Message {
+  uint8_t data[Size];
+};
+
+template <size_t Size>
+void TypedBench(benchmark::State &state) {  // NOLINT
+  std::string topic = "typed_bench_" + std::to_string(Size);
+  Message<Size> message{};
+  uint64_t received = 0;
+  shm::pubsub::TypedPublisher<Message<Size>> pub(topic);
+  shm::pubsub::TypedSubscriber<Message<Size>> sub(
+      topic, [&received](const Message<Size> &msg) {
+        benchmark::DoNotOptimize(msg.data[0]);
+        received++;
+      });
+  for (auto _ : state) {
+    message.data[0]++;
+    pub.publish(message);
+    sub.spin_once();
+  }
+  if (received != state.iterations()) {
+    state.SkipWithError("lost messages");
+  }
+  state.SetItemsProcessed(state.iterations());
+  state.SetBytesProcessed(state.iterations() * Size);
+}
+
+template <size_t Size>
+void RawBench(benchmark::State &state) {  // NOLINT
+  std::string topic = "raw_bench_" + std::to_string(Size);
+  Message<Size> message{};
+  uint64_t received = 0;
+  shm::pubsub::Publisher pub(topic);
+  shm::pubsub::Subscriber sub(
+      topic, [&received](shm::memory::Memblock *memblock) {
+        benchmark::DoNotOptimize(
+            reinterpret_cast<uint8_t *>(memblock->ptr)[0]);
+        received++;
+      });
+  for (auto _ : state) {
+    message.data[0]++;
+    pub.publish(&message, sizeof(message));
+    sub.spin_once();
+  }
+  if (received != state.iterations()) {
+    state.SkipWithError("lost messages");
+  }
+  state.SetItemsProcessed(state.iterations());
+  state.SetBytesProcessed(state.iterations() * Size);
+}
+
+#define SHM_TYPED_BENCHMARK(size)          \
+  BENCHMARK_TEMPLATE(TypedBench, size); \
+  BENCHMARK_TEMPLATE(RawBench, size);
+
+SHM_TYPED_BENCHMARK(8);
+SHM_TYPED_BENCHMARK(64);
+SHM_TYPED_BENCHMARK(256);
+SHM_TYPED_BENCHMARK(1024);
+
+BENCHMARK_MAIN();
@@ -0,0 +1,126 @@
+/* MIT License
+
+Copyright (c) 2020 Dheeraj R Reddy
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+==============================================================================*/
+
+#include <sys/mman.h>
+
+#include <atomic>
+#include <chrono>
+#include <ctime>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#ifdef SINGLE_HEADER
+#include "shadesmar.h"
+#else
+#include "shadesmar/concurrency/wait_strategy.h"
+#include "shadesmar/pubsub/publisher.h"
+#include "shadesmar/pubsub/subscriber.h"
+#include "shadesmar/stats.h"
+#endif
+
+// Latency against CPU use of a subscriber, for each wait strategy at a
+// range of publish rates. CPU use is the subscriber thread's CPU time over
+// the wall time of the run.
+
+using Clock = std::chrono::steady_clock;
+
+int64_t now_ns() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             Clock::now().time_since_epoch())
+      .count();
+}
+
+double thread_cpu_seconds() {
+  struct timespec ts {};
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void run(const std::string &name, const shm::concurrent::WaitStrategy &strategy,
+         int rate, std::chrono::milliseconds duration) {
+  const std::string topic = "raw_benchmark_topic_wait_" + name;
+
+  shm::stats::Welford lag;
+  shm::stats::Percentile tail;
+  auto callback = [&](shm::memory::Memblock *memblock) {
+    double msg_lag =
+        (now_ns() - *reinterpret_cast<int64_t *>(memblock->ptr)) / 1e3;
+    lag.add(msg_lag);
+    tail.add(msg_lag);
+  };
+
+  shm::pubsub::Publisher pub(topic);
+  shm::pubsub::Subscriber sub(topic, callback);
+  sub.set_wait_strategy(strategy);
+
+  double cpu = 0;
+  std::thread th([&]() {
+    double start = thread_cpu_seconds();
+    sub.spin();
+    cpu = thread_cpu_seconds() - start;
+  });
+
+  auto interval = std::chrono::nanoseconds(1000000000 / rate);
+  auto start = Clock::now();
+  auto next = start;
+  while (next < start + duration) {
+    std::this_thread::sleep_until(next);
+    int64_t timestamp = now_ns();
+    pub.publish(&timestamp, sizeof(timestamp));
+    next += interval;
+  }
+  // Let the last message arrive.
+  std::this_thread::sleep_for(std::chrono::milliseconds(20));
+  sub.stop();
+  th.join();
+  double wall = std::chrono::duration<double>(Clock::now() - start).count();
+  shm_unlink(("/SHM_" + topic).c_str());
+
+  std::cout << std::left << std::setw(10) << name << std::right
+            << std::setw(8) << rate << " msg/s | lag " << lag << " | p50 "
+            << tail.get(50) << " p99 " << tail.get(99) << " | cpu "
+            << std::fixed << std::setprecision(1) << 100 * cpu / wall << "%"
+            << std::defaultfloat << std::setprecision(6) << std::endl;
+}
+
+int main() {
+  const auto DURATION = std::chrono::milliseconds(1000);
+
+  std::vector<std::pair<std::string, shm::concurrent::WaitStrategy>>
+      strategies = {
+          {"spin", shm::concurrent::WaitStrategy::busy_spin()},
+          {"yield", shm::concurrent::WaitStrategy::yielding()},
+          {"block", shm::concurrent::WaitStrategy::blocking()},
+      };
+
+  std::cout << "Time unit = us" << std::endl;
+  for (int rate : {100, 1000, 10000, 100000}) {
+    for (auto &strategy : strategies) {
+      run(strategy.first, strategy.second, rate, DURATION);
+    }
+  }
+}
@@ -40,19 +40,21 @@ class CondVar {
   void reset();
 
  private:
-  pthread_condattr_t attr;
+  void init();
+
   pthread_cond_t cond;
 };
 
-CondVar::CondVar() {
+CondVar::CondVar() { init(); }
+
+CondVar::~CondVar() { pthread_cond_destroy(&cond); }
+
+void CondVar::init() {
+  pthread_condattr_t attr;
   pthread_condattr_init(&attr);
   pthread_condattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
   pthread_cond_init(&cond, &attr);
-}
-
-CondVar::~CondVar() {
   pthread_condattr_destroy(&attr);
-  pthread_cond_destroy(&cond);
 }
 
 void CondVar::wait(PthreadWriteLock *lock) {
@@ -63,7 +65,7 @@ void CondVar::signal() { pthread_cond_signal(&cond); }
 
 void CondVar::reset() {
   pthread_cond_destroy(&cond);
-  pthread_cond_init(&cond, &attr);
+  init();
 }
 
 }  // namespace shm::concurrent
@@ -0,0 +1,243 @@
+/* MIT License
+
+Copyright (c) 2020 Dheeraj R Reddy
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+==============================================================================*/
+
+#ifndef INCLUDE_SHADESMAR_CONCURRENCY_FD_BRIDGE_H_
+#define INCLUDE_SHADESMAR_CONCURRENCY_FD_BRIDGE_H_
+
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "shadesmar/concurrency/futex.h"
+#include "shadesmar/concurrency/waiters.h"
+
+namespace shm::concurrent {
+
+/*
+ * Turns futex words in shared memory (the counters of topics) into file
+ * descriptors that an event loop can `epoll_wait` on. Each watched word
+ * gets an eventfd, and a thread per process sleeps on all of the words at
+ * once with `futex_waitv`. Whenever a word changes, its eventfd is
+ * signalled. `futex_waitv` takes 128 words, one of which is the thread's
+ * own wake-up word, so every 127 words get another thread.
+ *
+ * The thread counts itself in the waiters of each word only while it is
+ * in `futex_waitv`, like `memory::SharedQueue::wait`, so writers skip
+ * FUTEX_WAKE while it handles a change. Without `futex_waitv` it polls,
+ * and doesn't count itself at all.
+ */
+class FdBridge {
+ public:
+  // Returns a non-blocking eventfd for `word`, or -1 on failure. The fd
+  // starts out readable, in case `word` moved before it was watched.
+  static int add(std::atomic<uint32_t> *word, Waiters *waiters);
+  // Stops watching and closes `fd`.
+  static void remove(int fd);
+
+  FdBridge();
+  FdBridge(const FdBridge &) = delete;
+  ~FdBridge();
+
+ private:
+  static constexpr size_t MAX_WATCHES = FUTEX_WAITV_MAX_WORDS - 1;
+
+  struct Watch {
+    std::atomic<uint32_t> *word;
+    Waiters *waiters;
+    int fd;
+    uint32_t seen;
+    // The slot in `waiters` while the thread sleeps, see `lower`.
+    bool raised;
+    int slot;
+  };
+
+  struct Registry {
+    std::mutex mutex;
+    std::vector<std::unique_ptr<FdBridge>> bridges;
+  };
+
+  // Never destroyed, subscribers with static storage may outlive it.
+  static Registry &registry() {
+    static auto *registry = new Registry;
+    return *registry;
+  }
+
+  static void signal(int fd) {
+    uint64_t one = 1;
+    if (write(fd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+      std::cerr << "Could not signal eventfd: " << std::strerror(errno)
+                << std::endl;
+    }
+  }
+
+  void wake() {
+    wake_++;
+    futex_wake(&wake_);
+  }
+
+  static void lower(Watch *watch) {
+    if (watch->raised) {
+      watch->waiters->leave(watch->slot);
+      watch->raised = false;
+    }
+  }
+
+  void run();
+
+  const uint32_t pid_ = getpid();
+  std::mutex mutex_;
+  std::vector<Watch> watches_;
+  std::atomic<uint32_t> wake_{0};
+  std::atomic_bool running_{true};
+  std::thread thread_;
+};
+
+FdBridge::FdBridge() { thread_ = std::thread([this]() { run(); }); }
+
+FdBridge::~FdBridge() {
+  running_ = false;
+  wake();
+  thread_.join();
+  for (auto &watch : watches_) {
+    lower(&watch);
+    close(watch.fd);
+  }
+}
+
+int FdBridge::add(std::atomic<uint32_t> *word, Waiters *waiters) {
+  int fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (fd < 0) {
+    std::cerr << "Could not create eventfd: " << std::strerror(errno)
+              << std::endl;
+    return -1;
+  }
+  signal(fd);
+
+  auto &reg = registry();
+  std::unique_lock<std::mutex> reg_lock(reg.mutex);
+  FdBridge *bridge = nullptr;
+  uint32_t pid = getpid();
+  for (auto &b : reg.bridges) {
+    // Bridges copied by `fork` have no thread.
+    if (b->pid_ != pid) {
+      continue;
+    }
+    std::unique_lock<std::mutex> lock(b->mutex_);
+    if (b->watches_.size() < MAX_WATCHES) {
+      bridge = b.get();
+      break;
+    }
+  }
+  if (bridge == nullptr) {
+    reg.bridges.push_back(std::make_unique<FdBridge>());
+    bridge = reg.bridges.back().get();
+  }
+
+  {
+    std::unique_lock<std::mutex> lock(bridge->mutex_);
+    bridge->watches_.push_back({word, waiters, fd, word->load(), false, 0});
+  }
+  bridge->wake();
+  return fd;
+}
+
+void FdBridge::remove(int fd) {
+  auto &reg = registry();
+  std::unique_lock<std::mutex> reg_lock(reg.mutex);
+  for (auto &bridge : reg.bridges) {
+    std::unique_lock<std::mutex> lock(bridge->mutex_);
+    auto &watches = bridge->watches_;
+    for (auto it = watches.begin(); it != watches.end(); ++it) {
+      if (it->fd == fd) {
+        // Once this returns, the bridge won't touch the word anymore.
+        lower(&*it);
+        watches.erase(it);
+        lock.unlock();
+        bridge->wake();
+        close(fd);
+        return;
+      }
+    }
+  }
+}
+
+void FdBridge::run() {
+  std::vector<FutexWaitv> waitv;
+  bool polling = false;
+  while (running_.load()) {
+    waitv.clear();
+    waitv.push_back(futex_waitv_entry(&wake_, wake_.load()));
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      for (auto &watch : watches_) {
+        uint32_t value = watch.word->load();
+        if (value != watch.seen) {
+          watch.seen = value;
+          signal(watch.fd);
+        }
+        // A writer that moves the word after the load may not see us
+        // counted, but then the kernel won't let us sleep.
+        if (!polling) {
+          watch.slot = watch.waiters->enter(pid_);
+          watch.raised = true;
+        }
+        waitv.push_back(futex_waitv_entry(watch.word, value));
+      }
+    }
+
+    /*
+     * A word removed after the unlock may be unmapped by now, the kernel
+     * then fails with EFAULT, and the next round leaves it out. Removing
+     * also bumps `wake_` and lowers the count, so neither the wait nor
+     * the count can outlive the word.
+     */
+    if (futex_waitv(waitv.data(), waitv.size()) < 0 && errno == ENOSYS) {
+      polling = true;
+    }
+
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      for (auto &watch : watches_) {
+        lower(&watch);
+      }
+    }
+    if (polling) {
+      // Before Linux 5.16, poll instead.
+      std::this_thread::sleep_for(std::chrono::microseconds(100));
+    }
+  }
+}
+
+}  // namespace shm::concurrent
+
+#endif  // INCLUDE_SHADESMAR_CONCURRENCY_FD_BRIDGE_H_
@@ -0,0 +1,99 @@
+/* MIT License
+
+Copyright (c) 2020 Dheeraj R Reddy
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+==============================================================================*/
+
+#ifndef INCLUDE_SHADESMAR_CONCURRENCY_FUTEX_H_
+#define INCLUDE_SHADESMAR_CONCURRENCY_FUTEX_H_
+
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <chrono>
+#include <cerrno>
+#include <climits>
+#include <cstdint>
+#include <ctime>
+
+#ifndef SYS_futex_waitv
+#define SYS_futex_waitv 449
+#endif
+
+namespace shm::concurrent {
+
+// Thin wrappers over the futex syscall. The futex word lives in shared
+// memory, so these use the process-shared (non-private) variants.
+
+// Blocks while `*addr == expected`, for at most `timeout` if it is
+// non-zero. Returns false on timeout.
+inline bool futex_wait(std::atomic<uint32_t> *addr, uint32_t expected,
+                       std::chrono::nanoseconds timeout =
+                           std::chrono::nanoseconds::zero()) {
+  struct timespec ts {};
+  struct timespec *ts_ptr = nullptr;
+  if (timeout.count() > 0) {
+    ts.tv_sec = timeout.count() / 1000000000;
+    ts.tv_nsec = timeout.count() % 1000000000;
+    ts_ptr = &ts;
+  }
+  long result =  // NOLINT
+      syscall(SYS_futex, reinterpret_cast<uint32_t *>(addr), FUTEX_WAIT,
+              expected, ts_ptr, nullptr, 0);
+  return !(result == -1 && errno == ETIMEDOUT);
+}
+
+// Returns the number of threads woken.
+inline int futex_wake(std::atomic<uint32_t> *addr, int count = INT_MAX) {
+  long result =  // NOLINT
+      syscall(SYS_futex, reinterpret_cast<uint32_t *>(addr), FUTEX_WAKE,
+              count, nullptr, nullptr, 0);
+  return result < 0 ? 0 : static_cast<int>(result);
+}
+
+// `struct futex_waitv`, which older kernel headers don't have.
+struct FutexWaitv {
+  uint64_t val;
+  uint64_t uaddr;
+  uint32_t flags;
+  uint32_t reserved;
+};
+
+static constexpr uint32_t FUTEX_WAITV_MAX_WORDS = 128;
+static constexpr uint32_t FUTEX_WAITV_U32 = 2;
+
+// Shared, like `futex_wait`, so `futex_wake` reaches it.
+inline FutexWaitv futex_waitv_entry(std::atomic<uint32_t> *addr,
+                                    uint32_t expected) {
+  return {expected, reinterpret_cast<uint64_t>(addr), FUTEX_WAITV_U32, 0};
+}
+
+// Blocks until any of the `count` words no longer holds its `val`. Returns
+// the index of the word that woke it, or -1 with `errno` set: EAGAIN if a
+// word had already changed, ENOSYS before Linux 5.16.
+inline long futex_waitv(FutexWaitv *waiters, uint32_t count) {  // NOLINT
+  return syscall(SYS_futex_waitv, waiters, count, 0, nullptr, 0);
+}
+
+}  // namespace shm::concurrent
+
+#endif  // INCLUDE_SHADESMAR_CONCURRENCY_FUTEX_H_
@@ -44,11 +44,19 @@ class PthreadWriteLock {
   pthread_mutex_t *get_mutex() { return &mutex; }
 
  private:
+  void init();
+
+  // The attributes are only needed during `init`, so they aren't kept in
+  // (shared) memory next to the mutex.
   pthread_mutex_t mutex{};
-  pthread_mutexattr_t attr{};
 };
 
-PthreadWriteLock::PthreadWriteLock() {
+PthreadWriteLock::PthreadWriteLock() { init(); }
+
+PthreadWriteLock::~PthreadWriteLock() { pthread_mutex_destroy(&mutex); }
+
+void PthreadWriteLock::init() {
+  pthread_mutexattr_t attr;
   pthread_mutexattr_init(&attr);
   pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_NORMAL);
   pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
@@ -56,11 +64,7 @@ PthreadWriteLock::PthreadWriteLock() {
   pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
 #endif  // __linux__
   pthread_mutex_init(&mutex, &attr);
-}
-
-PthreadWriteLock::~PthreadWriteLock() {
   pthread_mutexattr_destroy(&attr);
-  pthread_mutex_destroy(&mutex);
 }
 
 void PthreadWriteLock::lock() {
@@ -78,7 +82,7 @@ void PthreadWriteLock::unlock() { pthread_mutex_unlock(&mutex); }
 
 void PthreadWriteLock::reset() {
   pthread_mutex_destroy(&mutex);
-  pthread_mutex_init(&mutex, &attr);
+  init();
 }
 
 }  // namespace shm::concurrent
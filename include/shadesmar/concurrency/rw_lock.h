@@ -45,18 +45,24 @@ class PthreadReadWriteLock {
   void reset();
 
  private:
+  void init();
+
+  // The attributes are only needed during `init`, so they aren't kept in
+  // (shared) memory next to the lock.
   pthread_rwlock_t rwlock{};
-  pthread_rwlockattr_t attr{};
 };
 
-PthreadReadWriteLock::PthreadReadWriteLock() {
+PthreadReadWriteLock::PthreadReadWriteLock() { init(); }
+PthreadReadWriteLock::~PthreadReadWriteLock() {
+  pthread_rwlock_destroy(&rwlock);
+}
+
+void PthreadReadWriteLock::init() {
+  pthread_rwlockattr_t attr;
   pthread_rwlockattr_init(&attr);
   pthread_rwlockattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
   pthread_rwlock_init(&rwlock, &attr);
-}
-PthreadReadWriteLock::~PthreadReadWriteLock() {
   pthread_rwlockattr_destroy(&attr);
-  pthread_rwlock_destroy(&rwlock);
 }
 
 void PthreadReadWriteLock::lock() { pthread_rwlock_wrlock(&rwlock); }
@@ -74,7 +80,7 @@ void PthreadReadWriteLock::unlock_sharable() {
 
 void PthreadReadWriteLock::reset() {
   pthread_rwlock_destroy(&rwlock);
-  pthread_rwlock_init(&rwlock, &attr);
+  init();
 }
 
 }  // namespace shm::concurrent
@@ -0,0 +1,107 @@
+/* MIT License
+
+Copyright (c) 2020 Dheeraj R Reddy
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+==============================================================================*/
+
+#ifndef INCLUDE_SHADESMAR_CONCURRENCY_WAIT_STRATEGY_H_
+#define INCLUDE_SHADESMAR_CONCURRENCY_WAIT_STRATEGY_H_
+
+#include <sched.h>
+
+#include <chrono>
+#include <cstdint>
+
+namespace shm::concurrent {
+
+inline void cpu_relax() {
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_ia32_pause();
+#elif defined(__aarch64__)
+  asm volatile("yield" ::: "memory");
+#endif
+}
+
+/*
+ * How a consumer loop (`Subscriber::spin`, `Server::serve`) waits for new
+ * work. An idle loop first busy-spins for `spin_limit` rounds, with a
+ * pause in each, then calls `sched_yield` for `yield_limit` rounds, and
+ * after that blocks on the queue's futex until woken, or for at most
+ * `block_timeout`. Any work found starts the sequence over.
+ *
+ * Spinning gives the lowest latency at a full core per loop, blocking
+ * costs a wake-up (a few microseconds) but no CPU while idle.
+ */
+struct WaitStrategy {
+  static constexpr uint64_t UNLIMITED = UINT64_MAX;
+
+  uint64_t spin_limit;
+  uint64_t yield_limit;
+  std::chrono::nanoseconds block_timeout;
+
+  // Never gives up the CPU.
+  static WaitStrategy busy_spin() {
+    return {UNLIMITED, 0, std::chrono::nanoseconds::zero()};
+  }
+
+  // Spins for a while, then keeps yielding, never sleeps.
+  static WaitStrategy yielding(uint64_t spins = 1000) {
+    return {spins, UNLIMITED, std::chrono::nanoseconds::zero()};
+  }
+
+  // Spins and yields for a while, then sleeps until woken.
+  static WaitStrategy blocking(uint64_t spins = 1000, uint64_t yields = 100,
+                               std::chrono::nanoseconds block_timeout =
+                                   std::chrono::milliseconds(10)) {
+    return {spins, yields, block_timeout};
+  }
+};
+
+// The state of one loop waiting with a `WaitStrategy`.
+class Waiter {
+ public:
+  explicit Waiter(const WaitStrategy &strategy) : strategy_(strategy) {}
+
+  // Call after finding work.
+  void reset() { rounds_ = 0; }
+
+  // Call after finding no work. `block(timeout)` has to sleep until there
+  // may be new work, or `timeout` passes.
+  template <class BlockFn>
+  void idle(BlockFn &&block) {
+    if (rounds_ < strategy_.spin_limit) {
+      ++rounds_;
+      cpu_relax();
+    } else if (rounds_ - strategy_.spin_limit < strategy_.yield_limit) {
+      ++rounds_;
+      sched_yield();
+    } else {
+      block(strategy_.block_timeout);
+    }
+  }
+
+ private:
+  WaitStrategy strategy_;
+  uint64_t rounds_ = 0;
+};
+
+}  // namespace shm::concurrent
+
+#endif  // INCLUDE_SHADESMAR_CONCURRENCY_WAIT_STRATEGY_H_
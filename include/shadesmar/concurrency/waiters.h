@@ -0,0 +1,149 @@
+/* MIT License
+
+Copyright (c) 2020 Dheeraj R Reddy
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+==============================================================================*/
+
+
+#ifndef INCLUDE_SHADESMAR_CONCURRENCY_WAITERS_H_
+#define INCLUDE_SHADESMAR_CONCURRENCY_WAITERS_H_
+
+#include <unistd.h>
+
+#include <atomic>
+#include <cstdint>
+
+#include "shadesmar/concurrency/futex.h"
+#include "shadesmar/macros.h"
+
+namespace shm::concurrent {
+
+/*
+ * Counts the threads sleeping on a futex word in shared memory, so that
+ * writers only make the FUTEX_WAKE syscall when someone sleeps.
+ *
+ * A count alone isn't crash-safe, a process killed while asleep never
+ * takes itself back out. So each sleeper is also counted in a slot of its
+ * PID. When a wake finds nobody to wake, every `REAP_INTERVAL`th time the
+ * slots of dead processes are handed back. A process that finds all slots
+ * taken by live ones is only counted in `total_`, and isn't reaped if it
+ * dies asleep.
+ *
+ * A slot is counted after `total_` and uncounted before it, so it never
+ * holds more than its process added, and reaping can't take back too
+ * much. A crash between the two leaks at most one.
+ */
+class Waiters {
+ public:
+  static constexpr uint32_t SLOTS = 5;
+  static constexpr uint32_t REAP_INTERVAL = 64;
+
+  Waiters() { reset(); }
+
+  // Before sleeping on the word: the increment of `total_` happens before
+  // the kernel compares it. Returns the slot to pass to `leave`.
+  int enter() { return enter(getpid()); }
+  int enter(uint32_t pid) {
+    total_++;
+    int slot = claim(pid);
+    if (slot >= 0) {
+      slots_[slot].count++;
+    }
+    return slot;
+  }
+
+  void leave(int slot) {
+    if (slot >= 0) {
+      slots_[slot].count--;
+    }
+    total_--;
+  }
+
+  bool any() const { return total_.load() != 0; }
+
+  // Called after every change of `word`.
+  void wake(std::atomic<uint32_t> *word) {
+    if (total_.load() == 0) {
+      return;
+    }
+    if (futex_wake(word) == 0 && ++misses_ % REAP_INTERVAL == 0) {
+      reap();
+    }
+  }
+
+  void reap() {
+    for (auto &slot : slots_) {
+      uint32_t pid = slot.pid.load();
+      if (pid == 0 || !proc_dead(pid)) {
+        continue;
+      }
+      // The dead don't count anymore, so take the count before the slot
+      // can be claimed again.
+      uint32_t count = slot.count.exchange(0);
+      if (slot.pid.compare_exchange_strong(pid, 0)) {
+        total_ -= count;
+      }
+    }
+  }
+
+  void reset() {
+    total_ = 0;
+    misses_ = 0;
+    for (auto &slot : slots_) {
+      slot.pid = 0;
+      slot.count = 0;
+    }
+  }
+
+ private:
+  struct Slot {
+    std::atomic<uint32_t> pid;
+    std::atomic<uint32_t> count;
+  };
+
+  // Slots aren't given back by live processes, so if they're all taken,
+  // look for dead ones first.
+  int claim(uint32_t pid) {
+    for (int attempt = 0; attempt < 2; ++attempt) {
+      for (uint32_t idx = 0; idx < SLOTS; ++idx) {
+        if (slots_[idx].pid.load() == pid) {
+          return idx;
+        }
+      }
+      for (uint32_t idx = 0; idx < SLOTS; ++idx) {
+        uint32_t exp = 0;
+        if (slots_[idx].pid.load() == 0 &&
+            slots_[idx].pid.compare_exchange_strong(exp, pid)) {
+          return idx;
+        }
+      }
+      reap();
+    }
+    return -1;
+  }
+
+  std::atomic<uint32_t> total_;
+  std::atomic<uint32_t> misses_;
+  Slot slots_[SLOTS];
+};
+
+}  // namespace shm::concurrent
+
+#endif  // INCLUDE_SHADESMAR_CONCURRENCY_WAITERS_H_
@@ -0,0 +1,311 @@
+/* MIT License
+
+Copyright (c) 2020 Dheeraj R Reddy
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+==============================================================================*/
+
+#ifndef INCLUDE_SHADESMAR_EXECUTOR_H_
+#define INCLUDE_SHADESMAR_EXECUTOR_H_
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "shadesmar/pubsub/subscriber.h"
+#include "shadesmar/rpc/server.h"
+
+namespace shm {
+
+/*
+ * Runs the callbacks of many subscribers and servers on a fixed pool of
+ * worker threads, instead of a thread per `spin()` / `serve()`.
+ *
+ * `spin()` waits on the file descriptors of all of them with epoll (see
+ * `Subscriber::fd()`), and queues the ready ones on their worker. Every
+ * subscriber or server has a home worker, but an idle worker steals from
+ * the others, so a hot topic doesn't hold up the rest on its worker.
+ *
+ * A subscriber or server only ever runs on one worker at a time, so the
+ * messages of a topic are handled in order. Different topics run in
+ * parallel. If new messages arrive while a topic is running, it goes to
+ * the back of the queue once it's done, instead of running again right
+ * away.
+ */
+class Executor {
+ public:
+  explicit Executor(uint32_t num_workers = std::thread::hardware_concurrency());
+  Executor(const Executor &) = delete;
+  ~Executor();
+
+  template <class AllocatorT>
+  bool add(std::unique_ptr<pubsub::SubscriberT<AllocatorT>> subscriber);
+  bool add(std::unique_ptr<rpc::Server> server);
+
+  // Dispatches callbacks until `stop()`.
+  void spin();
+  void stop();
+
+ private:
+  enum State : uint32_t {
+    IDLE,
+    QUEUED,
+    RUNNING,
+    // New messages arrived while running.
+    RUNNING_AGAIN,
+  };
+
+  struct Task {
+    std::shared_ptr<void> owner;
+    std::function<void()> run;
+    uint32_t home;
+    std::atomic<uint32_t> state{IDLE};
+  };
+
+  struct Worker {
+    std::mutex mutex;
+    std::deque<Task *> queue;
+  };
+
+  bool add(std::shared_ptr<void> owner, int fd, std::function<void()> run);
+  void ready(Task *task);
+  void push(uint32_t worker, Task *task);
+  Task *pop(uint32_t worker);
+  void work(uint32_t worker);
+
+  std::vector<std::unique_ptr<Worker>> workers_;
+  std::vector<std::thread> threads_;
+  std::mutex tasks_mutex_;
+  std::deque<std::unique_ptr<Task>> tasks_;
+
+  // Queued tasks, idle workers sleep while there are none.
+  std::atomic<uint32_t> pending_{0};
+  std::mutex idle_mutex_;
+  std::condition_variable idle_cv_;
+
+  int epoll_fd_;
+  int stop_fd_;
+  std::atomic_bool running_{false};
+};
+
+Executor::Executor(uint32_t num_workers) {
+  if (num_workers == 0) {
+    num_workers = 1;
+  }
+  for (uint32_t w = 0; w < num_workers; ++w) {
+    workers_.push_back(std::make_unique<Worker>());
+  }
+  epoll_fd_ = epoll_create1(EPOLL_CLOEXEC);
+  stop_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (epoll_fd_ < 0 || stop_fd_ < 0) {
+    std::cerr << "Could not create executor: " << std::strerror(errno)
+              << std::endl;
+    exit(1);
+  }
+  struct epoll_event event {};
+  event.events = EPOLLIN;
+  event.data.ptr = nullptr;
+  epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, stop_fd_, &event);
+}
+
+Executor::~Executor() {
+  stop();
+  close(stop_fd_);
+  close(epoll_fd_);
+}
+
+template <class AllocatorT>
+bool Executor::add(
+    std::unique_ptr<pubsub::SubscriberT<AllocatorT>> subscriber) {
+  auto *sub = subscriber.get();
+  return add(std::shared_ptr<void>(std::move(subscriber)), sub->fd(),
+             [sub]() { sub->spin_ready(); });
+}
+
+bool Executor::add(std::unique_ptr<rpc::Server> server) {
+  auto *srv = server.get();
+  return add(std::shared_ptr<void>(std::move(server)), srv->fd(),
+             [srv]() { srv->serve_ready(); });
+}
+
+bool Executor::add(std::shared_ptr<void> owner, int fd,
+                   std::function<void()> run) {
+  if (fd < 0) {
+    return false;
+  }
+  Task *task;
+  {
+    std::unique_lock<std::mutex> lock(tasks_mutex_);
+    tasks_.push_back(std::make_unique<Task>());
+    task = tasks_.back().get();
+    task->owner = std::move(owner);
+    task->run = std::move(run);
+    // Spread topics over the workers in the order they were added.
+    task->home = (tasks_.size() - 1) % workers_.size();
+  }
+
+  // Edge triggered, the eventfd fires on every signal, and `run` drains
+  // it before handling the messages.
+  struct epoll_event event {};
+  event.events = EPOLLIN | EPOLLET;
+  event.data.ptr = task;
+  if (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, fd, &event) != 0) {
+    std::cerr << "Could not add to executor: " << std::strerror(errno)
+              << std::endl;
+    return false;
+  }
+  return true;
+}
+
+void Executor::ready(Task *task) {
+  uint32_t state = task->state.load();
+  while (true) {
+    if (state == IDLE) {
+      if (task->state.compare_exchange_weak(state, QUEUED)) {
+        push(task->home, task);
+        return;
+      }
+    } else if (state == RUNNING) {
+      if (task->state.compare_exchange_weak(state, RUNNING_AGAIN)) {
+        return;
+      }
+    } else {
+      // Already queued, or will be.
+      return;
+    }
+  }
+}
+
+void Executor::push(uint32_t worker, Task *task) {
+  pending_++;
+  {
+    std::unique_lock<std::mutex> lock(workers_[worker]->mutex);
+    workers_[worker]->queue.push_back(task);
+  }
+  std::unique_lock<std::mutex> lock(idle_mutex_);
+  idle_cv_.notify_one();
+}
+
+Executor::Task *Executor::pop(uint32_t worker) {
+  // Own queue first, from the front.
+  {
+    Worker &own = *workers_[worker];
+    std::unique_lock<std::mutex> lock(own.mutex);
+    if (!own.queue.empty()) {
+      Task *task = own.queue.front();
+      own.queue.pop_front();
+      pending_--;
+      return task;
+    }
+  }
+  // Then steal from the back of the others.
+  for (uint32_t i = 1; i < workers_.size(); ++i) {
+    Worker &victim = *workers_[(worker + i) % workers_.size()];
+    std::unique_lock<std::mutex> lock(victim.mutex);
+    if (!victim.queue.empty()) {
+      Task *task = victim.queue.back();
+      victim.queue.pop_back();
+      pending_--;
+      return task;
+    }
+  }
+  return nullptr;
+}
+
+void Executor::work(uint32_t worker) {
+  while (running_.load()) {
+    Task *task = pop(worker);
+    if (task == nullptr) {
+      std::unique_lock<std::mutex> lock(idle_mutex_);
+      idle_cv_.wait_for(lock, std::chrono::milliseconds(10), [this]() {
+        return pending_.load() != 0 || !running_.load();
+      });
+      continue;
+    }
+
+    task->state.store(RUNNING);
+    task->run();
+    uint32_t state = RUNNING;
+    if (!task->state.compare_exchange_strong(state, IDLE)) {
+      // RUNNING_AGAIN, let the others go first.
+      task->state.store(QUEUED);
+      push(worker, task);
+    }
+  }
+}
+
+void Executor::spin() {
+  running_ = true;
+  for (uint32_t w = 0; w < workers_.size(); ++w) {
+    threads_.emplace_back([this, w]() { work(w); });
+  }
+
+  const int MAX_EVENTS = 64;
+  struct epoll_event events[MAX_EVENTS];
+  while (running_.load()) {
+    int n = epoll_wait(epoll_fd_, events, MAX_EVENTS, -1);
+    for (int i = 0; i < n; ++i) {
+      if (events[i].data.ptr == nullptr) {
+        // `stop()`, possibly from before `spin()` started.
+        uint64_t value;
+        while (read(stop_fd_, &value, sizeof(value)) > 0) {
+        }
+        running_ = false;
+        break;
+      }
+      ready(static_cast<Task *>(events[i].data.ptr));
+    }
+  }
+
+  {
+    std::unique_lock<std::mutex> lock(idle_mutex_);
+    idle_cv_.notify_all();
+  }
+  for (auto &thread : threads_) {
+    thread.join();
+  }
+  threads_.clear();
+}
+
+void Executor::stop() {
+  running_ = false;
+  uint64_t one = 1;
+  if (write(stop_fd_, &one, sizeof(one)) < 0) {
+    std::cerr << "Could not stop executor: " << std::strerror(errno)
+              << std::endl;
+  }
+}
+
+}  // namespace shm
+
+#endif  // INCLUDE_SHADESMAR_EXECUTOR_H_
@@ -35,6 +35,10 @@ SOFTWARE.
 #define TIMESCALE_NAME "us"
 
 namespace shm {
+// Shared structures written by different processes are padded to this, to
+// avoid false sharing.
+static constexpr size_t CACHELINE_SIZE = 64;
+
 uint64_t current_time() {
   auto time_since_epoch = std::chrono::system_clock::now().time_since_epoch();
   auto casted_time = std::chrono::duration_cast<TIMESCALE>(time_since_epoch);
@@ -25,6 +25,10 @@ SOFTWARE.
 #define INCLUDE_SHADESMAR_MEMORY_ALLOCATOR_H_
 
 #include <cassert>
+#include <cstdint>
+#include <cstdlib>
+#include <limits>
+#include <new>
 
 #include "shadesmar/concurrency/robust_lock.h"
 #include "shadesmar/concurrency/scope.h"
@@ -39,17 +43,145 @@ inline uint8_t *align_address(void *ptr, size_t alignment) {
   return reinterpret_cast<uint8_t *>(aligned_int_ptr);
 }
 
-class Allocator {
+/*
+ * The heap is a ring of blocks. Every block is a header word followed by
+ * its payload, the header holds the payload size in words. Once a block is
+ * freed, `BLOCK_FREE` is set in its header, blocks can be freed in any
+ * order. The free index only moves past the run of freed blocks at the
+ * tail of the ring. Freeing the most recent block also hands it straight
+ * back to the head, so an aborted loan doesn't wait on older messages.
+ *
+ * If the heap is mapped twice, back to back (`Options::mirrored`), the
+ * payload of a block may run past the end of the heap into the mirror, so
+ * blocks never have to restart at 0.
+ */
+template <class IndexT>
+static constexpr IndexT BLOCK_FREE = IndexT(1) << (8 * sizeof(IndexT) - 1);
+
+// `index + step` around a heap of `heap_size` words, for `step <=
+// heap_size`. Only `IndexT` arithmetic and no division, the 32-bit
+// allocators stay 32-bit.
+template <class IndexT>
+inline IndexT wrap_add(IndexT index, IndexT step, IndexT heap_size) {
+  IndexT to_end = heap_size - index;
+  return step < to_end ? index + step : step - to_end;
+}
+
+// Index of the block after the one at `header_index`.
+template <class IndexT>
+inline IndexT next_block(IndexT header_index, IndexT header,
+                         IndexT heap_size) {
+  return wrap_add<IndexT>(header_index, (header & ~BLOCK_FREE<IndexT>) + 1,
+                          heap_size);
+}
+
+// Fills [from, to) with a single freed block.
+template <class IndexT>
+inline void pad_blocks(IndexT *heap, IndexT from, IndexT to) {
+  if (from < to) {
+    __atomic_store_n(&heap[from], (to - from - 1) | BLOCK_FREE<IndexT>,
+                     __ATOMIC_RELAXED);
+  }
+}
+
+/*
+ * Finds a place for a block of `payload_size` words at `alloc_index`, with
+ * the payload aligned to `alignment`. Unless the heap is `mirrored`, blocks
+ * never wrap, if there is no room before the end of the heap the block
+ * starts at 0. Returns false if it would run into the block at
+ * `free_index`.
+ */
+template <class IndexT>
+inline bool place_block(IndexT *heap, IndexT heap_size, bool mirrored,
+                        IndexT alloc_index, IndexT free_index,
+                        IndexT payload_size, size_t alignment,
+                        IndexT *header_index, IndexT *new_alloc_index) {
+  // Words from `index` to the aligned payload of a block placed there.
+  auto gap_at = [&](IndexT index) -> IndexT {
+    auto *payload = align_address(heap + index + 1, alignment);
+    return (payload - reinterpret_cast<uint8_t *>(heap + index)) /
+           sizeof(IndexT);
+  };
+
+  IndexT available = heap_size;
+  if (free_index != alloc_index) {
+    available = free_index > alloc_index
+                    ? free_index - alloc_index
+                    : heap_size - (alloc_index - free_index);
+  }
+
+  // The block takes `gap + payload_size` words from `start`, after
+  // skipping `skipped` words at the end of the heap.
+  const IndexT to_end = heap_size - alloc_index;
+  IndexT start = alloc_index;
+  IndexT gap = gap_at(alloc_index);
+  IndexT skipped = 0;
+  if (!mirrored && (gap > to_end || payload_size > to_end - gap)) {
+    start = 0;
+    gap = gap_at(0);
+    skipped = to_end;
+  }
+
+  // `alloc_index == free_index` means empty, so never fill up completely.
+  // Subtractions only, nothing here overflows `IndexT`.
+  if (skipped >= available || gap >= available - skipped ||
+      payload_size >= available - skipped - gap) {
+    return false;
+  }
+
+  *header_index = wrap_add<IndexT>(start, gap - 1, heap_size);
+  *new_alloc_index = wrap_add<IndexT>(start, gap + payload_size, heap_size);
+  return true;
+}
+
+// Pads the gap in front of a block placed by `place_block`.
+template <class IndexT>
+inline void pad_to_block(IndexT *heap, IndexT heap_size, IndexT alloc_index,
+                         IndexT header_index) {
+  if (header_index < alloc_index) {
+    pad_blocks<IndexT>(heap, alloc_index, heap_size);
+    pad_blocks<IndexT>(heap, 0, header_index);
+  } else {
+    pad_blocks<IndexT>(heap, alloc_index, header_index);
+  }
+}
+
+/*
+ * `IndexT` is the type of the heap indices and block headers, and the unit
+ * the heap is divided in. With `uint32_t` (`Allocator`) a heap holds up to
+ * 16gb, and a message up to 8gb. `uint64_t` (`Allocator64`) lifts both
+ * limits, for the price of 8 byte headers and coarser rounding, so it is
+ * meant for the few topics that need it.
+ */
+template <class IndexT>
+class BasicAllocator {
  public:
   using handle = uint64_t;
 
   template <concurrent::ExlOrShr type>
   using Scope = concurrent::ScopeGuard<concurrent::RobustLock, type>;
 
-  Allocator(size_t offset, size_t size);
+  BasicAllocator(size_t offset, size_t size, bool mirrored = false);
+
+  // A heap that holds `blocks` blocks of up to `block_size` bytes at once,
+  // a header word each and the word that is never filled.
+  static constexpr size_t required_size(size_t blocks, size_t block_size) {
+    return blocks * (SHMALIGN(block_size, sizeof(IndexT)) + sizeof(IndexT)) +
+           sizeof(IndexT);
+  }
+
+  // The largest heap that `IndexT` can index.
+  static constexpr size_t max_size() {
+    return sizeof(IndexT) < sizeof(size_t)
+               ? size_t(std::numeric_limits<IndexT>::max()) * sizeof(IndexT)
+               : std::numeric_limits<size_t>::max();
+  }
 
-  uint8_t *alloc(uint32_t bytes);
-  uint8_t *alloc(uint32_t bytes, size_t alignment);
+  uint8_t *alloc(size_t bytes);
+  uint8_t *alloc(size_t bytes, size_t alignment);
+  // Places `count` blocks back to back under a single lock, the i-th of
+  // `sizes[i]` bytes goes to `ptrs[i]`. All or nothing.
+  bool alloc_batch(const size_t *sizes, size_t count, uint8_t **ptrs);
   bool free(const uint8_t *ptr);
   void reset();
   void lock_reset();
@@ -65,140 +197,222 @@ class Allocator {
     Scope<concurrent::SHARED> _(&lock_);
 
     size_t free_size;
-    size_t size = size_ / sizeof(int);
+    size_t size = size_ / sizeof(IndexT);
     if (free_index_ <= alloc_index_) {
       free_size = size - alloc_index_ + free_index_;
     } else {
       free_size = free_index_ - alloc_index_;
     }
 
-    return free_size * sizeof(int);
+    return free_size * sizeof(IndexT);
   }
 
   concurrent::RobustLock lock_;
 
  private:
-  void validate_index(uint32_t index) const;
-  [[nodiscard]] uint32_t suggest_index(uint32_t header_index,
-                                       uint32_t payload_size) const;
-  uint32_t *__attribute__((always_inline)) heap_() {
-    return reinterpret_cast<uint32_t *>(reinterpret_cast<uint8_t *>(this) +
-                                        offset_);
+  void validate_index(IndexT index) const;
+  static bool payload_words(size_t bytes, size_t size, IndexT *payload_size);
+  uint8_t *alloc_locked(IndexT payload_size, size_t alignment);
+  IndexT *__attribute__((always_inline)) heap_() {
+    return reinterpret_cast<IndexT *>(reinterpret_cast<uint8_t *>(this) +
+                                      offset_);
   }
 
-  uint32_t alloc_index_;
-  volatile uint32_t free_index_;
+  IndexT alloc_index_;
+  volatile IndexT free_index_;
   size_t offset_;
   size_t size_;
+  bool mirrored_;
 };
 
-Allocator::Allocator(size_t offset, size_t size)
-    : alloc_index_(0), free_index_(0), offset_(offset), size_(size) {
-  assert(!(size & (sizeof(int) - 1)));
+using Allocator = BasicAllocator<uint32_t>;
+using Allocator64 = BasicAllocator<uint64_t>;
+
+template <class IndexT>
+BasicAllocator<IndexT>::BasicAllocator(size_t offset, size_t size,
+                                       bool mirrored)
+    : alloc_index_(0),
+      free_index_(0),
+      offset_(offset),
+      size_(size),
+      mirrored_(mirrored) {
+  assert(!(size & (sizeof(IndexT) - 1)));
+  assert(size / sizeof(IndexT) <= std::numeric_limits<IndexT>::max());
 }
 
-void Allocator::validate_index(uint32_t index) const {
-  assert(index < (size_ / sizeof(int)));
+template <class IndexT>
+void BasicAllocator<IndexT>::validate_index(IndexT index) const {
+  assert(index < (size_ / sizeof(IndexT)));
 }
 
-uint32_t Allocator::suggest_index(uint32_t header_index,
-                                  uint32_t payload_size) const {
-  validate_index(header_index);
+template <class IndexT>
+uint8_t *BasicAllocator<IndexT>::alloc(size_t bytes) {
+  return alloc(bytes, 1);
+}
 
-  int32_t payload_index = header_index + 1;
+template <class IndexT>
+bool BasicAllocator<IndexT>::payload_words(size_t bytes, size_t size,
+                                          IndexT *payload_size) {
+  if (bytes >= size - 2 * sizeof(IndexT)) {
+    return false;
+  }
 
-  if (payload_index + payload_size - 1 >= size_ / sizeof(int)) {
-    payload_index = 0;
+  *payload_size = (bytes + sizeof(IndexT) - 1) / sizeof(IndexT);
+  if (*payload_size == 0) {
+    *payload_size = 1;
   }
-  validate_index(payload_index);
-  validate_index(payload_index + payload_size - 1);
-  return payload_index;
+  // Has to fit in a header.
+  return !(*payload_size & BLOCK_FREE<IndexT>);
 }
 
-uint8_t *Allocator::alloc(uint32_t bytes) { return alloc(bytes, 1); }
-
-uint8_t *Allocator::alloc(uint32_t bytes, size_t alignment) {
-  uint32_t payload_size = bytes + alignment;
-
-  if (payload_size == 0) {
-    payload_size = sizeof(int);
-  }
+template <class IndexT>
+uint8_t *BasicAllocator<IndexT>::alloc(size_t bytes, size_t alignment) {
+  assert(!(alignment & (alignment - 1)));
 
-  if (payload_size >= size_ - 2 * sizeof(int)) {
+  IndexT payload_size;
+  if (!payload_words(bytes, size_, &payload_size)) {
     return nullptr;
   }
 
-  if (payload_size & (sizeof(int) - 1)) {
-    payload_size &= ~(sizeof(int) - 1);
-    payload_size += sizeof(int);
-  }
-
-  payload_size /= sizeof(int);
-
   Scope<concurrent::EXCLUSIVE> _(&lock_);
+  return alloc_locked(payload_size, alignment);
+}
 
-  const auto payload_index = suggest_index(alloc_index_, payload_size);
-  const auto free_index_th = free_index_;
-  uint32_t new_alloc_index = payload_index + payload_size;
+template <class IndexT>
+bool BasicAllocator<IndexT>::alloc_batch(const size_t *sizes, size_t count,
+                                         uint8_t **ptrs) {
+  Scope<concurrent::EXCLUSIVE> _(&lock_);
 
-  if (alloc_index_ < free_index_th && payload_index == 0) {
-    return nullptr;
+  // Nothing before `alloc_index_` is touched, so putting it back undoes the
+  // blocks placed so far.
+  const IndexT start_index = alloc_index_;
+  for (size_t i = 0; i < count; ++i) {
+    IndexT payload_size;
+    if (!payload_words(sizes[i], size_, &payload_size) ||
+        (ptrs[i] = alloc_locked(payload_size, 1)) == nullptr) {
+      alloc_index_ = start_index;
+      return false;
+    }
   }
+  return true;
+}
 
-  if (payload_index <= free_index_th && free_index_th <= new_alloc_index) {
+template <class IndexT>
+uint8_t *BasicAllocator<IndexT>::alloc_locked(IndexT payload_size,
+                                              size_t alignment) {
+  const IndexT heap_size = size_ / sizeof(IndexT);
+  IndexT header_index, new_alloc_index;
+  if (!place_block<IndexT>(heap_(), heap_size, mirrored_, alloc_index_,
+                           free_index_, payload_size, alignment,
+                           &header_index, &new_alloc_index)) {
     return nullptr;
   }
 
-  if (new_alloc_index == size_ / sizeof(int)) {
-    new_alloc_index = 0;
-    if (new_alloc_index == free_index_th) {
-      return nullptr;
-    }
-  }
-
-  assert(new_alloc_index != alloc_index_);
+  validate_index(header_index);
   validate_index(new_alloc_index);
 
-  heap_()[alloc_index_] = payload_size;
+  pad_to_block<IndexT>(heap_(), heap_size, alloc_index_, header_index);
+  heap_()[header_index] = payload_size;
   alloc_index_ = new_alloc_index;
 
-  auto heap_ptr = reinterpret_cast<void *>(heap_() + payload_index);
-  return align_address(heap_ptr, alignment);
+  return reinterpret_cast<uint8_t *>(heap_() + header_index + 1);
 }
 
-bool Allocator::free(const uint8_t *ptr) {
+template <class IndexT>
+bool BasicAllocator<IndexT>::free(const uint8_t *ptr) {
   if (ptr == nullptr) {
     return true;
   }
   auto *heap = reinterpret_cast<uint8_t *>(heap_());
 
-  Scope<concurrent::EXCLUSIVE> _(&lock_);
+  assert(ptr > heap);
+  assert(ptr <= heap + size_);
 
-  assert(ptr >= heap);
-  assert(ptr < heap + size_);
-  validate_index(free_index_);
+  IndexT header_index = (ptr - heap) / sizeof(IndexT) - 1;
+  validate_index(header_index);
 
-  uint32_t payload_size = heap_()[free_index_];
-  uint32_t payload_index = suggest_index(free_index_, payload_size);
+  Scope<concurrent::EXCLUSIVE> _(&lock_);
 
-  if (ptr != reinterpret_cast<uint8_t *>(heap_() + payload_index)) {
+  const IndexT header = heap_()[header_index];
+  if (header & BLOCK_FREE<IndexT>) {
+    // Double free.
     return false;
   }
+  // The header keeps `BLOCK_FREE` even when the block goes back to the
+  // head, so a double free is still caught until the space is reused.
+  heap_()[header_index] |= BLOCK_FREE<IndexT>;
 
-  uint32_t new_free_index = payload_index + payload_size;
-  if (new_free_index == size_ / sizeof(int)) {
-    new_free_index = 0;
+  const IndexT heap_size = size_ / sizeof(IndexT);
+  if (next_block<IndexT>(header_index, header, heap_size) == alloc_index_) {
+    alloc_index_ = header_index;
+  }
+  while (free_index_ != alloc_index_ &&
+         (heap_()[free_index_] & BLOCK_FREE<IndexT>)) {
+    free_index_ =
+        next_block<IndexT>(free_index_, heap_()[free_index_], heap_size);
+  }
+  if (free_index_ == alloc_index_) {
+    // Empty, start over so the next block gets the whole heap.
+    reset();
   }
-  free_index_ = new_free_index;
   return true;
 }
 
-void Allocator::reset() {
+template <class IndexT>
+void BasicAllocator<IndexT>::reset() {
   alloc_index_ = 0;
   free_index_ = 0;
 }
 
-void Allocator::lock_reset() { lock_.reset(); }
+template <class IndexT>
+void BasicAllocator<IndexT>::lock_reset() {
+  lock_.reset();
+}
+
+/*
+ * Allocates `count` blocks, the i-th of `sizes[i]` bytes, into `ptrs`. All
+ * or nothing: if one doesn't fit, the ones before it are freed again. The
+ * ring allocators place the whole batch under one lock, any other
+ * allocator gets one `alloc` per block.
+ */
+template <class AllocatorT>
+bool alloc_batch(AllocatorT *allocator, const size_t *sizes, size_t count,
+                 uint8_t **ptrs) {
+  for (size_t i = 0; i < count; ++i) {
+    if ((ptrs[i] = allocator->alloc(sizes[i])) == nullptr) {
+      while (i-- > 0) {
+        allocator->free(ptrs[i]);
+      }
+      return false;
+    }
+  }
+  return true;
+}
+
+template <class IndexT>
+bool alloc_batch(BasicAllocator<IndexT> *allocator, const size_t *sizes,
+                 size_t count, uint8_t **ptrs) {
+  return allocator->alloc_batch(sizes, count, ptrs);
+}
+
+/*
+ * An allocator followed by a heap of `heap_size` bytes, in private memory
+ * of the calling process (tests, benchmarks). The storage is aligned for
+ * `AllocatorT`, some allocators are cache line aligned. Release it with
+ * `free`.
+ */
+template <class AllocatorT>
+AllocatorT *new_local_allocator(size_t heap_size) {
+  constexpr size_t alignment = alignof(AllocatorT) > CACHELINE_SIZE
+                                   ? alignof(AllocatorT)
+                                   : CACHELINE_SIZE;
+  void *memory = aligned_alloc(
+      alignment, SHMALIGN(sizeof(AllocatorT) + heap_size, alignment));
+  if (memory == nullptr) {
+    return nullptr;
+  }
+  return new (memory) AllocatorT(sizeof(AllocatorT), heap_size);
+}
 
 }  // namespace shm::memory
 #endif  // INCLUDE_SHADESMAR_MEMORY_ALLOCATOR_H_
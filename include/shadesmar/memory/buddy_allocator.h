@@ -0,0 +1,245 @@
+/* MIT License
+
+Copyright (c) 2020 Dheeraj R Reddy
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+==============================================================================*/
+
+#ifndef INCLUDE_SHADESMAR_MEMORY_BUDDY_ALLOCATOR_H_
+#define INCLUDE_SHADESMAR_MEMORY_BUDDY_ALLOCATOR_H_
+
+#include <cassert>
+#include <cstdint>
+
+#include "shadesmar/concurrency/robust_lock.h"
+#include "shadesmar/concurrency/scope.h"
+#include "shadesmar/macros.h"
+#include "shadesmar/memory/allocator.h"
+
+namespace shm::memory {
+
+/*
+ * Buddy allocator for large messages of varying size (camera frames, point
+ * clouds). Unlike the ring in `Allocator`, a long lived block doesn't hold
+ * up the memory behind it, and nothing is lost at the end of the heap.
+ * The price is rounding every block up to a power of two.
+ *
+ * The heap is split into units of `MIN_BLOCK` bytes. A block of order `k`
+ * spans 2^k units and starts at a multiple of 2^k, its buddy is the block
+ * at `unit ^ 2^k`. A table at the start of the heap holds one byte per
+ * unit, the order of the block starting there, with `BLOCK_FREE` set for
+ * free blocks. Free blocks of each order are kept in a doubly linked list
+ * that lives inside the free blocks, linked by unit index.
+ */
+class BuddyAllocator {
+ public:
+  using handle = uint64_t;
+
+  template <concurrent::ExlOrShr type>
+  using Scope = concurrent::ScopeGuard<concurrent::RobustLock, type>;
+
+  static constexpr size_t MIN_BLOCK = 256;
+  static constexpr uint32_t NUM_ORDERS = 32;
+
+  BuddyAllocator(size_t offset, size_t size);
+
+  /*
+   * A heap that holds `blocks` blocks of up to `block_size` bytes at once,
+   * whatever their sizes: each is within an aligned block of the order of
+   * `block_size`, and one of `blocks` such blocks is always free and
+   * merged whole. The order table takes a byte per unit ahead of them.
+   */
+  static size_t required_size(size_t blocks, size_t block_size) {
+    size_t data = blocks * (MIN_BLOCK << order_of(block_size));
+    return data + SHMALIGN(data / MIN_BLOCK * 2 + CACHELINE_SIZE,
+                           CACHELINE_SIZE);
+  }
+
+  // Units are indexed by `uint32_t`, with `NIL` kept free.
+  static constexpr size_t max_size() { return size_t(NIL) * MIN_BLOCK; }
+
+  uint8_t *alloc(size_t bytes);
+  bool free(const uint8_t *ptr);
+  void reset();
+  void lock_reset() { lock_.reset(); }
+
+  inline handle ptr_to_handle(uint8_t *p) { return p - heap_(); }
+  uint8_t *handle_to_ptr(handle h) { return heap_() + h; }
+
+  size_t get_free_memory() {
+    Scope<concurrent::SHARED> _(&lock_);
+    return free_units_ * MIN_BLOCK;
+  }
+
+  concurrent::RobustLock lock_;
+
+ private:
+  static constexpr uint8_t BLOCK_FREE = 0x80;
+  static constexpr uint32_t NIL = 0xffffffff;
+
+  struct FreeBlock {
+    uint32_t prev;
+    uint32_t next;
+  };
+
+  static uint32_t order_of(size_t bytes);
+
+  void push(uint32_t unit, uint32_t order);
+  void remove(uint32_t unit, uint32_t order);
+
+  FreeBlock *block_(uint32_t unit) {
+    return reinterpret_cast<FreeBlock *>(data_() + unit * MIN_BLOCK);
+  }
+  uint8_t *__attribute__((always_inline)) heap_() {
+    return reinterpret_cast<uint8_t *>(this) + offset_;
+  }
+  uint8_t *orders_() { return heap_(); }
+  uint8_t *data_() { return heap_() + data_offset_; }
+
+  uint32_t free_lists_[NUM_ORDERS];
+  size_t free_units_;
+  size_t offset_;
+  size_t size_;
+  size_t data_offset_;
+  uint32_t units_;
+};
+
+BuddyAllocator::BuddyAllocator(size_t offset, size_t size)
+    : offset_(offset), size_(size) {
+  // One byte of the table per unit, ahead of the units.
+  data_offset_ = SHMALIGN(size / MIN_BLOCK + 1, CACHELINE_SIZE);
+  units_ = data_offset_ < size ? (size - data_offset_) / MIN_BLOCK : 0;
+  reset();
+}
+
+uint32_t BuddyAllocator::order_of(size_t bytes) {
+  uint32_t order = 0;
+  while (order < NUM_ORDERS && (MIN_BLOCK << order) < bytes) {
+    ++order;
+  }
+  return order;
+}
+
+void BuddyAllocator::push(uint32_t unit, uint32_t order) {
+  orders_()[unit] = order | BLOCK_FREE;
+  FreeBlock *block = block_(unit);
+  block->prev = NIL;
+  block->next = free_lists_[order];
+  if (block->next != NIL) {
+    block_(block->next)->prev = unit;
+  }
+  free_lists_[order] = unit;
+}
+
+void BuddyAllocator::remove(uint32_t unit, uint32_t order) {
+  FreeBlock *block = block_(unit);
+  if (block->prev != NIL) {
+    block_(block->prev)->next = block->next;
+  } else {
+    free_lists_[order] = block->next;
+  }
+  if (block->next != NIL) {
+    block_(block->next)->prev = block->prev;
+  }
+  orders_()[unit] = order;
+}
+
+uint8_t *BuddyAllocator::alloc(size_t bytes) {
+  uint32_t order = order_of(bytes);
+  if (order >= NUM_ORDERS) {
+    return nullptr;
+  }
+
+  Scope<concurrent::EXCLUSIVE> _(&lock_);
+
+  uint32_t k = order;
+  while (k < NUM_ORDERS && free_lists_[k] == NIL) {
+    ++k;
+  }
+  if (k == NUM_ORDERS) {
+    return nullptr;
+  }
+
+  uint32_t unit = free_lists_[k];
+  remove(unit, k);
+  // Split down to the requested order, the upper halves stay free.
+  while (k > order) {
+    --k;
+    push(unit + (1u << k), k);
+  }
+  orders_()[unit] = order;
+  free_units_ -= 1u << order;
+  return data_() + static_cast<size_t>(unit) * MIN_BLOCK;
+}
+
+bool BuddyAllocator::free(const uint8_t *ptr) {
+  if (ptr == nullptr) {
+    return true;
+  }
+  assert(ptr >= data_());
+  assert(ptr < data_() + static_cast<size_t>(units_) * MIN_BLOCK);
+
+  uint32_t unit = (ptr - data_()) / MIN_BLOCK;
+
+  Scope<concurrent::EXCLUSIVE> _(&lock_);
+
+  uint32_t order = orders_()[unit];
+  if (order & BLOCK_FREE) {
+    // Double free.
+    return false;
+  }
+  free_units_ += 1u << order;
+
+  // Merge with the buddy for as long as it is free and whole.
+  while (order + 1 < NUM_ORDERS) {
+    uint32_t buddy = unit ^ (1u << order);
+    if (buddy + (1u << order) > units_ ||
+        orders_()[buddy] != (order | BLOCK_FREE)) {
+      break;
+    }
+    remove(buddy, order);
+    unit = unit < buddy ? unit : buddy;
+    ++order;
+  }
+  push(unit, order);
+  return true;
+}
+
+void BuddyAllocator::reset() {
+  for (auto &free_list : free_lists_) {
+    free_list = NIL;
+  }
+  free_units_ = units_;
+
+  // The heap isn't a power of two in general, cover it with the largest
+  // aligned blocks that fit.
+  uint32_t unit = 0;
+  while (unit < units_) {
+    uint32_t order = NUM_ORDERS - 1;
+    while ((unit & ((1u << order) - 1)) ||
+           unit + (1ull << order) > units_) {
+      --order;
+    }
+    push(unit, order);
+    unit += 1u << order;
+  }
+}
+
+}  // namespace shm::memory
+#endif  // INCLUDE_SHADESMAR_MEMORY_BUDDY_ALLOCATOR_H_
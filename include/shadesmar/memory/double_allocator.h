@@ -32,6 +32,9 @@ class DoubleAllocator {
  public:
   DoubleAllocator(size_t offset, size_t size)
       : req(offset, size / 2), resp(offset + size / 2, size / 2) {}
+
+  static constexpr size_t max_size() { return 2 * Allocator::max_size(); }
+
   Allocator req;
   Allocator resp;
 
@@ -0,0 +1,263 @@
+/* MIT License
+
+Copyright (c) 2020 Dheeraj R Reddy
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+==============================================================================*/
+
+#ifndef INCLUDE_SHADESMAR_MEMORY_LOCKLESS_ALLOCATOR_H_
+#define INCLUDE_SHADESMAR_MEMORY_LOCKLESS_ALLOCATOR_H_
+
+#include <unistd.h>
+
+#include <atomic>
+#include <cassert>
+#include <cstdint>
+#include <thread>
+
+#include "shadesmar/concurrency/wait_strategy.h"
+#include "shadesmar/macros.h"
+#include "shadesmar/memory/allocator.h"
+
+namespace shm::memory {
+
+/*
+ * Drop-in replacement for `Allocator` (same circular heap, same block
+ * headers) where the alloc and free indices are kept in atomic words,
+ * without `RobustLock` and its sleeping retry loops.
+ *
+ * Allocating isn't lock-free, the claim below is a spinlock. An
+ * allocation is a two step process on `alloc_state_`, which packs the
+ * alloc index and the PID of the claimant into a single word:
+ *   1. Claim: (index, 0) -> (index, pid). The claimant now owns the header
+ *      at `index`.
+ *   2. Commit: write the block header, then (index, pid) -> (next, 0).
+ * The claim is only held for those few stores, other allocators spin on
+ * it. A claimant that is preempted holds them up, one that died has its
+ * claim rolled back (nothing was committed, so nothing is lost). That
+ * gives the crash-robustness `RobustLock` provides for `Allocator`.
+ *
+ * The index can't be reserved with a single CAS instead: until the header
+ * is written, the word at `index` is whatever was there before, and
+ * `advance_free_index` could take it for a freed block.
+ *
+ * `free` is lock-free. It sets `BLOCK_FREE` in the header of the block,
+ * then tries to move the free index past the freed blocks at the tail.
+ * Any process can do that, `free_state_` packs the free index with a
+ * generation which is bumped on every move, so a stale header read can't
+ * move it.
+ */
+class LocklessAllocator {
+ public:
+  using handle = uint64_t;
+
+  LocklessAllocator(size_t offset, size_t size, bool mirrored = false);
+
+  // Same blocks and `uint32_t` indices as `Allocator`.
+  static constexpr size_t required_size(size_t blocks, size_t block_size) {
+    return Allocator::required_size(blocks, block_size);
+  }
+  static constexpr size_t max_size() { return Allocator::max_size(); }
+
+  uint8_t *alloc(size_t bytes);
+  bool free(const uint8_t *ptr);
+  void reset();
+  void lock_reset() {}
+
+  inline handle ptr_to_handle(uint8_t *p) {
+    return p - reinterpret_cast<uint8_t *>(heap_());
+  }
+  uint8_t *handle_to_ptr(handle h) {
+    return reinterpret_cast<uint8_t *>(heap_()) + h;
+  }
+
+  size_t get_free_memory() {
+    uint32_t alloc_index = index_of(alloc_state_.load());
+    uint32_t free_index = index_of(free_state_.load());
+
+    size_t free_size;
+    size_t size = size_ / sizeof(int);
+    if (free_index <= alloc_index) {
+      free_size = size - alloc_index + free_index;
+    } else {
+      free_size = free_index - alloc_index;
+    }
+
+    return free_size * sizeof(int);
+  }
+
+ private:
+  static uint64_t make_state(uint32_t index, uint32_t claim_pid) {
+    return (static_cast<uint64_t>(claim_pid) << 32) | index;
+  }
+  static uint32_t index_of(uint64_t state) { return state & 0xffffffff; }
+  static uint32_t claim_pid_of(uint64_t state) { return state >> 32; }
+  static uint32_t generation_of(uint64_t state) { return state >> 32; }
+
+  bool fits(uint32_t alloc_index, uint32_t payload_size,
+            uint32_t *header_index, uint32_t *new_alloc_index);
+  void advance_free_index();
+  void wait_for_claim(uint64_t state, uint32_t *spins);
+  uint32_t *__attribute__((always_inline)) heap_() {
+    return reinterpret_cast<uint32_t *>(reinterpret_cast<uint8_t *>(this) +
+                                        offset_);
+  }
+
+  alignas(CACHELINE_SIZE) std::atomic<uint64_t> alloc_state_;
+  alignas(CACHELINE_SIZE) std::atomic<uint64_t> free_state_;
+  alignas(CACHELINE_SIZE) size_t offset_;
+  size_t size_;
+  bool mirrored_;
+};
+
+LocklessAllocator::LocklessAllocator(size_t offset, size_t size, bool mirrored)
+    : alloc_state_(0),
+      free_state_(0),
+      offset_(offset),
+      size_(size),
+      mirrored_(mirrored) {
+  assert(!(size & (sizeof(int) - 1)));
+}
+
+bool LocklessAllocator::fits(uint32_t alloc_index, uint32_t payload_size,
+                             uint32_t *header_index,
+                             uint32_t *new_alloc_index) {
+  return place_block<uint32_t>(heap_(), size_ / sizeof(int), mirrored_,
+                               alloc_index, index_of(free_state_.load()),
+                               payload_size, 1, header_index, new_alloc_index);
+}
+
+void LocklessAllocator::wait_for_claim(uint64_t state, uint32_t *spins) {
+  /*
+   * Another allocator holds the claim. That is only for a couple of
+   * stores, so spin first. If it takes long, the claimant may have died,
+   * in which case its claim is rolled back.
+   */
+  if (++(*spins) < 1024) {
+    concurrent::cpu_relax();
+    return;
+  }
+  *spins = 0;
+  if (proc_dead(claim_pid_of(state))) {
+    alloc_state_.compare_exchange_strong(state, make_state(index_of(state), 0));
+  } else {
+    std::this_thread::yield();
+  }
+}
+
+uint8_t *LocklessAllocator::alloc(size_t bytes) {
+  if (bytes >= size_ - 2 * sizeof(int)) {
+    return nullptr;
+  }
+
+  uint32_t payload_size = (bytes + sizeof(int) - 1) / sizeof(int);
+  if (payload_size == 0) {
+    payload_size = 1;
+  }
+
+  const uint32_t pid = getpid();
+  uint32_t spins = 0;
+  uint64_t state = alloc_state_.load();
+  while (true) {
+    if (claim_pid_of(state) != 0) {
+      wait_for_claim(state, &spins);
+      state = alloc_state_.load();
+      continue;
+    }
+
+    const uint32_t alloc_index = index_of(state);
+    uint32_t header_index, new_alloc_index;
+    if (!fits(alloc_index, payload_size, &header_index, &new_alloc_index)) {
+      return nullptr;
+    }
+
+    if (!alloc_state_.compare_exchange_weak(state,
+                                            make_state(alloc_index, pid))) {
+      continue;
+    }
+
+    // Check again, the free index read by `fits` may predate a full lap
+    // of the heap by other allocators.
+    if (!fits(alloc_index, payload_size, &header_index, &new_alloc_index)) {
+      alloc_state_.store(make_state(alloc_index, 0));
+      return nullptr;
+    }
+
+    pad_to_block<uint32_t>(heap_(), size_ / sizeof(int), alloc_index,
+                           header_index);
+    __atomic_store_n(&heap_()[header_index], payload_size, __ATOMIC_RELEASE);
+    alloc_state_.store(make_state(new_alloc_index, 0));
+
+    return reinterpret_cast<uint8_t *>(heap_() + header_index + 1);
+  }
+}
+
+bool LocklessAllocator::free(const uint8_t *ptr) {
+  if (ptr == nullptr) {
+    return true;
+  }
+  auto *heap = reinterpret_cast<uint8_t *>(heap_());
+
+  assert(ptr > heap);
+  assert(ptr <= heap + size_);
+
+  uint32_t *header = &heap_()[(ptr - heap) / sizeof(int) - 1];
+  if (__atomic_fetch_or(header, BLOCK_FREE<uint32_t>, __ATOMIC_SEQ_CST) &
+      BLOCK_FREE<uint32_t>) {
+    // Double free.
+    return false;
+  }
+
+  advance_free_index();
+  return true;
+}
+
+void LocklessAllocator::advance_free_index() {
+  /*
+   * Setting `BLOCK_FREE` happens before the load of `free_state_`. So either
+   * this call sees the block at the tail, or the call that moved the free
+   * index up to the block sees it freed.
+   */
+  const uint32_t heap_size = size_ / sizeof(int);
+  uint64_t state = free_state_.load();
+  while (true) {
+    const uint32_t free_index = index_of(state);
+    if (free_index == index_of(alloc_state_.load())) {
+      return;
+    }
+    uint32_t header =
+        __atomic_load_n(&heap_()[free_index], __ATOMIC_SEQ_CST);
+    if (!(header & BLOCK_FREE<uint32_t>)) {
+      return;
+    }
+    uint64_t next = (static_cast<uint64_t>(generation_of(state) + 1) << 32) |
+                    next_block<uint32_t>(free_index, header, heap_size);
+    if (free_state_.compare_exchange_weak(state, next)) {
+      state = next;
+    }
+  }
+}
+
+void LocklessAllocator::reset() {
+  alloc_state_ = 0;
+  free_state_ = 0;
+}
+
+}  // namespace shm::memory
+#endif  // INCLUDE_SHADESMAR_MEMORY_LOCKLESS_ALLOCATOR_H_
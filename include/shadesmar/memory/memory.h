@@ -25,20 +25,30 @@ SOFTWARE.
 #define INCLUDE_SHADESMAR_MEMORY_MEMORY_H_
 
 #include <fcntl.h>
+#include <linux/magic.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/statfs.h>
 #include <sys/types.h>
 #include <unistd.h>
 
+#include <algorithm>
 #include <atomic>
+#include <chrono>
 #include <cerrno>
 #include <cstdint>
+#include <cstring>
+#include <fstream>
 #include <memory>
+#include <stdexcept>
 #include <string>
+#include <thread>
 #include <type_traits>
 
+#include "shadesmar/concurrency/futex.h"
 #include "shadesmar/concurrency/lockless_set.h"
 #include "shadesmar/concurrency/robust_lock.h"
+#include "shadesmar/concurrency/waiters.h"
 #include "shadesmar/macros.h"
 #include "shadesmar/memory/allocator.h"
 
@@ -48,48 +58,314 @@ static constexpr size_t QUEUE_SIZE = 1024;
 static size_t buffer_size = (1U << 28);  // 256mb
 static size_t GAP = 1024;                // 1kb safety gap
 
-inline uint8_t *create_memory_segment(const std::string &name, size_t size,
-                                      bool *new_segment,
-                                      size_t alignment = 32) {
-  /*
-   * Create a new shared memory segment. The segment is created
-   * under a name. We check if an existing segment is found under
-   * the same name. This info is stored in `new_segment`.
-   *
-   * The permission of the memory segment is 0644.
-   */
+static constexpr uint32_t SEGMENT_MAGIC = 0x53484d53;  // "SHMS"
+static constexpr uint32_t SEGMENT_VERSION = 16;
+// The first version whose header has `pid_set_offset`, see `SegmentHeader`.
+static constexpr uint32_t STABLE_PREFIX_VERSION = 12;
+
+// How long a segment may stay half created before it's taken for the
+// leftover of a creator that died.
+static constexpr std::chrono::seconds STALE_TIMEOUT(1);
+
+// The pages backing a segment, as recorded in the `SegmentHeader`.
+enum Backing : uint32_t {
+  SMALL_PAGES = 0,
+  TRANSPARENT_HUGE_PAGES = 1,
+  HUGETLBFS_PAGES = 2,
+};
+
+/*
+ * Per-topic geometry of a shared memory segment. Only the process that
+ * creates the segment uses these values, they are written into the
+ * `SegmentHeader` and every later joiner reads them back from there.
+ *
+ * `queue_size` is rounded up to the next power of two.
+ *
+ * With `huge_pages` the segment is first created as a file on the
+ * hugetlbfs mount at `hugetlbfs_mount`. If that fails (no mount, no free
+ * huge pages) it falls back to a regular shm segment with transparent huge
+ * pages requested through `madvise`, and finally to 4kb pages. Joiners
+ * always look for the segment on `hugetlbfs_mount` first, so a non-default
+ * mount has to be passed by every participant.
+ *
+ * With `mirrored` the buffer is mapped twice, back to back, so the ring
+ * allocators can place a message across the end of the buffer instead of
+ * restarting it at the front. The buffer is rounded up to whole pages.
+ * Mirrored segments are always regular shm segments, `huge_pages` only
+ * requests transparent huge pages for them.
+ *
+ * `prefault` and `lock_memory` act on the mapping of the calling process,
+ * so unlike the geometry they are honoured for joiners too. `prefault`
+ * faults in every page of the segment at open time, `lock_memory` also
+ * `mlock`s it so it can't be paged out.
+ *
+ * With `seqlock` readers of a topic don't lock its elements, they copy
+ * optimistically and retry if a publisher got in the way (see
+ * `pubsub::TopicT::read`). Publishers never wait for readers, but
+ * zero-copy reads aren't available.
+ *
+ * `keep_last` sizes a state topic (pose, config, ...) whose subscribers
+ * only want the newest value, see `pubsub::SubscriberT::set_latest_only`.
+ */
+struct Options {
+  uint32_t queue_size = QUEUE_SIZE;
+  size_t buffer_size = memory::buffer_size;
+  size_t alignment = 32;
+  bool huge_pages = false;
+  std::string hugetlbfs_mount = "/dev/hugepages";
+  bool mirrored = false;
+  bool prefault = false;
+  bool lock_memory = false;
+  bool seqlock = false;
+
+  template <class AllocatorT = Allocator>
+  static Options keep_last(uint32_t n, size_t max_message_size);
+};
+
+inline uint32_t next_power_of_two(uint32_t n) {
+  if (n <= 1) return 1;
+  return 1U << (32 - __builtin_clz(n - 1));
+}
+
+/*
+ * At least two elements, so the newest value can be published while the
+ * one before it is read. The buffer holds a block per element, the one
+ * being published, one parked for a zero-copy view (see
+ * `pubsub::TopicT::retire`), and the end of the ring that a block may
+ * skip. Views of older messages held at the same time park one more each.
+ * How much that takes depends on how `AllocatorT` rounds and lays out
+ * blocks, see its `required_size`.
+ */
+template <class AllocatorT>
+inline Options Options::keep_last(uint32_t n, size_t max_message_size) {
+  Options options;
+  options.queue_size = next_power_of_two(std::max(n, 2u));
+  options.buffer_size =
+      AllocatorT::required_size(options.queue_size + 3, max_message_size);
+  return options;
+}
+
+inline const char *backing_name(uint32_t backing) {
+  switch (backing) {
+    case TRANSPARENT_HUGE_PAGES:
+      return "transparent huge pages";
+    case HUGETLBFS_PAGES:
+      return "hugetlbfs pages";
+    default:
+      return "4kb pages";
+  }
+}
+
+inline int unlink_segment(const std::string &path, bool hugetlbfs) {
+  return hugetlbfs ? unlink(path.c_str()) : shm_unlink(path.c_str());
+}
+
+// Unlinks `path` if it's still the segment `st` was taken from, and not
+// one that replaced it since.
+inline void unlink_segment_if_same(const std::string &path, bool hugetlbfs,
+                                   const struct stat &st) {
+  int fd = hugetlbfs ? open(path.c_str(), O_RDONLY)
+                     : shm_open(path.c_str(), O_RDONLY, 0644);
+  if (fd < 0) {
+    return;
+  }
+  struct stat current {};
+  if (fstat(fd, &current) == 0 && current.st_ino == st.st_ino &&
+      current.st_dev == st.st_dev) {
+    unlink_segment(path, hugetlbfs);
+  }
+  close(fd);
+}
+
+inline int open_segment(const std::string &path, bool hugetlbfs,
+                        bool *new_segment) {
+  auto open_fn = [hugetlbfs](const std::string &p, int flags) {
+    return hugetlbfs ? open(p.c_str(), flags, 0644)
+                     : shm_open(p.c_str(), flags, 0644);
+  };
   int fd;
   while (true) {
     *new_segment = true;
-    fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0644);
+    fd = open_fn(path, O_RDWR | O_CREAT | O_EXCL);
     if (fd >= 0) {
       fchmod(fd, 0644);
     } else if (errno == EEXIST) {
-      fd = shm_open(name.c_str(), O_RDWR, 0644);
+      fd = open_fn(path, O_RDWR);
       if (fd < 0 && errno == ENOENT) {
         // the memory segment was deleted in the mean time
         continue;
       }
       *new_segment = false;
-    } else {
-      return nullptr;
     }
     break;
   }
+  return fd;
+}
+
+inline uint8_t *create_memory_segment(const std::string &name, size_t *size,
+                                      bool *new_segment,
+                                      size_t alignment = 32,
+                                      const std::string &hugetlbfs_mount = "") {
+  /*
+   * Create a new shared memory segment. The segment is created
+   * under a name. We check if an existing segment is found under
+   * the same name. This info is stored in `new_segment`.
+   *
+   * For a new segment `size` is an input. For an existing segment
+   * `size` is ignored and overwritten with the size of the segment
+   * created by the first process.
+   *
+   * If `hugetlbfs_mount` is set, the segment is a file on that mount
+   * instead of a POSIX shm object, and `size` is rounded so that the
+   * mapping is a whole number of huge pages.
+   *
+   * If an existing segment is never truncated (its creator died right
+   * after creating it), it's unlinked after `STALE_TIMEOUT`, and this
+   * returns nullptr with `errno` set to EAGAIN: try again.
+   *
+   * The permission of the memory segment is 0644.
+   */
+  bool hugetlbfs = !hugetlbfs_mount.empty();
+  std::string path = hugetlbfs ? hugetlbfs_mount + name : name;
+  int fd = open_segment(path, hugetlbfs, new_segment);
+  if (fd < 0) {
+    return nullptr;
+  }
 
   if (*new_segment) {
+    if (hugetlbfs) {
+      struct statfs fs {};
+      if (fstatfs(fd, &fs) != 0 || fs.f_type != HUGETLBFS_MAGIC) {
+        close(fd);
+        unlink(path.c_str());
+        return nullptr;
+      }
+      *size = SHMALIGN(*size + alignment, fs.f_bsize) - alignment;
+    }
     // Allocate an extra `alignment` bytes as padding
-    int result = ftruncate(fd, size + alignment);
-    if (result == EINVAL) {
+    int result = ftruncate(fd, *size + alignment);
+    if (result != 0) {
+      close(fd);
+      if (hugetlbfs) unlink(path.c_str());
       return nullptr;
     }
+  } else {
+    // The creator may not have truncated the segment to its full size yet.
+    struct stat st {};
+    auto start = std::chrono::steady_clock::now();
+    while (fstat(fd, &st) == 0 && st.st_size == 0) {
+      if (std::chrono::steady_clock::now() - start > STALE_TIMEOUT) {
+        unlink_segment_if_same(path, hugetlbfs, st);
+        close(fd);
+        errno = EAGAIN;
+        return nullptr;
+      }
+      std::this_thread::yield();
+    }
+    if (st.st_size <= static_cast<off_t>(alignment)) {
+      close(fd);
+      return nullptr;
+    }
+    *size = st.st_size - alignment;
   }
 
-  auto *ptr = mmap(nullptr, size + alignment, PROT_READ | PROT_WRITE,
+  auto *ptr = mmap(nullptr, *size + alignment, PROT_READ | PROT_WRITE,
                    MAP_SHARED, fd, 0);
+  close(fd);
+  if (ptr == MAP_FAILED) {
+    if (hugetlbfs && *new_segment) unlink(path.c_str());
+    return nullptr;
+  }
   return align_address(ptr, alignment);
 }
 
+inline bool hugetlbfs_segment_exists(const std::string &name,
+                                     const std::string &hugetlbfs_mount) {
+  return !hugetlbfs_mount.empty() &&
+         access((hugetlbfs_mount + name).c_str(), F_OK) == 0;
+}
+
+inline uint8_t *mirror_memory_segment(const std::string &name,
+                                      size_t buffer_offset,
+                                      size_t buffer_size) {
+  /*
+   * Maps the segment `name` up to the end of its buffer, followed by a
+   * second mapping of just the buffer. The address range is reserved
+   * first, so the two mappings are guaranteed to be adjacent.
+   *
+   * `buffer_offset` and `buffer_size` have to be multiples of the page
+   * size.
+   */
+  int fd = shm_open(name.c_str(), O_RDWR, 0644);
+  if (fd < 0) {
+    return nullptr;
+  }
+  size_t prefix_size = buffer_offset + buffer_size;
+  auto *base = reinterpret_cast<uint8_t *>(
+      mmap(nullptr, prefix_size + buffer_size, PROT_NONE,
+           MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0));
+  if (base == MAP_FAILED) {
+    close(fd);
+    return nullptr;
+  }
+  bool mapped = mmap(base, prefix_size, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_FIXED, fd, 0) != MAP_FAILED &&
+                mmap(base + prefix_size, buffer_size, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_FIXED, fd, buffer_offset) != MAP_FAILED;
+  close(fd);
+  if (!mapped) {
+    munmap(base, prefix_size + buffer_size);
+    return nullptr;
+  }
+  return base;
+}
+
+inline void prefault_memory_segment(uint8_t *ptr, size_t size) {
+  /*
+   * Write-fault every page, so the first `alloc` + `user_to_shm` doesn't.
+   * MADV_POPULATE_WRITE (Linux 5.14) does this in a single call. On older
+   * kernels every page is touched with an atomic add of 0, which leaves
+   * the contents of an already initialized segment intact.
+   */
+#ifndef MADV_POPULATE_WRITE
+#define MADV_POPULATE_WRITE 23
+#endif
+  if (madvise(ptr, size, MADV_POPULATE_WRITE) == 0) {
+    return;
+  }
+  size_t page_size = sysconf(_SC_PAGESIZE);
+  for (size_t offset = 0; offset + sizeof(uint64_t) <= size;
+       offset += page_size) {
+    __atomic_fetch_add(reinterpret_cast<uint64_t *>(ptr + offset), 0,
+                       __ATOMIC_RELAXED);
+  }
+}
+
+inline bool shm_segment_exists(const std::string &name) {
+  int fd = shm_open(name.c_str(), O_RDONLY, 0644);
+  if (fd < 0) {
+    return false;
+  }
+  close(fd);
+  return true;
+}
+
+inline bool request_transparent_huge_pages(void *ptr, size_t size) {
+  /*
+   * Transparent huge pages on shm are only used if the kernel allows it
+   * for shmem (`advise`, `within_size` or `always`).
+   */
+  if (madvise(ptr, size, MADV_HUGEPAGE) != 0) {
+    return false;
+  }
+  std::ifstream shmem_enabled(
+      "/sys/kernel/mm/transparent_hugepage/shmem_enabled");
+  std::string line;
+  std::getline(shmem_enabled, line);
+  return line.find("[never]") == std::string::npos &&
+         line.find("[deny]") == std::string::npos && !line.empty();
+}
+
 struct Memblock {
   void *ptr;
   size_t size;
@@ -132,6 +408,17 @@ class PIDSet {
 
   bool insert(uint32_t pid) { return pid_set.insert(pid); }
 
+  // Like `any_alive`, but leaves the set as it is.
+  bool any_running() const {
+    for (auto &i : pid_set.array_) {
+      uint32_t pid = i.load();
+      if (pid != 0 && !proc_dead(pid)) {
+        return true;
+      }
+    }
+    return false;
+  }
+
   void lock() { lck.lock(); }
 
   void unlock() { lck.unlock(); }
@@ -141,101 +428,403 @@ class PIDSet {
   concurrent::RobustLock lck;
 };
 
+/*
+ * A message in a queue element. Messages of up to `INLINE_SIZE` bytes are
+ * stored in the element itself (`is_inline`), in place of the handle, so
+ * they don't touch the allocator or a second cache line. Larger ones live
+ * in the buffer at `address_handle`.
+ *
+ * Packed to a cache line, the size and the flags share a word.
+ */
 struct Element {
-  size_t size;
-  bool empty;
-  Allocator::handle address_handle;
+  static constexpr size_t INLINE_SIZE = 56;
+
+  uint64_t size : 62;
+  uint64_t empty : 1;
+  uint64_t is_inline : 1;
+  union {
+    Allocator::handle address_handle;
+    uint8_t payload[INLINE_SIZE];
+  };
 
-  Element() : size(0), address_handle(0), empty(true) {}
+  Element() : size(0), empty(true), is_inline(false), address_handle(0) {}
+
+  static bool fits_inline(size_t size) { return size <= INLINE_SIZE; }
 
   void reset() {
     size = 0;
     address_handle = 0;
     empty = true;
+    is_inline = false;
   }
 };
+static_assert(sizeof(Element) == CACHELINE_SIZE,
+              "Element should be packed to a cache line");
 
+/*
+ * `SharedQueue` is a header followed by `queue_size` elements. The number
+ * of elements is only known at runtime, so the elements are laid out
+ * directly after the header instead of in a fixed size array.
+ *
+ * `counter` is written by every publisher and read by every subscriber,
+ * so it gets a cache line to itself, away from the elements and from the
+ * read-only `queue_size`.
+ *
+ * `counter` is also the futex word readers sleep on in `wait`. `waiters`
+ * counts the sleepers, and shares the line with `counter` since it's read
+ * on every `notify`. Without sleepers, `notify` skips the syscall. Readers
+ * that crashed asleep are reaped by `notify`, see `concurrent::Waiters`.
+ */
 template <class ElemT>
 class SharedQueue {
  public:
-  std::atomic<uint32_t> counter;
-  std::array<ElemT, QUEUE_SIZE> elements;
+  explicit SharedQueue(uint32_t queue_size)
+      : counter(0), queue_size(queue_size) {
+    for (uint32_t idx = 0; idx < queue_size; ++idx) {
+      new (&elements()[idx]) ElemT();
+    }
+  }
+
+  static size_t size(uint32_t queue_size) {
+    return elements_offset() + queue_size * sizeof(ElemT);
+  }
+
+  inline __attribute__((always_inline)) ElemT *elements() {
+    return reinterpret_cast<ElemT *>(reinterpret_cast<uint8_t *>(this) +
+                                     elements_offset());
+  }
+
+  // Called after every bump of `counter`.
+  void notify() { waiters.wake(&counter); }
+
+  // Sleeps while `counter` is still `seen`, for at most `timeout` if it is
+  // non-zero. Returns false on timeout.
+  bool wait(uint32_t seen, std::chrono::nanoseconds timeout =
+                               std::chrono::nanoseconds::zero()) {
+    /*
+     * The increment of `waiters` happens before the kernel compares
+     * `counter` with `seen`, and a publisher bumps `counter` before it
+     * reads `waiters`. Either the publisher wakes us, or we don't sleep.
+     */
+    int slot = waiters.enter();
+    bool woken = concurrent::futex_wait(&counter, seen, timeout);
+    waiters.leave(slot);
+    return woken || counter.load() != seen;
+  }
+
+  alignas(CACHELINE_SIZE) std::atomic<uint32_t> counter;
+  concurrent::Waiters waiters;
+  alignas(CACHELINE_SIZE) uint32_t queue_size;
+
+ private:
+  static constexpr size_t elements_offset() {
+    return SHMALIGN(sizeof(SharedQueue), alignof(ElemT));
+  }
 };
 
-template <class ElemT, class AllocatorT>
-class Memory {
+/*
+ * The subscribers of a topic, one entry each, on a cache line of its own
+ * that only that subscriber writes. For monitoring (lag, stuck or
+ * crashed consumers), and for back-pressure: publishers don't overwrite
+ * messages that a reliable subscriber hasn't read (see
+ * `pubsub::SubscriberT::set_reliable`).
+ *
+ * `owner` is the PID of the subscriber, with `VALID` set once the rest of
+ * the entry is, and `RELIABLE` for reliable subscribers. `position` is
+ * the next message the subscriber will read, `last_read` the time of its
+ * last update (steady clock, which is shared by all processes), and
+ * `drops` the messages it skipped when it fell behind. Entries of crashed
+ * subscribers are evicted, so they never hold up publishers or fill the
+ * registry.
+ *
+ * `reliable` counts the reliable entries, and `generation` moves every
+ * time one turns reliable. Publishers caching the result of `slowest`
+ * check it. `progress` is the futex word blocked publishers sleep on,
+ * bumped by `update` only if there are `waiters`, like
+ * `SharedQueue::notify`.
+ */
+template <uint32_t Size>
+class SubscriberRegistry {
  public:
-  explicit Memory(const std::string &name) : name_(name) {
-    auto pid_set_size = sizeof(PIDSet);
-    auto shared_queue_size = sizeof(SharedQueue<ElemT>);
-    auto allocator_size = sizeof(AllocatorT);
+  static constexpr uint64_t VALID = 1ull << 32;
+  static constexpr uint64_t RELIABLE = 1ull << 33;
 
-    auto total_size = pid_set_size + shared_queue_size + allocator_size +
-                      buffer_size + 4 * GAP;
-    bool new_segment = false;
-    auto *base_address =
-        create_memory_segment("/SHM_" + name, total_size, &new_segment);
+  struct alignas(CACHELINE_SIZE) Entry {
+    std::atomic<uint64_t> owner;
+    std::atomic<uint32_t> id;
+    std::atomic<uint32_t> position;
+    std::atomic<uint64_t> last_read;
+    std::atomic<uint64_t> drops;
+  };
+
+  SubscriberRegistry() { reset(); }
 
-    if (base_address == nullptr) {
-      std::cerr << "Could not create/open shared memory segment.\n";
-      exit(1);
+  static uint64_t now() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+  }
+
+  // Returns the slot of a new entry at `position`, or -1 if the registry
+  // is full even after evicting the dead.
+  int add(uint32_t position) {
+    for (int attempt = 0; attempt < 2; ++attempt) {
+      int slot = claim(position);
+      if (slot >= 0) {
+        return slot;
+      }
+      evict_dead();
     }
+    return -1;
+  }
 
-    auto *pid_set_address = base_address;
-    auto *shared_queue_address = pid_set_address + pid_set_size + GAP;
-    auto *allocator_address = shared_queue_address + shared_queue_size + GAP;
-    auto *buffer_address = allocator_address + allocator_size + GAP;
+  void evict_dead() {
+    for (auto &entry : entries) {
+      uint64_t owner = entry.owner.load();
+      if (owner != 0 && proc_dead(static_cast<uint32_t>(owner))) {
+        evict(&entry, owner);
+      }
+    }
+  }
 
-    if (new_segment) {
-      pid_set_ = new (pid_set_address) PIDSet();
-      shared_queue_ = new (shared_queue_address) SharedQueue<ElemT>();
-      allocator_ = new (allocator_address)
-          AllocatorT(buffer_address - allocator_address, buffer_size);
+  void remove(int slot) { evict(&entries[slot], entries[slot].owner.load()); }
 
-      pid_set_->insert(getpid());
-      init_shared_queue();
+  // The entry has to be up to date, see `update`.
+  void set_reliable(int slot, bool on) {
+    Entry &entry = entries[slot];
+    uint64_t owner = entry.owner.load();
+    if (((owner & RELIABLE) != 0) == on) {
+      return;
+    }
+    if (on) {
+      entry.owner.store(owner | RELIABLE);
+      reliable++;
+      generation++;
     } else {
-      /*
-       * We do a cast first. So if the shared queue isn't init'd
-       * in time, i.e., `init_shared_queue` is still running,
-       * we need to wait a bit to ensure nothing crazy happens.
-       * The exact time to sleep is just a guess: depends on file IO.
-       * Currently: 10ms.
-       */
-      pid_set_ = reinterpret_cast<PIDSet *>(pid_set_address);
-      shared_queue_ =
-          reinterpret_cast<SharedQueue<ElemT> *>(shared_queue_address);
-      allocator_ = reinterpret_cast<AllocatorT *>(allocator_address);
-      std::this_thread::sleep_for(std::chrono::milliseconds(10));
-
-      /*
-       * Check if any of the participating PIDs are up and running.
-       * If all participating PIDs are dead, reset the underlying memory
-       * structures:
-       * - Reset the allocator's underlying buffer
-       *   - Set the free, allocation indices to 0
-       * - Reset the shared queue
-       *   - Set the counter to 0
-       *   - Set all underlying elements of queue to be empty
-       * - Reset all mutexes/locks
-       */
-      pid_set_->lock();
-      if (!pid_set_->any_alive()) {
-        allocator_->lock_reset();
-        for (auto &elem : shared_queue_->elements) {
-          elem.reset();
+      entry.owner.store(owner & ~RELIABLE);
+      reliable--;
+      wake();
+    }
+  }
+
+  void update(int slot, uint32_t position, uint64_t drops) {
+    Entry &entry = entries[slot];
+    entry.last_read.store(now(), std::memory_order_relaxed);
+    entry.drops.store(drops, std::memory_order_relaxed);
+    entry.position.store(position, std::memory_order_release);
+    if (waiters.any()) {
+      wake();
+    }
+  }
+
+  /*
+   * The position of the reliable entry furthest behind `head` in
+   * `*position`, false if there are none. With `evict_dead`, entries of
+   * dead processes are dropped first. That check isn't cheap, publishers
+   * only ask for it when an entry is in the way.
+   */
+  bool slowest(uint32_t head, uint32_t *position, bool evict_dead) {
+    bool found = false;
+    uint32_t max_lag = 0;
+    for (auto &entry : entries) {
+      uint64_t owner = entry.owner.load();
+      if (!(owner & RELIABLE)) {
+        continue;
+      }
+      if (evict_dead && proc_dead(static_cast<uint32_t>(owner))) {
+        evict(&entry, owner);
+        continue;
+      }
+      int32_t lag = head - entry.position.load(std::memory_order_acquire);
+      if (lag < 0) {
+        lag = 0;
+      }
+      if (!found || static_cast<uint32_t>(lag) >= max_lag) {
+        max_lag = lag;
+        found = true;
+      }
+    }
+    *position = head - max_lag;
+    return found;
+  }
+
+  // Sleeps while `progress` is still `seen`, see `SharedQueue::wait`.
+  void wait(uint32_t seen, std::chrono::nanoseconds timeout) {
+    int slot = waiters.enter();
+    concurrent::futex_wait(&progress, seen, timeout);
+    waiters.leave(slot);
+  }
+
+  void reset() {
+    for (auto &entry : entries) {
+      entry.owner.store(0);
+      entry.id.store(0);
+      entry.position.store(0);
+      entry.last_read.store(0);
+      entry.drops.store(0);
+    }
+    reliable = 0;
+    generation = 0;
+    next_id = 0;
+    progress = 0;
+    waiters.reset();
+  }
+
+  alignas(CACHELINE_SIZE) std::atomic<uint32_t> reliable;
+  std::atomic<uint32_t> generation;
+  std::atomic<uint32_t> next_id;
+  std::atomic<uint32_t> progress;
+  concurrent::Waiters waiters;
+  Entry entries[Size];
+
+ private:
+  int claim(uint32_t position) {
+    uint64_t pid = getpid();
+    for (uint32_t idx = 0; idx < Size; ++idx) {
+      Entry &entry = entries[idx];
+      uint64_t exp = 0;
+      if (entry.owner.load() == 0 &&
+          entry.owner.compare_exchange_strong(exp, pid)) {
+        entry.id.store(++next_id);
+        entry.position.store(position);
+        entry.last_read.store(now());
+        entry.drops.store(0);
+        entry.owner.store(pid | VALID);
+        return idx;
+      }
+    }
+    return -1;
+  }
+
+  void evict(Entry *entry, uint64_t owner) {
+    if (owner != 0 && entry->owner.compare_exchange_strong(owner, 0)) {
+      if (owner & RELIABLE) {
+        reliable--;
+        wake();
+      }
+    }
+  }
+
+  void wake() {
+    progress++;
+    waiters.wake(&progress);
+  }
+};
+
+static constexpr uint32_t MAX_SUBSCRIBERS = 64;
+using Registry = SubscriberRegistry<MAX_SUBSCRIBERS>;
+
+// Geometry of a segment. All offsets are relative to the start of the
+// segment.
+struct SegmentLayout {
+  uint32_t queue_size;
+  uint32_t elem_size;
+  uint32_t backing;
+  uint32_t mirrored;
+  uint32_t seqlock;
+  uint64_t alignment;
+  uint64_t allocator_size;
+  uint64_t buffer_size;
+  uint64_t pid_set_offset;
+  uint64_t registry_offset;
+  uint64_t shared_queue_offset;
+  uint64_t allocator_offset;
+  uint64_t buffer_offset;
+  uint64_t total_size;
+};
+
+enum InitState : uint32_t {
+  UNINIT = 0,
+  INITIALIZING = 1,
+  READY = 2,
+  STALE = 3,
+};
+
+/*
+ * The first bytes of every segment. Written once by the creator of the
+ * segment, and read by every process that joins it afterwards.
+ *
+ * `state` is the initialization handshake, and doubles as a futex word
+ * that joiners sleep on:
+ *   UNINIT:       freshly truncated segment, nothing is valid. If it
+ *                 stays so for `STALE_TIMEOUT`, the creator died.
+ *   INITIALIZING: `magic`, `version`, `creator_pid` and `layout` are valid,
+ *                 the creator is constructing the shared structures.
+ *   READY:        everything is valid.
+ *   STALE:        the segment is being unlinked, open it again.
+ * `magic` and `version` always come first, so a segment with a different
+ * layout version is detected instead of misread.
+ *
+ * Everything up to `pid_set_offset`, and the `PIDSet` it points to, keep
+ * their layout across versions. A process can tell if a segment of
+ * another version is still in use, and replace it if it isn't.
+ */
+struct SegmentHeader {
+  uint32_t magic;
+  uint32_t version;
+  std::atomic<uint32_t> state;
+  std::atomic<uint32_t> creator_pid;
+  uint64_t pid_set_offset;
+  SegmentLayout layout;
+};
+
+template <class ElemT, class AllocatorT>
+class Memory {
+ public:
+  explicit Memory(const std::string &name) : Memory(name, Options()) {}
+
+  /*
+   * Creates the segment `name`, or joins it if it exists. A segment that
+   * can't be joined (another version, another type of topic, or a
+   * creator that died before setting it up) is replaced if none of its
+   * processes are alive. Throws `std::runtime_error` if that isn't the
+   * case, or the segment can't be mapped, and `std::invalid_argument` if
+   * `options.buffer_size` is more than `AllocatorT` can index (e.g. 16gb
+   * for `Allocator`, use `Allocator64`).
+   */
+  Memory(const std::string &name, const Options &options) : name_(name) {
+    SegmentLayout layout = make_layout(options);
+    if (layout.buffer_size > AllocatorT::max_size()) {
+      throw std::invalid_argument(
+          "Buffer of " + std::to_string(layout.buffer_size) +
+          " bytes is too big for the allocator of " + name +
+          ", its limit is " + std::to_string(AllocatorT::max_size()));
+    }
+    const std::string shm_name = "/SHM_" + name;
+
+    // A segment that another process is unlinking has the STALE state. If
+    // it stays for long, that process died, and we unlink it instead.
+    uint32_t stale_rounds = 0;
+    uint32_t retries = 0;
+    while (true) {
+      Attached attached = attach(shm_name, layout, options);
+      if (attached == ATTACHED) {
+        break;
+      }
+      if (attached == FOUND_STALE) {
+        if (++stale_rounds * std::chrono::milliseconds(1) > STALE_TIMEOUT) {
+          unlink_segment(path_, hugetlbfs_);
+          stale_rounds = 0;
         }
-        shared_queue_->counter = 0;
-        allocator_->reset();
-      } else {
-        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+      } else if (++retries > MAX_RETRIES) {
+        throw std::runtime_error("Could not open shared memory segment " +
+                                 name);
       }
-      pid_set_->unlock();
-      pid_set_->insert(getpid());
+    }
+
+    if (options.prefault || options.lock_memory) {
+      prefault_memory_segment(base_address_, mapped_size_);
+    }
+    if (options.lock_memory && mlock(base_address_, mapped_size_) != 0) {
+      std::cerr << "Could not lock shared memory segment " << name << ": "
+                << std::strerror(errno) << ".\n";
     }
   }
 
-  ~Memory() = default;
+  Memory(const Memory &) = delete;
+
+  ~Memory() { munmap(base_address_, mapped_size_); }
 
   void init_shared_queue() {
     /*
@@ -245,12 +834,352 @@ class Memory {
     shared_queue_->counter = 0;
   }
 
-  size_t queue_size() const { return QUEUE_SIZE; }
+  size_t queue_size() const { return header_->layout.queue_size; }
+
+  size_t buffer_size() const { return header_->layout.buffer_size; }
+
+  size_t alignment() const { return header_->layout.alignment; }
+
+  uint32_t backing() const { return header_->layout.backing; }
+
+  bool mirrored() const { return header_->layout.mirrored; }
+
+  bool seqlock() const { return header_->layout.seqlock; }
 
   std::string name_;
   PIDSet *pid_set_;
+  Registry *registry_;
   AllocatorT *allocator_;
   SharedQueue<ElemT> *shared_queue_;
+
+ private:
+  static SegmentLayout make_layout(const Options &options) {
+    /*
+     * Layout of a segment, each region starts at a multiple of
+     * `alignment`, and is separated from the previous one by `GAP`:
+     *   | header | pid set | registry | shared queue | allocator | buffer |
+     */
+    size_t page_size = sysconf(_SC_PAGESIZE);
+    size_t alignment = next_power_of_two(options.alignment);
+    alignment = std::min(std::max(alignment, CACHELINE_SIZE), page_size);
+
+    SegmentLayout layout{};
+    layout.queue_size = next_power_of_two(options.queue_size);
+    layout.elem_size = sizeof(ElemT);
+    layout.mirrored = options.mirrored;
+    layout.seqlock = options.seqlock;
+    layout.alignment = alignment;
+    layout.allocator_size = sizeof(AllocatorT);
+    layout.buffer_size = SHMALIGN(options.buffer_size, alignment);
+    if (layout.mirrored) {
+      // Only whole pages can be mapped twice.
+      layout.buffer_size = SHMALIGN(options.buffer_size, page_size);
+    }
+
+    auto next_region = [alignment](size_t offset, size_t size) {
+      return SHMALIGN(offset + size + GAP, alignment);
+    };
+    layout.pid_set_offset = next_region(0, sizeof(SegmentHeader));
+    layout.registry_offset =
+        next_region(layout.pid_set_offset, sizeof(PIDSet));
+    layout.shared_queue_offset =
+        next_region(layout.registry_offset, sizeof(Registry));
+    layout.allocator_offset =
+        next_region(layout.shared_queue_offset,
+                    SharedQueue<ElemT>::size(layout.queue_size));
+    layout.buffer_offset =
+        next_region(layout.allocator_offset, sizeof(AllocatorT));
+    if (layout.mirrored) {
+      layout.buffer_offset = SHMALIGN(layout.buffer_offset, page_size);
+    }
+    layout.total_size = layout.buffer_offset + layout.buffer_size;
+    return layout;
+  }
+
+  void map_structures() {
+    const SegmentLayout &layout = header_->layout;
+    pid_set_ = reinterpret_cast<PIDSet *>(base_address_ + layout.pid_set_offset);
+    registry_ =
+        reinterpret_cast<Registry *>(base_address_ + layout.registry_offset);
+    shared_queue_ = reinterpret_cast<SharedQueue<ElemT> *>(
+        base_address_ + layout.shared_queue_offset);
+    allocator_ =
+        reinterpret_cast<AllocatorT *>(base_address_ + layout.allocator_offset);
+  }
+
+  void init_segment() {
+    // Called with `state` in INITIALIZING, by the creator or by the joiner
+    // that took over from a dead creator.
+    const SegmentLayout &layout = header_->layout;
+    pid_set_ = new (base_address_ + layout.pid_set_offset) PIDSet();
+    registry_ = new (base_address_ + layout.registry_offset) Registry();
+    shared_queue_ = new (base_address_ + layout.shared_queue_offset)
+        SharedQueue<ElemT>(layout.queue_size);
+    allocator_ = new_allocator(
+        base_address_ + layout.allocator_offset,
+        layout.buffer_offset - layout.allocator_offset, layout.buffer_size,
+        layout.mirrored,
+        std::is_constructible<AllocatorT, size_t, size_t, bool>());
+
+    pid_set_->insert(getpid());
+    init_shared_queue();
+
+    header_->state.store(READY, std::memory_order_release);
+    concurrent::futex_wake(&header_->state);
+  }
+
+  enum Attached {
+    ATTACHED,
+    // Found a segment that is being unlinked.
+    FOUND_STALE,
+    // Unlinked a stale segment, or lost a race, try again.
+    RETRY,
+  };
+
+  static constexpr uint32_t MAX_RETRIES = 100;
+
+  Attached attach(const std::string &shm_name, SegmentLayout layout,
+                  const Options &options) {
+    constexpr size_t padding = 32;
+    size_t total_size = layout.total_size;
+    bool new_segment = false;
+    base_address_ = nullptr;
+    errno = 0;
+
+    if ((options.huge_pages && !options.mirrored &&
+         !shm_segment_exists(shm_name)) ||
+        hugetlbfs_segment_exists(shm_name, options.hugetlbfs_mount)) {
+      base_address_ =
+          create_memory_segment(shm_name, &total_size, &new_segment, padding,
+                                options.hugetlbfs_mount);
+      layout.backing = HUGETLBFS_PAGES;
+      hugetlbfs_ = true;
+      path_ = options.hugetlbfs_mount + shm_name;
+    }
+    if (base_address_ == nullptr && errno == EAGAIN) {
+      return RETRY;
+    }
+    if (base_address_ == nullptr) {
+      total_size = layout.total_size;
+      base_address_ = create_memory_segment(shm_name, &total_size,
+                                            &new_segment, padding);
+      layout.backing = SMALL_PAGES;
+      hugetlbfs_ = false;
+      path_ = shm_name;
+    }
+    if (base_address_ == nullptr) {
+      if (errno == EAGAIN) {
+        return RETRY;
+      }
+      throw std::runtime_error("Could not create/open shared memory segment " +
+                               name_ + ": " + std::strerror(errno));
+    }
+    mapped_size_ = total_size + padding;
+    header_ = reinterpret_cast<SegmentHeader *>(base_address_);
+
+    if (!new_segment) {
+      return join(total_size);
+    }
+
+    /*
+     * Claim the segment before the slow parts of the setup (mirroring,
+     * huge pages), so joiners can tell if we die in the middle of it.
+     */
+    header_->magic = SEGMENT_MAGIC;
+    header_->version = SEGMENT_VERSION;
+    header_->pid_set_offset = layout.pid_set_offset;
+    header_->layout = layout;
+    header_->creator_pid.store(getpid());
+    header_->state.store(INITIALIZING, std::memory_order_release);
+
+    if (layout.mirrored && !mirror_buffer(shm_name, layout)) {
+      abandon();
+      throw std::runtime_error("Could not mirror shared memory segment " +
+                               name_);
+    }
+    if (options.huge_pages && layout.backing == SMALL_PAGES &&
+        request_transparent_huge_pages(base_address_, mapped_size_)) {
+      header_->layout.backing = TRANSPARENT_HUGE_PAGES;
+    }
+    if (options.huge_pages && header_->layout.backing != HUGETLBFS_PAGES) {
+      std::cerr << "Huge pages unavailable for " << name_ << ", using "
+                << backing_name(header_->layout.backing) << ".\n";
+    }
+    init_segment();
+    return ATTACHED;
+  }
+
+  Attached join(size_t segment_size) {
+    /*
+     * Wait for the creator to finish the handshake. If the creator died
+     * half way through, the first joiner to notice takes over and
+     * finishes the initialization.
+     */
+    auto start = std::chrono::steady_clock::now();
+    while (true) {
+      uint32_t state = header_->state.load(std::memory_order_acquire);
+      if (state == STALE) {
+        unmap();
+        return FOUND_STALE;
+      }
+      if (header_->magic != SEGMENT_MAGIC &&
+          (header_->magic != 0 || state != UNINIT)) {
+        // Not a segment of any version with a header.
+        return replace_unused(segment_size);
+      }
+      if (state == READY || state == INITIALIZING) {
+        if (!valid_header(segment_size)) {
+          return replace_unused(segment_size);
+        }
+        if (state == READY) {
+          break;
+        }
+        uint32_t creator = header_->creator_pid.load();
+        if (proc_dead(creator) &&
+            header_->creator_pid.compare_exchange_strong(creator, getpid())) {
+          init_segment();
+          break;
+        }
+      } else if (std::chrono::steady_clock::now() - start > STALE_TIMEOUT) {
+        // Still UNINIT, the creator died before claiming the segment.
+        return replace_unused(segment_size);
+      }
+      // The timeout only bounds how often a dead creator is checked for.
+      concurrent::futex_wait(&header_->state, state,
+                             std::chrono::milliseconds(1));
+    }
+
+    SegmentLayout joined_layout = header_->layout;
+    if (joined_layout.mirrored && !mirror_buffer(path_, joined_layout)) {
+      unmap();
+      throw std::runtime_error("Could not mirror shared memory segment " +
+                               name_);
+    }
+    map_structures();
+    if (header_->layout.backing == TRANSPARENT_HUGE_PAGES) {
+      request_transparent_huge_pages(base_address_, mapped_size_);
+    }
+
+    /*
+     * Check if any of the participating PIDs are up and running.
+     * If all participating PIDs are dead, reset the underlying memory
+     * structures:
+     * - Reset the allocator's underlying buffer
+     *   - Set the free, allocation indices to 0
+     * - Reset the shared queue
+     *   - Set the counter to 0
+     *   - Set all underlying elements of queue to be empty
+     * - Reset all mutexes/locks
+     */
+    pid_set_->lock();
+    if (!pid_set_->any_alive()) {
+      allocator_->lock_reset();
+      for (uint32_t idx = 0; idx < queue_size(); ++idx) {
+        shared_queue_->elements()[idx].reset();
+      }
+      shared_queue_->counter = 0;
+      shared_queue_->waiters.reset();
+      registry_->reset();
+      allocator_->reset();
+    }
+    pid_set_->unlock();
+    pid_set_->insert(getpid());
+    return ATTACHED;
+  }
+
+  /*
+   * Whether any process of a segment that can't be joined is alive. Its
+   * PIDs are found through the part of the header that every version
+   * shares. Versions before that only record their creator, and segments
+   * from before there was a header have their `PIDSet` at the start.
+   */
+  bool in_use(size_t segment_size) const {
+    if (header_->magic != SEGMENT_MAGIC) {
+      return sizeof(PIDSet) <= segment_size &&
+             reinterpret_cast<PIDSet *>(base_address_)->any_running();
+    }
+    if (header_->version < STABLE_PREFIX_VERSION) {
+      return !proc_dead(header_->creator_pid.load());
+    }
+    uint64_t offset = header_->pid_set_offset;
+    return offset > segment_size || segment_size - offset < sizeof(PIDSet) ||
+           reinterpret_cast<PIDSet *>(base_address_ + offset)->any_running();
+  }
+
+  // Unlinks a segment that can't be joined, so it can be created anew.
+  Attached replace_unused(size_t segment_size) {
+    if (in_use(segment_size)) {
+      unmap();
+      throw std::runtime_error("Incompatible shared memory segment " + name_ +
+                               " is in use");
+    }
+    uint32_t state = header_->state.load();
+    Attached attached = FOUND_STALE;
+    if (state != STALE &&
+        header_->state.compare_exchange_strong(state, STALE)) {
+      concurrent::futex_wake(&header_->state);
+      unlink_segment(path_, hugetlbfs_);
+      attached = RETRY;
+    }
+    unmap();
+    return attached;
+  }
+
+  // Gives up a segment we created but couldn't set up.
+  void abandon() {
+    header_->state.store(STALE);
+    concurrent::futex_wake(&header_->state);
+    unlink_segment(path_, hugetlbfs_);
+    unmap();
+  }
+
+  void unmap() {
+    munmap(base_address_, mapped_size_);
+    base_address_ = nullptr;
+    header_ = nullptr;
+  }
+
+  static AllocatorT *new_allocator(uint8_t *address, size_t offset,
+                                   size_t size, bool mirrored,
+                                   std::true_type /* takes mirrored */) {
+    return new (address) AllocatorT(offset, size, mirrored);
+  }
+
+  static AllocatorT *new_allocator(uint8_t *address, size_t offset,
+                                   size_t size, bool /* mirrored */,
+                                   std::false_type /* takes mirrored */) {
+    // Allocators that never wrap have no use for the mirror.
+    return new (address) AllocatorT(offset, size);
+  }
+
+  bool mirror_buffer(const std::string &shm_name, const SegmentLayout &layout) {
+    // Replaces the mapping of the segment with a mirrored one.
+    uint8_t *base = mirror_memory_segment(shm_name, layout.buffer_offset,
+                                          layout.buffer_size);
+    if (base == nullptr) {
+      return false;
+    }
+    munmap(base_address_, mapped_size_);
+    base_address_ = base;
+    mapped_size_ = layout.buffer_offset + 2 * layout.buffer_size;
+    header_ = reinterpret_cast<SegmentHeader *>(base_address_);
+    return true;
+  }
+
+  bool valid_header(size_t segment_size) const {
+    return header_->magic == SEGMENT_MAGIC &&
+           header_->version == SEGMENT_VERSION &&
+           header_->layout.elem_size == sizeof(ElemT) &&
+           header_->layout.allocator_size == sizeof(AllocatorT) &&
+           header_->layout.total_size <= segment_size;
+  }
+
+  uint8_t *base_address_;
+  size_t mapped_size_;
+  SegmentHeader *header_;
+  // Where the segment lives, see `unlink_segment`.
+  std::string path_;
+  bool hugetlbfs_ = false;
 };
 
 }  // namespace shm::memory
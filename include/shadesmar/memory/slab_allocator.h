@@ -0,0 +1,278 @@
+/* MIT License
+
+Copyright (c) 2020 Dheeraj R Reddy
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+==============================================================================*/
+
+#ifndef INCLUDE_SHADESMAR_MEMORY_SLAB_ALLOCATOR_H_
+#define INCLUDE_SHADESMAR_MEMORY_SLAB_ALLOCATOR_H_
+
+#include <atomic>
+#include <cassert>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+
+#include "shadesmar/macros.h"
+
+namespace shm::memory {
+
+/*
+ * Size-class allocator for topics of fixed or small messages. Every
+ * allocation is rounded up to a power of two (at least `MIN_BLOCK`), and
+ * each size class has its own lock-free free list. Alloc and free are a
+ * single CAS on the list of their class, different sizes never touch the
+ * same cache line.
+ *
+ * The heap is carved into chunks of `CHUNK_SIZE` bytes on demand, a chunk
+ * (or a run of chunks for classes larger than a chunk) is split into
+ * blocks of one class. Memory handed to a class stays with it. The class
+ * of every chunk is kept in a table at the start of the heap, so blocks
+ * don't need headers. A bitmap after it has a bit per `MIN_BLOCK` unit,
+ * set while the block starting there is allocated, so a double free is
+ * reported instead of linking the block into its list twice.
+ *
+ * Free lists link blocks by their index in the heap instead of pointers, so
+ * they work at any mapping address. The list heads carry a tag that is
+ * bumped on every change against ABA.
+ *
+ * A process that dies between taking a chunk (`carved_`) and pushing its
+ * blocks leaks that chunk until the topic is reset.
+ */
+class SlabAllocator {
+ public:
+  using handle = uint64_t;
+
+  static constexpr size_t MIN_BLOCK = 64;
+  static constexpr size_t CHUNK_SIZE = 64 * 1024;
+  static constexpr uint32_t NUM_CLASSES = 32;
+
+  SlabAllocator(size_t offset, size_t size);
+
+  /*
+   * A heap that holds `blocks` blocks of up to `block_size` bytes at once.
+   * Memory stays with a class, so every class up to that of `block_size`
+   * gets room for all of them. The chunk table and bitmap take a byte per
+   * chunk and a bit per unit ahead of the chunks.
+   */
+  static size_t required_size(size_t blocks, size_t block_size) {
+    size_t data = 0;
+    for (uint32_t c = 0; c <= class_of(block_size) && c < NUM_CLASSES; ++c) {
+      size_t carve_size =
+          class_size(c) > CHUNK_SIZE ? class_size(c) : size_t(CHUNK_SIZE);
+      size_t per_carve = carve_size / class_size(c);
+      data += (blocks + per_carve - 1) / per_carve * carve_size;
+    }
+    return data + ((data / 256 + 256 + MIN_BLOCK - 1) & ~(MIN_BLOCK - 1));
+  }
+
+  // Blocks are linked by `uint32_t` index + 1.
+  static constexpr size_t max_size() {
+    return size_t(std::numeric_limits<uint32_t>::max() - 1) * MIN_BLOCK;
+  }
+
+  uint8_t *alloc(size_t bytes);
+  bool free(const uint8_t *ptr);
+  void reset();
+  void lock_reset() {}
+
+  inline handle ptr_to_handle(uint8_t *p) { return p - heap_(); }
+  uint8_t *handle_to_ptr(handle h) { return heap_() + h; }
+
+  size_t get_free_memory() {
+    size_t free_size = data_size_ - carved_.load();
+    for (uint32_t c = 0; c < NUM_CLASSES; ++c) {
+      free_size += classes_[c].free_blocks.load() * class_size(c);
+    }
+    return free_size;
+  }
+
+ private:
+  struct alignas(CACHELINE_SIZE) SizeClass {
+    // (tag << 32) | (block index + 1), 0 is the empty list.
+    std::atomic<uint64_t> head;
+    std::atomic<uint64_t> free_blocks;
+  };
+
+  static size_t class_size(uint32_t c) { return MIN_BLOCK << c; }
+  static uint32_t class_of(size_t bytes);
+  static uint64_t make_head(uint64_t head, uint32_t index) {
+    return (((head >> 32) + 1) << 32) | index;
+  }
+
+  bool carve(uint32_t c);
+  void push(uint32_t c, uint32_t first, uint32_t last, uint32_t count);
+  uint32_t pop(uint32_t c);
+
+  uint32_t *next_of(uint32_t index) {
+    return reinterpret_cast<uint32_t *>(data_() + (index - 1) * MIN_BLOCK);
+  }
+  uint32_t index_of(const uint8_t *ptr) {
+    return (ptr - data_()) / MIN_BLOCK + 1;
+  }
+  // Sets or clears the allocated bit of the block at `index`, and returns
+  // what it was.
+  bool mark(uint32_t index, bool allocated) {
+    uint64_t *word = bitmap_() + (index - 1) / 64;
+    uint64_t bit = 1ull << ((index - 1) % 64);
+    uint64_t old = allocated ? __atomic_fetch_or(word, bit, __ATOMIC_ACQ_REL)
+                             : __atomic_fetch_and(word, ~bit, __ATOMIC_ACQ_REL);
+    return old & bit;
+  }
+
+  uint8_t *__attribute__((always_inline)) heap_() {
+    return reinterpret_cast<uint8_t *>(this) + offset_;
+  }
+  uint8_t *chunk_classes_() { return heap_(); }
+  uint64_t *bitmap_() {
+    return reinterpret_cast<uint64_t *>(heap_() + bitmap_offset_);
+  }
+  uint8_t *data_() { return heap_() + data_offset_; }
+
+  SizeClass classes_[NUM_CLASSES];
+  alignas(CACHELINE_SIZE) std::atomic<size_t> carved_;
+  alignas(CACHELINE_SIZE) size_t offset_;
+  size_t size_;
+  size_t bitmap_offset_;
+  size_t bitmap_size_;
+  size_t data_offset_;
+  size_t data_size_;
+};
+
+SlabAllocator::SlabAllocator(size_t offset, size_t size)
+    : carved_(0), offset_(offset), size_(size) {
+  // One byte per chunk for its class, then a bit per unit, ahead of the
+  // chunks themselves.
+  size_t num_chunks = size / CHUNK_SIZE;
+  constexpr size_t word = sizeof(uint64_t);
+  bitmap_offset_ = (num_chunks + word - 1) & ~(word - 1);
+  bitmap_size_ = (size / MIN_BLOCK + 63) / 64 * sizeof(uint64_t);
+  data_offset_ =
+      (bitmap_offset_ + bitmap_size_ + MIN_BLOCK - 1) & ~(MIN_BLOCK - 1);
+  data_size_ = data_offset_ < size ? size - data_offset_ : 0;
+  data_size_ -= data_size_ % CHUNK_SIZE;
+  reset();
+}
+
+uint32_t SlabAllocator::class_of(size_t bytes) {
+  uint32_t c = 0;
+  while (c < NUM_CLASSES && class_size(c) < bytes) {
+    ++c;
+  }
+  return c;
+}
+
+void SlabAllocator::push(uint32_t c, uint32_t first, uint32_t last,
+                         uint32_t count) {
+  SizeClass &size_class = classes_[c];
+  uint64_t head = size_class.head.load();
+  do {
+    __atomic_store_n(next_of(last), static_cast<uint32_t>(head),
+                     __ATOMIC_RELAXED);
+  } while (
+      !size_class.head.compare_exchange_weak(head, make_head(head, first)));
+  size_class.free_blocks += count;
+}
+
+uint32_t SlabAllocator::pop(uint32_t c) {
+  SizeClass &size_class = classes_[c];
+  uint64_t head = size_class.head.load();
+  while (static_cast<uint32_t>(head) != 0) {
+    // If another process pops this block first, `next` may be garbage, but
+    // then the tag has changed and the CAS fails.
+    uint32_t next = __atomic_load_n(next_of(head), __ATOMIC_RELAXED);
+    if (size_class.head.compare_exchange_weak(head, make_head(head, next))) {
+      size_class.free_blocks--;
+      return head;
+    }
+  }
+  return 0;
+}
+
+bool SlabAllocator::carve(uint32_t c) {
+  size_t block_size = class_size(c);
+  size_t carve_size = block_size > CHUNK_SIZE ? block_size : CHUNK_SIZE;
+
+  size_t carved = carved_.load();
+  do {
+    if (carved + carve_size > data_size_) {
+      return false;
+    }
+  } while (!carved_.compare_exchange_weak(carved, carved + carve_size));
+
+  for (size_t chunk = carved / CHUNK_SIZE;
+       chunk < (carved + carve_size) / CHUNK_SIZE; ++chunk) {
+    chunk_classes_()[chunk] = c;
+  }
+
+  uint32_t first = index_of(data_() + carved);
+  uint32_t count = carve_size / block_size;
+  uint32_t stride = block_size / MIN_BLOCK;
+  for (uint32_t b = 0; b + 1 < count; ++b) {
+    *next_of(first + b * stride) = first + (b + 1) * stride;
+  }
+  push(c, first, first + (count - 1) * stride, count);
+  return true;
+}
+
+uint8_t *SlabAllocator::alloc(size_t bytes) {
+  uint32_t c = class_of(bytes);
+  if (c >= NUM_CLASSES || class_size(c) > data_size_) {
+    return nullptr;
+  }
+
+  uint32_t index;
+  while ((index = pop(c)) == 0) {
+    if (!carve(c)) {
+      return nullptr;
+    }
+  }
+  mark(index, true);
+  return reinterpret_cast<uint8_t *>(next_of(index));
+}
+
+bool SlabAllocator::free(const uint8_t *ptr) {
+  if (ptr == nullptr) {
+    return true;
+  }
+  assert(ptr >= data_());
+  assert(ptr < data_() + carved_.load());
+
+  uint32_t c = chunk_classes_()[(ptr - data_()) / CHUNK_SIZE];
+  uint32_t index = index_of(ptr);
+  if (!mark(index, false)) {
+    // Freed already, or not the start of a block.
+    return false;
+  }
+  push(c, index, index, 1);
+  return true;
+}
+
+void SlabAllocator::reset() {
+  for (auto &size_class : classes_) {
+    size_class.head = 0;
+    size_class.free_blocks = 0;
+  }
+  carved_ = 0;
+  std::memset(bitmap_(), 0, bitmap_size_);
+}
+
+}  // namespace shm::memory
+#endif  // INCLUDE_SHADESMAR_MEMORY_SLAB_ALLOCATOR_H_
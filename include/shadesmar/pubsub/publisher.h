@@ -24,51 +24,144 @@ SOFTWARE.
 #ifndef INCLUDE_SHADESMAR_PUBSUB_PUBLISHER_H_
 #define INCLUDE_SHADESMAR_PUBSUB_PUBLISHER_H_
 
+#include <algorithm>
 #include <cstdint>
 #include <cstring>
 #include <iostream>
 #include <memory>
 #include <string>
 #include <utility>
+#include <vector>
 
 #include "shadesmar/memory/copier.h"
 #include "shadesmar/pubsub/topic.h"
 
 namespace shm::pubsub {
 
-class Publisher {
+template <class AllocatorT>
+class PublisherT {
  public:
-  explicit Publisher(const std::string &topic_name);
-  Publisher(const std::string &topic_name,
-            std::shared_ptr<memory::Copier> copier);
-  Publisher(const Publisher &) = delete;
-  Publisher(Publisher &&);
+  explicit PublisherT(const std::string &topic_name);
+  PublisherT(const std::string &topic_name,
+             std::shared_ptr<memory::Copier> copier,
+             const memory::Options &options = memory::Options());
+  PublisherT(const PublisherT &) = delete;
+  PublisherT(PublisherT &&);
   bool publish(void *data, size_t size);
 
+  // Publishes `count` messages at once, see `TopicT::write_batch`. Returns
+  // false if the buffer is full.
+  bool publish_batch(const memory::Memblock *messages, size_t count);
+  bool publish_batch(const std::vector<memory::Memblock> &messages) {
+    return publish_batch(messages.data(), messages.size());
+  }
+
+  /*
+   * Zero-copy publishing: `borrow` returns `size` writable bytes inside
+   * the topic's shared memory (empty if the buffer is full). Fill them in
+   * place, then `commit` the loan to publish it, or `abort` it. The size
+   * of the loan may be reduced before committing, e.g. to the length of
+   * a serialized message. `commit` returns false for an empty loan, or
+   * one that grew past what was borrowed.
+   */
+  memory::Memblock borrow(size_t size);
+  bool commit(memory::Memblock loan);
+  void abort(memory::Memblock loan);
+
+  // What `publish` does when a reliable subscriber is a whole queue behind,
+  // see `BackPressure`. Waits for it by default.
+  void set_back_pressure(const BackPressure &back_pressure) {
+    topic_->set_back_pressure(back_pressure);
+  }
+
+  // The subscribers of the topic, see `TopicT::subscribers`.
+  std::vector<SubscriberInfo> subscribers() { return topic_->subscribers(); }
+
  private:
+  using Loans = std::vector<std::pair<uint8_t *, size_t>>;
+  typename Loans::iterator find_loan(void *ptr) {
+    return std::find_if(loans_.begin(), loans_.end(),
+                        [ptr](const typename Loans::value_type &loan) {
+                          return loan.first == ptr;
+                        });
+  }
+
   std::string topic_name_;
-  std::unique_ptr<Topic> topic_;
+  std::unique_ptr<TopicT<AllocatorT>> topic_;
+  // Loans that weren't committed or aborted yet, and their sizes.
+  Loans loans_;
 };
 
-Publisher::Publisher(const std::string &topic_name) : topic_name_(topic_name) {
-  topic_ = std::make_unique<Topic>(topic_name);
+using Publisher = PublisherT<memory::Allocator>;
+
+template <class AllocatorT>
+PublisherT<AllocatorT>::PublisherT(const std::string &topic_name)
+    : topic_name_(topic_name) {
+  topic_ = std::make_unique<TopicT<AllocatorT>>(topic_name);
 }
 
-Publisher::Publisher(const std::string &topic_name,
-                     std::shared_ptr<memory::Copier> copier)
+template <class AllocatorT>
+PublisherT<AllocatorT>::PublisherT(const std::string &topic_name,
+                                   std::shared_ptr<memory::Copier> copier,
+                                   const memory::Options &options)
     : topic_name_(topic_name) {
-  topic_ = std::make_unique<Topic>(topic_name, copier);
+  topic_ = std::make_unique<TopicT<AllocatorT>>(topic_name, copier, options);
 }
 
-Publisher::Publisher(Publisher &&other) {
+template <class AllocatorT>
+PublisherT<AllocatorT>::PublisherT(PublisherT &&other) {
   topic_name_ = other.topic_name_;
   topic_ = std::move(other.topic_);
+  loans_ = std::move(other.loans_);
 }
 
-bool Publisher::publish(void *data, size_t size) {
+template <class AllocatorT>
+bool PublisherT<AllocatorT>::publish(void *data, size_t size) {
   memory::Memblock memblock(data, size);
   return topic_->write(memblock);
 }
 
+template <class AllocatorT>
+bool PublisherT<AllocatorT>::publish_batch(const memory::Memblock *messages,
+                                           size_t count) {
+  return topic_->write_batch(messages, count);
+}
+
+template <class AllocatorT>
+memory::Memblock PublisherT<AllocatorT>::borrow(size_t size) {
+  memory::Memblock loan;
+  loan.ptr = topic_->borrow(size);
+  if (loan.ptr != nullptr) {
+    loan.size = size;
+    loans_.emplace_back(reinterpret_cast<uint8_t *>(loan.ptr), size);
+  }
+  // Owned by the topic, not by the caller.
+  loan.no_delete();
+  return loan;
+}
+
+template <class AllocatorT>
+bool PublisherT<AllocatorT>::commit(memory::Memblock loan) {
+  auto it = find_loan(loan.ptr);
+  if (it == loans_.end() || loan.size > it->second) {
+    return false;
+  }
+  if (!topic_->commit(it->first, loan.size)) {
+    return false;
+  }
+  loans_.erase(it);
+  return true;
+}
+
+template <class AllocatorT>
+void PublisherT<AllocatorT>::abort(memory::Memblock loan) {
+  auto it = find_loan(loan.ptr);
+  if (it == loans_.end()) {
+    return;
+  }
+  topic_->abort(it->first);
+  loans_.erase(it);
+}
+
 }  // namespace shm::pubsub
 #endif  // INCLUDE_SHADESMAR_PUBSUB_PUBLISHER_H_
@@ -24,65 +24,266 @@ SOFTWARE.
 #ifndef INCLUDE_SHADESMAR_PUBSUB_SUBSCRIBER_H_
 #define INCLUDE_SHADESMAR_PUBSUB_SUBSCRIBER_H_
 
+#include <unistd.h>
+
 #include <atomic>
+#include <chrono>
 #include <cstdint>
 #include <cstring>
 #include <functional>
 #include <iostream>
+#include <limits>
 #include <memory>
 #include <string>
 #include <utility>
+#include <vector>
 
+#include "shadesmar/concurrency/wait_strategy.h"
 #include "shadesmar/memory/copier.h"
 #include "shadesmar/pubsub/topic.h"
 
 namespace shm::pubsub {
 
-class Subscriber {
+template <class AllocatorT>
+class SubscriberT {
  public:
-  Subscriber(const std::string &topic_name,
-             std::function<void(memory::Memblock *)> callback);
-  Subscriber(const std::string &topic_name,
-             std::function<void(memory::Memblock *)> callback,
-             std::shared_ptr<memory::Copier> copier);
+  SubscriberT(const std::string &topic_name,
+              std::function<void(memory::Memblock *)> callback);
+  SubscriberT(const std::string &topic_name,
+              std::function<void(memory::Memblock *)> callback,
+              std::shared_ptr<memory::Copier> copier,
+              const memory::Options &options = memory::Options());
 
-  Subscriber(const Subscriber &other) = delete;
+  SubscriberT(const SubscriberT &other) = delete;
 
-  Subscriber(Subscriber &&other);
+  SubscriberT(SubscriberT &&other);
+  ~SubscriberT();
 
   memory::Memblock get_message();
   void spin_once();
+  // Like `spin_once()`, but sleeps for up to `timeout` if there's no new
+  // message yet.
+  void spin_once(std::chrono::nanoseconds timeout);
+  // Handles messages until `stop()`, waiting for new ones as set by
+  // `set_wait_strategy` (blocking by default).
   void spin();
   void stop();
 
+  /*
+   * With zero-copy reads, the callback gets a view straight into shared
+   * memory instead of a private copy. The view is read-only, and only
+   * valid until the callback returns (`no_delete()` doesn't extend it).
+   * The publisher won't reuse the memory while it's viewed. Topics in
+   * seqlock mode always copy.
+   */
+  void set_zero_copy(bool zero_copy) { zero_copy_ = zero_copy; }
+
+  void set_wait_strategy(const concurrent::WaitStrategy &wait_strategy) {
+    wait_strategy_ = wait_strategy;
+  }
+
+  /*
+   * For state topics (see `memory::Options::keep_last`): every read skips
+   * straight to the newest message, whatever was published before it is
+   * dropped. Reads cost the same however far behind the subscriber is.
+   */
+  void set_latest_only(bool latest_only) { latest_only_ = latest_only; }
+
+  /*
+   * A reliable subscriber doesn't lose messages: it registers a cursor in
+   * the topic, and publishers wait for it instead of overwriting what it
+   * hasn't read, see `BackPressure`. Only messages published after this
+   * call are guaranteed. A message counts as read once its callback has
+   * returned (or, with `get_message()`, on the next call). Returns false
+   * if the subscriber isn't in the registry of the topic, which has room
+   * for `memory::MAX_SUBSCRIBERS`.
+   */
+  bool set_reliable(bool reliable);
+
+  /*
+   * A file descriptor that polls readable when there may be new messages,
+   * to multiplex many subscribers in one event loop (epoll, select, ...).
+   * When it's readable, call `spin_ready()`. Returns -1 on failure.
+   */
+  int fd();
+  // Handles the messages that are already there, and re-arms `fd()`.
+  void spin_ready();
+
+  /*
+   * Handles up to `max` of the messages that are there when it's called,
+   * without waiting, and returns how many it handled. Unlike calling
+   * `spin_once()` in a loop, the head of the topic is read once, and the
+   * upcoming slots are prefetched. A subscriber that was lapped resumes at
+   * the oldest message left in the queue instead of jumping ahead.
+   */
+  size_t spin_some(size_t max);
+
+  /*
+   * Like `spin_some`, but hands all the messages to `callback` in a single
+   * call, oldest first. They're valid until `callback` returns.
+   */
+  using BatchCallback = std::function<void(memory::Memblock *, size_t)>;
+  size_t spin_batch(const BatchCallback &callback,
+                    size_t max = std::numeric_limits<size_t>::max());
+
   std::atomic<uint32_t> counter_{0};
 
  private:
+  using Pin = typename TopicT<AllocatorT>::Pin;
+
+  // How many slots ahead of the one being read `spin_some` prefetches.
+  static constexpr uint32_t PREFETCH_DISTANCE = 4;
+  // How many messages a subscriber that isn't reliable handles before it
+  // updates its registry entry, see `report`.
+  static constexpr uint32_t REPORT_INTERVAL = 64;
+
+  memory::Memblock get_message(Pin *pin);
+  uint32_t catch_up();
+  bool read_next(memory::Memblock *memblock, Pin *pin);
+  void release(memory::Memblock *memblock, Pin *pin);
+  void advance();
+  void skip_to(uint32_t pos);
+  void count_drops(uint32_t from);
+  void report();
+  void report_if_moved() {
+    if (slot_ >= 0 && reported_ != counter_) {
+      report();
+    }
+  }
+
+  bool zero_copy_ = false;
+  bool latest_only_ = false;
+  // The entry in the topic's registry (-1 if it was full), see `report`.
+  int slot_ = -1;
+  bool reliable_ = false;
+  bool started_ = false;
+  uint32_t reported_ = 0;
+  uint64_t drops_ = 0;
+  int fd_ = -1;
+  concurrent::WaitStrategy wait_strategy_ =
+      concurrent::WaitStrategy::blocking();
   std::atomic_bool running_{false};
   std::function<void(memory::Memblock *)> callback_;
   std::string topic_name_;
-  std::unique_ptr<Topic> topic_;
+  std::unique_ptr<TopicT<AllocatorT>> topic_;
+
+  // Reused by `spin_batch`.
+  std::vector<memory::Memblock> batch_;
+  std::vector<Pin> batch_pins_;
 };
 
-Subscriber::Subscriber(const std::string &topic_name,
-                       std::function<void(memory::Memblock *)> callback)
+using Subscriber = SubscriberT<memory::Allocator>;
+
+template <class AllocatorT>
+SubscriberT<AllocatorT>::SubscriberT(
+    const std::string &topic_name,
+    std::function<void(memory::Memblock *)> callback)
     : topic_name_(topic_name), callback_(std::move(callback)) {
-  topic_ = std::make_unique<Topic>(topic_name_);
+  topic_ = std::make_unique<TopicT<AllocatorT>>(topic_name_);
+  slot_ = topic_->register_subscriber(counter_);
 }
 
-Subscriber::Subscriber(const std::string &topic_name,
-                       std::function<void(memory::Memblock *)> callback,
-                       std::shared_ptr<memory::Copier> copier)
+template <class AllocatorT>
+SubscriberT<AllocatorT>::SubscriberT(
+    const std::string &topic_name,
+    std::function<void(memory::Memblock *)> callback,
+    std::shared_ptr<memory::Copier> copier, const memory::Options &options)
     : topic_name_(topic_name), callback_(std::move(callback)) {
-  topic_ = std::make_unique<Topic>(topic_name_, copier);
+  topic_ = std::make_unique<TopicT<AllocatorT>>(topic_name_, copier, options);
+  slot_ = topic_->register_subscriber(counter_);
 }
 
-Subscriber::Subscriber(Subscriber &&other) {
+template <class AllocatorT>
+SubscriberT<AllocatorT>::SubscriberT(SubscriberT &&other) {
   callback_ = std::move(other.callback_);
+  topic_name_ = std::move(other.topic_name_);
   topic_ = std::move(other.topic_);
+  zero_copy_ = other.zero_copy_;
+  latest_only_ = other.latest_only_;
+  counter_ = other.counter_.load();
+  slot_ = other.slot_;
+  other.slot_ = -1;
+  reliable_ = other.reliable_;
+  started_ = other.started_;
+  reported_ = other.reported_;
+  drops_ = other.drops_;
+  wait_strategy_ = other.wait_strategy_;
+  fd_ = other.fd_;
+  other.fd_ = -1;
+}
+
+template <class AllocatorT>
+SubscriberT<AllocatorT>::~SubscriberT() {
+  if (fd_ >= 0) {
+    topic_->close_fd(fd_);
+  }
+  if (slot_ >= 0) {
+    topic_->unregister_subscriber(slot_);
+  }
+}
+
+template <class AllocatorT>
+bool SubscriberT<AllocatorT>::set_reliable(bool reliable) {
+  if (slot_ < 0) {
+    std::cerr << "Subscriber registry of " << topic_name_ << " is full\n";
+    return !reliable;
+  }
+  if (reliable) {
+    // The publishers go by the registry, it has to be up to date first.
+    catch_up();
+    report();
+  }
+  reliable_ = reliable;
+  topic_->set_reliable(slot_, reliable);
+  return true;
+}
+
+/*
+ * The registry entry is written every `REPORT_INTERVAL` messages, at the
+ * end of `spin_some` and `spin_batch`, and when there are no new messages,
+ * so a busy subscriber doesn't pay for it on every message. Publishers
+ * wait on the entries of reliable subscribers, those are written on every
+ * message.
+ */
+template <class AllocatorT>
+void SubscriberT<AllocatorT>::report() {
+  topic_->update_subscriber(slot_, counter_, drops_);
+  reported_ = counter_;
+}
+
+template <class AllocatorT>
+void SubscriberT<AllocatorT>::advance() {
+  counter_++;
+  if (slot_ >= 0 && (reliable_ || counter_ - reported_ >= REPORT_INTERVAL)) {
+    report();
+  }
+}
+
+// Messages skipped before the first read don't count as dropped, they were
+// published before the subscriber got there.
+template <class AllocatorT>
+void SubscriberT<AllocatorT>::count_drops(uint32_t from) {
+  int32_t skipped = counter_ - from;
+  if (started_ && skipped > 0) {
+    drops_ += skipped;
+  }
+}
+
+template <class AllocatorT>
+void SubscriberT<AllocatorT>::skip_to(uint32_t pos) {
+  uint32_t from = counter_;
+  counter_ = pos;
+  count_drops(from);
+}
+
+template <class AllocatorT>
+memory::Memblock SubscriberT<AllocatorT>::get_message() {
+  report_if_moved();
+  return get_message(nullptr);
 }
 
-memory::Memblock Subscriber::get_message() {
+template <class AllocatorT>
+memory::Memblock SubscriberT<AllocatorT>::get_message(Pin *pin) {
   /*
    * topic's `counter` must be strictly greater than counter.
    * If they're equal, there have been no new writes.
@@ -90,10 +291,17 @@ memory::Memblock Subscriber::get_message() {
    */
   if (topic_->counter() <= counter_) {
     // no new messages
+    report_if_moved();
     return memory::Memblock();
   }
 
-  if (topic_->counter() - counter_ >= topic_->queue_size()) {
+  if (latest_only_) {
+    // The head may be under write, the slot before it is the newest.
+    skip_to(topic_->counter() - 1);
+  } else if (reliable_) {
+    // Only lapped by messages published before it registered.
+    catch_up();
+  } else if (topic_->counter() - counter_ >= topic_->queue_size()) {
     /*
      * Why is the check >= (not >)? This is because in topic's
      * `write` we do an `inc` at the end, so the write head
@@ -109,45 +317,186 @@ memory::Memblock Subscriber::get_message() {
      * We move to a more optimistic location (see `jumpahead`), to prevent
      * hitting a case of always trying to keep up with the publisher.
      */
-    counter_ = jumpahead(topic_->counter(), topic_->queue_size());
+    skip_to(jumpahead(topic_->counter(), topic_->queue_size()));
   }
 
   memory::Memblock memblock;
   memblock.free = true;
 
-  if (!topic_->read(&memblock, &counter_)) {
+  // `read` jumps ahead too if the publisher got there first.
+  uint32_t from = counter_;
+  if (!topic_->read(&memblock, &counter_, pin)) {
     return memory::Memblock();
   }
+  count_drops(from);
+  started_ = true;
 
   return memblock;
 }
 
 // Not thread-safe. Should be called from a single thread.
-void Subscriber::spin_once() {
-  memory::Memblock memblock = get_message();
+template <class AllocatorT>
+void SubscriberT<AllocatorT>::spin_once() {
+  Pin pin;
+  memory::Memblock memblock = get_message(zero_copy_ ? &pin : nullptr);
 
   if (memblock.is_empty()) {
     return;
   }
 
   callback_(&memblock);
-  counter_++;
+  advance();
+  release(&memblock, &pin);
+}
+
+template <class AllocatorT>
+void SubscriberT<AllocatorT>::release(memory::Memblock *memblock, Pin *pin) {
+  if (pin->elem != nullptr) {
+    topic_->unpin(pin);
+  } else if (memblock->free) {
+    topic_->copier()->dealloc(memblock->ptr);
+    memblock->ptr = nullptr;
+    memblock->size = 0;
+  }
+}
+
+template <class AllocatorT>
+uint32_t SubscriberT<AllocatorT>::catch_up() {
+  /*
+   * The slot at the head may be under write (see `get_message()`), the one
+   * after it is the oldest message that's safe to read. Going there
+   * instead of to `jumpahead` only drops what was already overwritten, a
+   * subscriber that drains the whole queue at once can keep up from there.
+   */
+  uint32_t head = topic_->counter();
+  if (latest_only_ && head > counter_) {
+    skip_to(head - 1);
+  } else if (head > counter_ && head - counter_ >= topic_->queue_size()) {
+    skip_to(head - topic_->queue_size() + 1);
+  }
+  return head;
+}
+
+template <class AllocatorT>
+bool SubscriberT<AllocatorT>::read_next(memory::Memblock *memblock,
+                                        Pin *pin) {
+  // The element is fetched a few slots ahead, its message one slot ahead
+  // once the element is (hopefully) in the cache.
+  topic_->prefetch_elem(counter_ + PREFETCH_DISTANCE);
+  topic_->prefetch_msg(counter_ + 1);
+  uint32_t from = counter_;
+  if (!topic_->read(memblock, &counter_, zero_copy_ ? pin : nullptr)) {
+    return false;
+  }
+  count_drops(from);
+  started_ = true;
+  return true;
+}
+
+template <class AllocatorT>
+size_t SubscriberT<AllocatorT>::spin_some(size_t max) {
+  uint32_t head = catch_up();
+  size_t handled = 0;
+  while (handled < max && counter_ < head) {
+    Pin pin;
+    memory::Memblock memblock;
+    if (!read_next(&memblock, &pin)) {
+      break;
+    }
+    callback_(&memblock);
+    advance();
+    release(&memblock, &pin);
+    handled++;
+  }
+  report_if_moved();
+  return handled;
+}
+
+template <class AllocatorT>
+size_t SubscriberT<AllocatorT>::spin_batch(const BatchCallback &callback,
+                                           size_t max) {
+  uint32_t head = catch_up();
+  size_t available = head > counter_ ? head - counter_ : 0;
+  size_t count = available < max ? available : max;
+  batch_.assign(count, memory::Memblock());
+  batch_pins_.assign(count, Pin());
+
+  size_t received = 0;
+  while (received < count && counter_ < head) {
+    if (!read_next(&batch_[received], &batch_pins_[received])) {
+      break;
+    }
+    counter_++;
+    received++;
+  }
+
+  if (received > 0) {
+    callback(batch_.data(), received);
+  }
+  report_if_moved();
+  for (size_t i = 0; i < received; ++i) {
+    release(&batch_[i], &batch_pins_[i]);
+  }
+  return received;
+}
 
-  if (memblock.free) {
-    topic_->copier()->dealloc(memblock.ptr);
-    memblock.ptr = nullptr;
-    memblock.size = 0;
+template <class AllocatorT>
+void SubscriberT<AllocatorT>::spin_once(std::chrono::nanoseconds timeout) {
+  uint32_t seen = topic_->counter();
+  if (timeout.count() > 0 && seen <= counter_) {
+    topic_->wait(seen, timeout);
   }
+  spin_once();
 }
 
-void Subscriber::spin() {
+template <class AllocatorT>
+void SubscriberT<AllocatorT>::spin() {
+  /*
+   * `stop()` wakes the sleepers, but it can slip in between the check of
+   * `running_` and going to sleep. The block timeout of the strategy
+   * bounds how long that can hold up `stop()`.
+   */
+  concurrent::Waiter waiter(wait_strategy_);
   running_ = true;
   while (running_.load()) {
+    uint32_t seen = topic_->counter();
+    if (seen <= counter_) {
+      report_if_moved();
+      waiter.idle([this, seen](std::chrono::nanoseconds timeout) {
+        topic_->wait(seen, timeout);
+      });
+      continue;
+    }
     spin_once();
+    waiter.reset();
+  }
+}
+
+template <class AllocatorT>
+int SubscriberT<AllocatorT>::fd() {
+  if (fd_ < 0) {
+    fd_ = topic_->open_fd();
   }
+  return fd_;
 }
 
-void Subscriber::stop() { running_ = false; }
+template <class AllocatorT>
+void SubscriberT<AllocatorT>::spin_ready() {
+  // Drain the eventfd first, anything published after that signals it
+  // again.
+  uint64_t value;
+  if (fd_ >= 0) {
+    while (read(fd_, &value, sizeof(value)) > 0) {
+    }
+  }
+  spin_some(std::numeric_limits<size_t>::max());
+}
+
+template <class AllocatorT>
+void SubscriberT<AllocatorT>::stop() {
+  running_ = false;
+  topic_->wake_all();
+}
 
 }  // namespace shm::pubsub
 #endif  // INCLUDE_SHADESMAR_PUBSUB_SUBSCRIBER_H_
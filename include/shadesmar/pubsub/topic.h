@@ -24,17 +24,31 @@ SOFTWARE.
 #ifndef INCLUDE_SHADESMAR_PUBSUB_TOPIC_H_
 #define INCLUDE_SHADESMAR_PUBSUB_TOPIC_H_
 
+#include <unistd.h>
+
+#include <algorithm>
+#include <array>
 #include <atomic>
+#include <cassert>
+#include <chrono>
 #include <cstring>
 #include <iostream>
 #include <memory>
 #include <string>
+#include <type_traits>
+#include <vector>
 
+#include "shadesmar/concurrency/fd_bridge.h"
+#include "shadesmar/concurrency/futex.h"
 #include "shadesmar/concurrency/scope.h"
+#include "shadesmar/concurrency/wait_strategy.h"
 #include "shadesmar/macros.h"
 #include "shadesmar/memory/allocator.h"
+#include "shadesmar/memory/buddy_allocator.h"
 #include "shadesmar/memory/copier.h"
+#include "shadesmar/memory/lockless_allocator.h"
 #include "shadesmar/memory/memory.h"
+#include "shadesmar/memory/slab_allocator.h"
 
 namespace shm::pubsub {
 
@@ -45,101 +59,307 @@ inline uint32_t jumpahead(uint32_t counter, uint32_t queue_size) {
   return counter - queue_size / 2;
 }
 
+/*
+ * What a publisher does when the slot it would write to still holds a
+ * message that a reliable subscriber hasn't read (see
+ * `SubscriberT::set_reliable`): it waits with `wait_strategy` for the
+ * subscriber to move on, for at most `timeout`, and then the publish
+ * fails. Crashed subscribers are evicted while waiting.
+ */
+struct BackPressure {
+  concurrent::WaitStrategy wait_strategy;
+  std::chrono::nanoseconds timeout;
+
+  // Waits for as long as it takes (the default).
+  static BackPressure wait(const concurrent::WaitStrategy &wait_strategy =
+                               concurrent::WaitStrategy::blocking(),
+                           std::chrono::nanoseconds timeout =
+                               std::chrono::nanoseconds::max()) {
+    return {wait_strategy, timeout};
+  }
+
+  // Fails right away.
+  static BackPressure fail() {
+    return {concurrent::WaitStrategy::busy_spin(),
+            std::chrono::nanoseconds::zero()};
+  }
+};
+
+/*
+ * A subscriber of a topic, as recorded in the segment (see
+ * `TopicT::subscribers`). Subscribers update their entry after each
+ * batch of messages, and when they run out of messages, so `position`
+ * and `last_read` may trail a busy subscriber by a few messages.
+ */
+struct SubscriberInfo {
+  uint32_t id;
+  uint32_t pid;
+  bool reliable;
+  // The next message it will read, and how far that is behind the head.
+  uint32_t position;
+  uint32_t lag;
+  // Messages it skipped after falling behind.
+  uint64_t drops;
+  std::chrono::steady_clock::time_point last_read;
+};
+
+/*
+ * The subscribers holding a zero-copy view of an element: the PID of
+ * each, and the handle + 1 of the message it views. Every view takes a
+ * slot of its own (a process may hold several), and the index of the
+ * slot is what releases it. Slots of crashed readers are cleared by
+ * `prune`.
+ *
+ * The handle of a free slot is stale, and a new pin briefly shows the
+ * handle of the previous one. That only makes `viewing` say yes when it
+ * could have said no.
+ */
+template <uint32_t Size>
+struct ReaderPins {
+  std::array<std::atomic<uint32_t>, Size> pids = {};
+  std::array<std::atomic<uint64_t>, Size> handles = {};
+
+  // Returns the slot, or -1 if all of them are taken.
+  int pin(uint64_t handle) {
+    uint32_t pid = getpid();
+    for (uint32_t idx = 0; idx < Size; ++idx) {
+      uint32_t exp = 0;
+      if (pids[idx].load() == 0 &&
+          pids[idx].compare_exchange_strong(exp, pid)) {
+        handles[idx].store(handle);
+        return idx;
+      }
+    }
+    return -1;
+  }
+
+  void unpin(int slot) { pids[slot].store(0); }
+
+  bool viewing(uint64_t handle) const {
+    for (uint32_t idx = 0; idx < Size; ++idx) {
+      if (pids[idx].load() != 0 && handles[idx].load() == handle) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  void prune() {
+    for (auto &pid : pids) {
+      uint32_t reader = pid.load();
+      if (reader != 0 && proc_dead(reader)) {
+        pid.compare_exchange_strong(reader, 0);
+      }
+    }
+  }
+
+  void reset() {
+    for (uint32_t idx = 0; idx < Size; ++idx) {
+      pids[idx].store(0);
+      handles[idx].store(0);
+    }
+  }
+};
+
+// Each element starts on its own cache line, so publishers and subscribers
+// working on neighbouring elements don't share lines.
 template <class LockT>
-struct TopicElemT {
+struct alignas(CACHELINE_SIZE) TopicElemT {
   memory::Element msg;
+  // Odd while a publisher is changing `msg`, see `TopicT::read_seqlock`.
+  std::atomic<uint32_t> seq;
+  static constexpr uint32_t MAX_PINS = 8;
+
   LockT mutex;
+  ReaderPins<MAX_PINS> pins;
+  // Messages that were replaced while pinned, see `TopicT::retire`.
+  std::array<std::atomic<uint64_t>, MAX_PINS> retired = {};
 
-  TopicElemT() : msg(), mutex() {}
+  TopicElemT() : msg(), seq(0), mutex() {}
 
   TopicElemT(const TopicElemT &topic_elem) {
     msg = topic_elem.msg;
+    seq.store(topic_elem.seq.load());
     mutex = topic_elem.mutex;
+    for (uint32_t idx = 0; idx < MAX_PINS; ++idx) {
+      pins.pids[idx].store(topic_elem.pins.pids[idx].load());
+      pins.handles[idx].store(topic_elem.pins.handles[idx].load());
+      retired[idx].store(topic_elem.retired[idx].load());
+    }
   }
 
   void reset() {
     msg.reset();
+    seq.store(0);
     mutex.reset();
+    pins.reset();
+    for (auto &handle : retired) {
+      handle.store(0);
+    }
   }
 };
 
 using LockType = concurrent::PthreadReadWriteLock;
 
-class Topic {
+// `AllocatorT` manages the message buffer of the topic, e.g.
+// `memory::Allocator`, `memory::LocklessAllocator`, `memory::SlabAllocator`
+// or `memory::BuddyAllocator`. Every participant of a topic has to use the
+// same one.
+template <class AllocatorT>
+class TopicT {
   using TopicElem = TopicElemT<LockType>;
 
   template <concurrent::ExlOrShr type>
   using Scope = concurrent::ScopeGuard<LockType, type>;
 
  public:
-  explicit Topic(const std::string &topic)
-      : Topic(topic, std::make_shared<memory::DefaultCopier>()) {}
-  Topic(const std::string &topic, std::shared_ptr<memory::Copier> copier)
-      : memory_(topic) {
+  // A zero-copy view held by a subscriber, see `read`.
+  struct Pin {
+    TopicElem *elem = nullptr;
+    int slot = -1;
+  };
+
+  explicit TopicT(const std::string &topic)
+      : TopicT(topic, std::make_shared<memory::DefaultCopier>()) {}
+  TopicT(const std::string &topic, std::shared_ptr<memory::Copier> copier,
+         const memory::Options &options = memory::Options())
+      : memory_(topic, options),
+        seqlock_(memory_.seqlock()),
+        room_generation_(memory_.registry_->generation.load() - 1) {
     if (copier == nullptr) {
       copier = std::make_shared<memory::DefaultCopier>();
     }
     copier_ = copier;
   }
 
-  ~Topic() = default;
+  ~TopicT() = default;
 
   bool write(memory::Memblock memblock) {
-    /*
-     * Writes always happen at the head of the circular queue, the
-     * head is atomically incremented to prevent any race across
-     * processes. The head of the queue is stored as a counter
-     * on shared memory.
-     */
-    if (memblock.size > memory_.allocator_->get_free_memory()) {
-      std::cerr << "Increase buffer_size" << std::endl;
-      return false;
-    }
-    uint32_t q_pos = counter() & (queue_size() - 1);
-    TopicElem *elem = &(memory_.shared_queue_->elements[q_pos]);
-
     /*
      * Code path:
      *  1. Allocate shared memory buffer `new_address`
      *  2. Copy msg data to `new_address`
-     *  3. Acquire exclusive lock
-     *  4. Complex "swap" of old and new fields
-     *  5. Release exclusive lock
-     *  6. If old buffer is empty, deallocate it
+     *  3. Commit `new_address` to the head of the queue
+     * Small messages skip 1. and 2., they're copied into the element.
      */
+    if (!make_room(1)) {
+      return false;
+    }
 
-    uint8_t *new_address = memory_.allocator_->alloc(memblock.size);
+    if (memory::Element::fits_inline(memblock.size)) {
+      TopicElem *elem = head_elem();
+      uint8_t *old_address = swap_inline(elem, memblock.ptr, memblock.size);
+      if (old_address != nullptr) {
+        retire(elem, old_address);
+      }
+      inc_counter();
+      return true;
+    }
+
+    uint8_t *new_address = borrow(memblock.size);
     if (new_address == nullptr) {
       return false;
     }
 
     copier_->user_to_shm(new_address, memblock.ptr, memblock.size);
 
-    uint8_t *old_address = nullptr;
-    {
-      /*
-       * This locked block should *only* contain accesses
-       * to `elem`, any other expensive compute that doesn't
-       * include `elem` can be put outside this block.
-       */
-      Scope<concurrent::EXCLUSIVE> _(&elem->mutex);
-      if (!elem->msg.empty) {
-        old_address =
-            memory_.allocator_->handle_to_ptr(elem->msg.address_handle);
-      }
-      elem->msg.address_handle =
-          memory_.allocator_->ptr_to_handle(new_address);
-      elem->msg.size = memblock.size;
-      elem->msg.empty = false;
-    }
-
-    while (!memory_.allocator_->free(old_address)) {
-      std::this_thread::sleep_for(std::chrono::microseconds(100));
+    put(new_address, memblock.size);
+    return true;
+  }
+
+  /*
+   * Publishes `count` messages to consecutive slots. Their buffers are
+   * allocated together (see `memory::alloc_batch`), and readers are woken
+   * once per batch. As in `write`, the counter moves past each slot as
+   * soon as it's filled: a reader a queue behind would otherwise take a
+   * filled slot ahead of the counter for its own, older message. A batch
+   * longer than the queue is written in parts, the earlier messages of a
+   * part would be overwritten by the later ones anyway.
+   * Parts leave a slot free, which reliable subscribers need (see
+   * `make_room`).
+   */
+  bool write_batch(const memory::Memblock *memblocks, size_t count) {
+    const size_t max_part = queue_size() > 1 ? queue_size() - 1 : 1;
+    while (count > 0) {
+      size_t part = count < max_part ? count : max_part;
+      if (!write_part(memblocks, part)) {
+        return false;
+      }
+      memblocks += part;
+      count -= part;
     }
-    inc_counter();
     return true;
   }
 
+  /*
+   * Loans let a publisher build a message in place: `borrow` hands out
+   * `size` bytes of the topic's buffer, and exactly one of `commit` or
+   * `abort` has to give them back. Until then the loan is private to the
+   * borrower. The copier isn't involved.
+   */
+  uint8_t *borrow(size_t size) {
+    if (!has_room(size)) {
+      return nullptr;
+    }
+    return memory_.allocator_->alloc(size);
+  }
+
+  // Publishes the first `size` bytes of a loan, `size` may be less than
+  // what was borrowed. If that fails (see `BackPressure`), the loan is
+  // still the borrower's.
+  bool commit(uint8_t *new_address, size_t size) {
+    if (!make_room(1)) {
+      return false;
+    }
+    put(new_address, size);
+    return true;
+  }
+
+  // Returns a loan without publishing it.
+  void abort(uint8_t *address) { memory_.allocator_->free(address); }
+
+  void set_back_pressure(const BackPressure &back_pressure) {
+    back_pressure_ = back_pressure;
+  }
+
+  // Entries of the subscriber registry, see `memory::SubscriberRegistry`.
+  int register_subscriber(uint32_t position) {
+    return memory_.registry_->add(position);
+  }
+  void unregister_subscriber(int slot) { memory_.registry_->remove(slot); }
+  void update_subscriber(int slot, uint32_t position, uint64_t drops) {
+    memory_.registry_->update(slot, position, drops);
+  }
+  void set_reliable(int slot, bool reliable) {
+    memory_.registry_->set_reliable(slot, reliable);
+  }
+
+  // The subscribers of the topic right now, crashed ones are evicted.
+  std::vector<SubscriberInfo> subscribers() {
+    memory::Registry *registry = memory_.registry_;
+    registry->evict_dead();
+    uint32_t head = counter();
+    std::vector<SubscriberInfo> infos;
+    for (auto &entry : registry->entries) {
+      uint64_t owner = entry.owner.load();
+      if (!(owner & memory::Registry::VALID)) {
+        continue;
+      }
+      SubscriberInfo info;
+      info.id = entry.id.load();
+      info.pid = static_cast<uint32_t>(owner);
+      info.reliable = owner & memory::Registry::RELIABLE;
+      info.position = entry.position.load();
+      int32_t lag = head - info.position;
+      info.lag = lag > 0 ? lag : 0;
+      info.drops = entry.drops.load();
+      info.last_read = std::chrono::steady_clock::time_point(
+          std::chrono::nanoseconds(entry.last_read.load()));
+      infos.push_back(info);
+    }
+    return infos;
+  }
+
   /*
    * Reads aren't like writes in one major way: writes don't require
    * any information about which position in the queue to write to. It
@@ -149,11 +369,23 @@ class Topic {
    * reading at their own pace. Between picking the element at pos to
    * read from and acquiring a read lock, the publisher may write a new
    * value at pos. In this case, we implement a slow path to jump ahead.
+   *
+   * With a `pin`, the message isn't copied: `memblock` points into shared
+   * memory, and the element is pinned until `unpin`. If the element has
+   * no free pin slot, this falls back to a copy and `pin` stays empty.
+   *
+   * Topics in seqlock mode (`Options::seqlock`) are read without the lock,
+   * see `read_seqlock`. They always copy, `pin` stays empty.
    */
 
-  bool read(memory::Memblock *memblock, std::atomic<uint32_t> *pos) {
+  bool read(memory::Memblock *memblock, std::atomic<uint32_t> *pos,
+            Pin *pin = nullptr) {
+    if (seqlock_) {
+      return read_seqlock(memblock, pos);
+    }
+
     TopicElem *elem =
-        &(memory_.shared_queue_->elements[*pos & (queue_size() - 1)]);
+        &(memory_.shared_queue_->elements()[*pos & (queue_size() - 1)]);
 
     /*
      * Code path (without the slow path for lag):
@@ -165,14 +397,24 @@ class Topic {
     Scope<concurrent::SHARED> _(&elem->mutex);
 
 // Using a lambda for this reduced throughput.
+// Inline messages are always copied, a pin doesn't keep them in place.
 #define MOVE_ELEM(_elem)                                                    \
   if (_elem->msg.empty) {                                                   \
     return false;                                                           \
   }                                                                         \
-  auto *dst = memory_.allocator_->handle_to_ptr(_elem->msg.address_handle); \
+  auto *dst = _elem->msg.is_inline ? _elem->msg.payload                     \
+                                   : memory_.allocator_->handle_to_ptr(     \
+                                         _elem->msg.address_handle);        \
   memblock->size = _elem->msg.size;                                         \
-  memblock->ptr = copier_->alloc(memblock->size);                           \
-  copier_->shm_to_user(memblock->ptr, dst, memblock->size);
+  if (pin != nullptr && !_elem->msg.is_inline &&                            \
+      (pin->slot = _elem->pins.pin(_elem->msg.address_handle + 1)) >= 0) { \
+    pin->elem = _elem;                                                      \
+    memblock->ptr = dst;                                                    \
+    memblock->free = false;                                                 \
+  } else {                                                                  \
+    memblock->ptr = copier_->alloc(memblock->size);                         \
+    copier_->shm_to_user(memblock->ptr, dst, memblock->size);               \
+  }
 
     if (queue_size() > counter() - *pos) {
       // Fast path.
@@ -194,15 +436,56 @@ class Topic {
     //     path under a read lock.
     *pos = jumpahead(counter(), queue_size());
     TopicElem *next_best_elem =
-        &(memory_.shared_queue_->elements[*pos & (queue_size() - 1)]);
+        &(memory_.shared_queue_->elements()[*pos & (queue_size() - 1)]);
     MOVE_ELEM(next_best_elem);
     return true;
 #undef MOVE_ELEM
   }
 
+  // Cache hints for a reader that's about to get to `pos`. Only hints, the
+  // element may change before it's read.
+  void prefetch_elem(uint32_t pos) {
+    __builtin_prefetch(
+        &(memory_.shared_queue_->elements()[pos & (queue_size() - 1)]));
+  }
+  void prefetch_msg(uint32_t pos) {
+    TopicElem *elem =
+        &(memory_.shared_queue_->elements()[pos & (queue_size() - 1)]);
+    if (!elem->msg.empty && !elem->msg.is_inline) {
+      __builtin_prefetch(
+          memory_.allocator_->handle_to_ptr(elem->msg.address_handle));
+    }
+  }
+
+  // Releases a view from `read`, the last reader of a replaced message
+  // frees it.
+  void unpin(Pin *pin) {
+    pin->elem->pins.unpin(pin->slot);
+    reclaim(pin->elem);
+    pin->elem = nullptr;
+    pin->slot = -1;
+  }
+
   inline __attribute__((always_inline)) void inc_counter() {
     memory_.shared_queue_->counter++;
+    memory_.shared_queue_->notify();
+  }
+
+  // Sleeps until `counter()` moves past `seen`, see `SharedQueue::wait`.
+  bool wait(uint32_t seen, std::chrono::nanoseconds timeout) {
+    return memory_.shared_queue_->wait(seen, timeout);
+  }
+
+  // Wakes every reader sleeping in `wait`.
+  void wake_all() { concurrent::futex_wake(&memory_.shared_queue_->counter); }
+
+  // An eventfd that is signalled when `counter()` moves, see
+  // `concurrent::FdBridge`. Release it with `close_fd`.
+  int open_fd() {
+    return concurrent::FdBridge::add(&memory_.shared_queue_->counter,
+                                     &memory_.shared_queue_->waiters);
   }
+  void close_fd(int fd) { concurrent::FdBridge::remove(fd); }
 
   inline __attribute__((always_inline)) uint32_t counter() const {
     return memory_.shared_queue_->counter.load();
@@ -213,8 +496,346 @@ class Topic {
   inline std::shared_ptr<memory::Copier> copier() const { return copier_; }
 
  private:
-  memory::Memory<TopicElem, memory::Allocator> memory_;
+  /*
+   * Pins are taken under the element's read lock, so any reader that can
+   * still see `address` is in `pins` by the time the publisher gets here.
+   * Without readers viewing it, it's freed right away. Otherwise it's
+   * parked in a slot of `retired`, and whoever sees its last view go frees
+   * it. Crashed readers don't count, their pins are dropped first. Every
+   * parked message is viewed by a pin of its own, and there are as many
+   * slots as pins, so a slot is always free. Publishers never wait for
+   * readers.
+   *
+   * A slot holds the handle + 1 of the parked message in the low 48 bits
+   * (0 if none), and a generation in the high 16 bits that is bumped on
+   * every park. A reader that checked the pins for one message can't free
+   * the next one parked at the same address.
+   */
+  static constexpr uint64_t RETIRED_MASK = (1ull << 48) - 1;
+  static constexpr uint64_t EVICT_ROUNDS = 1024;
+
+  inline __attribute__((always_inline)) TopicElem *head_elem() {
+    return &(memory_.shared_queue_->elements()[counter() & (queue_size() - 1)]);
+  }
+
+  // Checks that the buffer could hold `size` more bytes, before allocating.
+  bool has_room(size_t size) {
+    return has_room(size,
+                    std::is_same<AllocatorT, memory::SlabAllocator>());
+  }
+
+  bool has_room(size_t size, std::false_type /* slab */) {
+    if (size > memory_.allocator_->get_free_memory()) {
+      std::cerr << "Increase buffer_size" << std::endl;
+      return false;
+    }
+    return true;
+  }
+
+  // The free memory of a `SlabAllocator` is summed over every size class,
+  // touching all their cache lines, and tells nothing about the class of
+  // `size`. Its `alloc` fails as fast.
+  bool has_room(size_t /* size */, std::true_type /* slab */) {
+    return true;
+  }
+
+  // Publishes a message that's in the buffer at the head of the queue.
+  void put(uint8_t *new_address, size_t size) {
+    /*
+     * Writes always happen at the head of the circular queue, the
+     * head is atomically incremented to prevent any race across
+     * processes. The head of the queue is stored as a counter
+     * on shared memory.
+     *
+     * Code path:
+     *  1. Acquire exclusive lock (and bump `seq` in seqlock mode)
+     *  2. Complex "swap" of old and new fields
+     *  3. Release exclusive lock
+     *  4. If old buffer is empty, deallocate it (or leave it to the
+     *     subscribers still viewing it)
+     */
+    TopicElem *elem = head_elem();
+    uint8_t *old_address = swap(elem, new_address, size);
+    if (old_address != nullptr) {
+      retire(elem, old_address);
+    }
+    inc_counter();
+  }
+
+  /*
+   * Waits until the next `count` slots only hold messages that every
+   * reliable subscriber has read, see `BackPressure`. One slot is kept
+   * free: readers take a lag of a whole queue as being lapped, since the
+   * head may be under write. Positions only move forward, so the room
+   * found by a scan lasts until another subscriber turns reliable, most
+   * writes don't look at the registry at all.
+   *
+   * Dead subscribers are looked for when a scan first finds no room, and
+   * then after every sleep or `EVICT_ROUNDS` spins.
+   */
+  bool make_room(uint32_t count) {
+    memory::Registry *registry = memory_.registry_;
+    if (registry->reliable.load() == 0) {
+      return true;
+    }
+    uint32_t generation = registry->generation.load();
+    if (generation == room_generation_ &&
+        static_cast<int32_t>(room_end_ - (counter() + count)) >= 0) {
+      return true;
+    }
+
+    // A crashed subscriber never wakes us, sleeps are bounded to notice.
+    const std::chrono::nanoseconds max_sleep = std::chrono::milliseconds(10);
+    const auto start = std::chrono::steady_clock::now();
+    concurrent::Waiter waiter(back_pressure_.wait_strategy);
+    bool evict = false;
+    bool evicted = false;
+    uint64_t rounds = 0;
+    while (true) {
+      uint32_t seen = registry->progress.load();
+      uint32_t head = counter();
+      uint32_t slowest;
+      if (!registry->slowest(head, &slowest, evict) ||
+          head + count - slowest < queue_size()) {
+        room_generation_ = generation;
+        room_end_ = slowest + queue_size() - 1;
+        return true;
+      }
+      if (!evicted) {
+        evict = evicted = true;
+        continue;
+      }
+
+      auto remaining = back_pressure_.timeout -
+                       (std::chrono::steady_clock::now() - start);
+      if (remaining.count() <= 0) {
+        return false;
+      }
+      evict = ++rounds % EVICT_ROUNDS == 0;
+      waiter.idle([&](std::chrono::nanoseconds timeout) {
+        if (timeout.count() == 0 || timeout > max_sleep) {
+          timeout = max_sleep;
+        }
+        registry->wait(seen, std::min<std::chrono::nanoseconds>(timeout,
+                                                               remaining));
+        evict = true;
+      });
+    }
+  }
+
+  // Points `elem` at a new message, and returns the old one if it has to
+  // be retired (nullptr if it was empty or inline).
+  uint8_t *swap(TopicElem *elem, uint8_t *address, size_t size) {
+    return swap(elem, size, [this, address](memory::Element *msg) {
+      msg->address_handle = memory_.allocator_->ptr_to_handle(address);
+      msg->is_inline = false;
+    });
+  }
+
+  // Copies a small message into `elem`, see `memory::Element`.
+  uint8_t *swap_inline(TopicElem *elem, void *data, size_t size) {
+    return swap(elem, size, [this, data, size](memory::Element *msg) {
+      copier_->user_to_shm(msg->payload, data, size);
+      msg->is_inline = true;
+    });
+  }
+
+  template <class FillFn>
+  uint8_t *swap(TopicElem *elem, size_t size, FillFn fill) {
+    /*
+     * This locked block should *only* contain accesses
+     * to `elem`, any other expensive compute that doesn't
+     * include `elem` can be put outside this block.
+     *
+     * In seqlock mode readers don't take the lock, it only orders the
+     * publishers. `seq` is odd while `msg` changes.
+     */
+    Scope<concurrent::EXCLUSIVE> _(&elem->mutex);
+    if (seqlock_) {
+      elem->seq.store(elem->seq.load(std::memory_order_relaxed) + 1,
+                      std::memory_order_relaxed);
+      std::atomic_thread_fence(std::memory_order_release);
+    }
+    uint8_t *old_address = nullptr;
+    if (!elem->msg.empty && !elem->msg.is_inline) {
+      old_address = memory_.allocator_->handle_to_ptr(elem->msg.address_handle);
+    }
+    fill(&elem->msg);
+    elem->msg.size = size;
+    elem->msg.empty = false;
+    if (seqlock_) {
+      elem->seq.store(elem->seq.load(std::memory_order_relaxed) + 1,
+                      std::memory_order_release);
+    }
+    return old_address;
+  }
+
+  /*
+   * Seqlock read: copy the message, then check that `seq` didn't move
+   * while copying. If it did, or the element was lapped, start over. The
+   * old message of an element is only freed after `seq` moves, so a copy
+   * that passes the check was taken from a live message. A torn copy of
+   * `msg` may point anywhere, it's bounds checked before it's followed.
+   */
+  bool read_seqlock(memory::Memblock *memblock, std::atomic<uint32_t> *pos) {
+    const size_t heap_size =
+        memory_.buffer_size() * (memory_.mirrored() ? 2 : 1);
+    void *buffer = nullptr;
+    size_t buffer_size = 0;
+    while (true) {
+      if (queue_size() <= counter() - *pos) {
+        *pos = jumpahead(counter(), queue_size());
+      }
+      TopicElem *elem =
+          &(memory_.shared_queue_->elements()[*pos & (queue_size() - 1)]);
+
+      uint32_t seq = elem->seq.load(std::memory_order_acquire);
+      if (seq & 1) {
+        concurrent::cpu_relax();
+        continue;
+      }
+      // An inline message is copied out of this snapshot.
+      memory::Element msg = elem->msg;
+      bool in_bounds =
+          !msg.empty &&
+          (msg.is_inline ? memory::Element::fits_inline(msg.size)
+                         : msg.address_handle <= heap_size &&
+                               msg.size <= heap_size - msg.address_handle);
+      if (in_bounds) {
+        if (buffer == nullptr || buffer_size != msg.size) {
+          if (buffer != nullptr) {
+            copier_->dealloc(buffer);
+          }
+          buffer = copier_->alloc(msg.size);
+          buffer_size = msg.size;
+        }
+        copier_->shm_to_user(
+            buffer,
+            msg.is_inline
+                ? msg.payload
+                : memory_.allocator_->handle_to_ptr(msg.address_handle),
+            msg.size);
+      }
+      std::atomic_thread_fence(std::memory_order_acquire);
+      if (elem->seq.load(std::memory_order_relaxed) != seq ||
+          queue_size() <= counter() - *pos) {
+        continue;
+      }
+
+      if (!in_bounds) {
+        // Only an empty element gets here with a matching `seq`.
+        if (buffer != nullptr) {
+          copier_->dealloc(buffer);
+        }
+        return false;
+      }
+      memblock->ptr = buffer;
+      memblock->size = msg.size;
+      return true;
+    }
+  }
+
+  bool write_part(const memory::Memblock *memblocks, size_t count) {
+    if (!make_room(count)) {
+      return false;
+    }
+
+    // Only the messages that don't fit inline need buffers.
+    std::vector<size_t> sizes;
+    std::vector<uint8_t *> addresses(count);
+    size_t total_size = 0;
+    for (size_t i = 0; i < count; ++i) {
+      if (!memory::Element::fits_inline(memblocks[i].size)) {
+        sizes.push_back(memblocks[i].size);
+        total_size += memblocks[i].size;
+      }
+    }
+    if (!has_room(total_size)) {
+      return false;
+    }
+    if (!memory::alloc_batch(memory_.allocator_, sizes.data(), sizes.size(),
+                             addresses.data())) {
+      return false;
+    }
+
+    uint32_t start = counter();
+    size_t allocated = 0;
+    for (size_t i = 0; i < count; ++i) {
+      TopicElem *elem = &(memory_.shared_queue_
+                              ->elements()[(start + i) & (queue_size() - 1)]);
+      uint8_t *old_address;
+      if (memory::Element::fits_inline(memblocks[i].size)) {
+        old_address = swap_inline(elem, memblocks[i].ptr, memblocks[i].size);
+      } else {
+        uint8_t *address = addresses[allocated++];
+        copier_->user_to_shm(address, memblocks[i].ptr, memblocks[i].size);
+        old_address = swap(elem, address, memblocks[i].size);
+      }
+      if (old_address != nullptr) {
+        retire(elem, old_address);
+      }
+      memory_.shared_queue_->counter++;
+    }
+    memory_.shared_queue_->notify();
+    return true;
+  }
+
+  void retire(TopicElem *elem, uint8_t *address) {
+    uint64_t handle = memory_.allocator_->ptr_to_handle(address) + 1;
+    assert(handle <= RETIRED_MASK);
+    if (elem->pins.viewing(handle)) {
+      elem->pins.prune();
+    }
+    while (elem->pins.viewing(handle)) {
+      if (park(elem, handle)) {
+        // The last reader may have left before it was parked.
+        reclaim(elem);
+        return;
+      }
+      elem->pins.prune();
+      reclaim(elem);
+    }
+    memory_.allocator_->free(address);
+  }
+
+  bool park(TopicElem *elem, uint64_t handle) {
+    for (auto &slot : elem->retired) {
+      uint64_t retired = slot.load();
+      if ((retired & RETIRED_MASK) == 0 &&
+          slot.compare_exchange_strong(
+              retired, ((retired & ~RETIRED_MASK) + (1ull << 48)) | handle)) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  // Frees the parked messages that nobody views anymore.
+  void reclaim(TopicElem *elem) {
+    for (auto &slot : elem->retired) {
+      uint64_t retired = slot.load();
+      uint64_t handle = retired & RETIRED_MASK;
+      if (handle == 0 || elem->pins.viewing(handle)) {
+        continue;
+      }
+      if (slot.compare_exchange_strong(retired, retired & ~RETIRED_MASK)) {
+        memory_.allocator_->free(
+            memory_.allocator_->handle_to_ptr(handle - 1));
+      }
+    }
+  }
+
+  memory::Memory<TopicElem, AllocatorT> memory_;
+  bool seqlock_;
   std::shared_ptr<memory::Copier> copier_;
+
+  BackPressure back_pressure_ = BackPressure::wait();
+  // The head may move up to `room_end_` while `generation` of the registry
+  // is `room_generation_`, see `make_room`.
+  uint32_t room_generation_;
+  uint32_t room_end_ = 0;
 };
+
+using Topic = TopicT<memory::Allocator>;
 }  // namespace shm::pubsub
 #endif  // INCLUDE_SHADESMAR_PUBSUB_TOPIC_H_
@@ -0,0 +1,55 @@
+/* MIT License
+
+Copyright (c) 2020 Dheeraj R Reddy
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+==============================================================================*/
+
+
+#ifndef INCLUDE_SHADESMAR_PUBSUB_TYPED_PUBLISHER_H_
+#define INCLUDE_SHADESMAR_PUBSUB_TYPED_PUBLISHER_H_
+
+#include <memory>
+#include <string>
+
+#include "shadesmar/pubsub/typed_topic.h"
+
+namespace shm::pubsub {
+
+// Publishes messages of type `T` on a typed topic, see `TypedTopic`.
+template <class T>
+class TypedPublisher {
+ public:
+  explicit TypedPublisher(const std::string &topic_name,
+                          const memory::Options &options = memory::Options())
+      : topic_name_(topic_name),
+        topic_(std::make_unique<TypedTopic<T>>(topic_name, options)) {}
+  TypedPublisher(const TypedPublisher &) = delete;
+  TypedPublisher(TypedPublisher &&) = default;
+
+  // Never fails, there is no buffer to fill up.
+  void publish(const T &msg) { topic_->write(msg); }
+
+ private:
+  std::string topic_name_;
+  std::unique_ptr<TypedTopic<T>> topic_;
+};
+
+}  // namespace shm::pubsub
+#endif  // INCLUDE_SHADESMAR_PUBSUB_TYPED_PUBLISHER_H_
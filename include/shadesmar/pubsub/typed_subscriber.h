@@ -0,0 +1,146 @@
+/* MIT License
+
+Copyright (c) 2020 Dheeraj R Reddy
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+==============================================================================*/
+
+
+#ifndef INCLUDE_SHADESMAR_PUBSUB_TYPED_SUBSCRIBER_H_
+#define INCLUDE_SHADESMAR_PUBSUB_TYPED_SUBSCRIBER_H_
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <type_traits>
+#include <utility>
+
+#include "shadesmar/concurrency/wait_strategy.h"
+#include "shadesmar/pubsub/typed_topic.h"
+
+namespace shm::pubsub {
+
+// Receives messages of type `T` from a typed topic, see `TypedTopic`. The
+// same calls as `Subscriber`, but the callback gets the message itself.
+template <class T>
+class TypedSubscriber {
+ public:
+  TypedSubscriber(const std::string &topic_name,
+                  std::function<void(const T &)> callback,
+                  const memory::Options &options = memory::Options())
+      : callback_(std::move(callback)),
+        topic_name_(topic_name),
+        topic_(std::make_unique<TypedTopic<T>>(topic_name, options)) {}
+  TypedSubscriber(const TypedSubscriber &) = delete;
+
+  // Copies the next message into `msg`, returns false if there is none.
+  bool get_message(T *msg);
+  void spin_once();
+  // Like `spin_once()`, but sleeps for up to `timeout` if there's no new
+  // message yet.
+  void spin_once(std::chrono::nanoseconds timeout);
+  // Handles messages until `stop()`, see `Subscriber::spin`.
+  void spin();
+  void stop();
+
+  void set_wait_strategy(const concurrent::WaitStrategy &wait_strategy) {
+    wait_strategy_ = wait_strategy;
+  }
+
+  // Reads only the newest message, see `Subscriber::set_latest_only`.
+  void set_latest_only(bool latest_only) { latest_only_ = latest_only; }
+
+  std::atomic<uint32_t> counter_{0};
+
+ private:
+  bool latest_only_ = false;
+  concurrent::WaitStrategy wait_strategy_ =
+      concurrent::WaitStrategy::blocking();
+  std::atomic_bool running_{false};
+  std::function<void(const T &)> callback_;
+  std::string topic_name_;
+  std::unique_ptr<TypedTopic<T>> topic_;
+};
+
+template <class T>
+bool TypedSubscriber<T>::get_message(T *msg) {
+  // Same catch up as `Subscriber::get_message`.
+  uint32_t head = topic_->counter();
+  if (head <= counter_) {
+    return false;
+  }
+  if (latest_only_) {
+    counter_ = head - 1;
+  } else if (head - counter_ >= topic_->queue_size()) {
+    counter_ = jumpahead(head, topic_->queue_size());
+  }
+  return topic_->read(msg, &counter_);
+}
+
+template <class T>
+void TypedSubscriber<T>::spin_once() {
+  // Sound because `T` is trivially copyable (checked by `TypedTopic`):
+  // copying its bytes in makes a valid `T`, and it has nothing to destroy.
+  // Raw storage also spares `T` from being default constructible.
+  std::aligned_storage_t<sizeof(T), alignof(T)> storage;
+  T *msg = reinterpret_cast<T *>(&storage);
+  if (!get_message(msg)) {
+    return;
+  }
+  callback_(*msg);
+  counter_++;
+}
+
+template <class T>
+void TypedSubscriber<T>::spin_once(std::chrono::nanoseconds timeout) {
+  uint32_t seen = topic_->counter();
+  if (timeout.count() > 0 && seen <= counter_) {
+    topic_->wait(seen, timeout);
+  }
+  spin_once();
+}
+
+template <class T>
+void TypedSubscriber<T>::spin() {
+  concurrent::Waiter waiter(wait_strategy_);
+  running_ = true;
+  while (running_.load()) {
+    uint32_t seen = topic_->counter();
+    if (seen <= counter_) {
+      waiter.idle([this, seen](std::chrono::nanoseconds timeout) {
+        topic_->wait(seen, timeout);
+      });
+      continue;
+    }
+    spin_once();
+    waiter.reset();
+  }
+}
+
+template <class T>
+void TypedSubscriber<T>::stop() {
+  running_ = false;
+  topic_->wake_all();
+}
+
+}  // namespace shm::pubsub
+#endif  // INCLUDE_SHADESMAR_PUBSUB_TYPED_SUBSCRIBER_H_
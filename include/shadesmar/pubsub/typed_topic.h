@@ -0,0 +1,227 @@
+/* MIT License
+
+Copyright (c) 2020 Dheeraj R Reddy
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+==============================================================================*/
+
+
+#ifndef INCLUDE_SHADESMAR_PUBSUB_TYPED_TOPIC_H_
+#define INCLUDE_SHADESMAR_PUBSUB_TYPED_TOPIC_H_
+
+#include <unistd.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <string>
+#include <thread>
+#include <type_traits>
+
+#include "shadesmar/concurrency/futex.h"
+#include "shadesmar/concurrency/wait_strategy.h"
+#include "shadesmar/macros.h"
+#include "shadesmar/memory/memory.h"
+#include "shadesmar/pubsub/topic.h"
+
+namespace shm::pubsub {
+
+/*
+ * Element of a typed topic, the message is stored inline. `seq` is
+ * `claimed(pos, pid)` (odd) while publisher `pid` writes the message of
+ * position `pos`, and `written(pos)` (even) once it's complete, 0 before
+ * the first write. PIDs fit in 31 bits.
+ */
+template <class T>
+struct alignas(CACHELINE_SIZE) TypedElem {
+  std::atomic<uint64_t> seq;
+  alignas(T) uint8_t msg[sizeof(T)];
+
+  TypedElem() : seq(0) {}
+
+  void reset() { seq.store(0); }
+
+  static uint64_t claimed(uint32_t pos, uint32_t pid) {
+    return (static_cast<uint64_t>(pid) << 33) |
+           (static_cast<uint64_t>(pos) << 1) | 1;
+  }
+  static uint64_t written(uint32_t pos) { return 2ull * pos + 2; }
+
+  // The position of a claimed or complete element, counters wrap around
+  // like `pos`.
+  static uint32_t pos_of(uint64_t seq) {
+    return static_cast<uint32_t>((seq & 1) ? seq >> 1 : seq / 2 - 1);
+  }
+  static uint32_t claim_pid_of(uint64_t seq) { return seq >> 33; }
+};
+
+// Typed topics have no message buffer to manage.
+struct NoAllocator {
+  NoAllocator(size_t, size_t) {}
+  static constexpr size_t max_size() {
+    return std::numeric_limits<size_t>::max();
+  }
+  void reset() {}
+  void lock_reset() {}
+};
+
+/*
+ * A topic of fixed size messages of type `T`, stored in the queue itself:
+ * no allocator, no handles, a message is copied straight into its
+ * element. Every participant has to use the same `T` (its size is checked
+ * when joining).
+ *
+ * Publishers take the element at the head by moving its `seq` to odd,
+ * so only one of them writes it, and bump the counter once it's written.
+ * Readers copy without a lock and check `seq` afterwards, a publisher
+ * never waits for them. Like the claims of `memory::LocklessAllocator`,
+ * the claim of a publisher that died is taken over by the next one, and
+ * a counter it didn't bump is bumped for it.
+ */
+template <class T>
+class TypedTopic {
+  static_assert(std::is_trivially_copyable<T>::value,
+                "Typed topics copy messages byte by byte");
+  static_assert(alignof(T) <= CACHELINE_SIZE,
+                "Messages can't be aligned beyond a cache line");
+
+  using Elem = TypedElem<T>;
+
+ public:
+  explicit TypedTopic(const std::string &topic,
+                      const memory::Options &options = memory::Options())
+      : memory_(topic, typed_options(options)) {}
+
+  void write(const T &msg) {
+    const uint32_t pid = getpid();
+    uint32_t spins = 0;
+    while (true) {
+      uint32_t pos = counter();
+      Elem *elem = elem_at(pos);
+      uint64_t seq = elem->seq.load();
+      if (seq & 1) {
+        // Another publisher is writing `pos`, or died while at it.
+        if (!take_over(elem, seq, pos, pid, &spins)) {
+          continue;
+        }
+      } else if (seq != 0 &&
+                 static_cast<int32_t>(Elem::pos_of(seq) - pos) >= 0) {
+        // Another publisher has written `pos`, and has yet to bump the
+        // counter (or died first), or our counter is stale.
+        if (Elem::pos_of(seq) == pos) {
+          publish(pos);
+        }
+        continue;
+      } else if (!elem->seq.compare_exchange_weak(seq,
+                                                  Elem::claimed(pos, pid),
+                                                  std::memory_order_relaxed)) {
+        continue;
+      }
+      std::atomic_thread_fence(std::memory_order_release);
+      std::memcpy(elem->msg, &msg, sizeof(T));
+      elem->seq.store(Elem::written(pos), std::memory_order_release);
+      publish(pos);
+      return;
+    }
+  }
+
+  /*
+   * Copies the message at `*pos` into `msg`. Returns false if it isn't
+   * there yet. If it was overwritten, `*pos` jumps ahead (see
+   * `jumpahead`) and the message there is read instead.
+   */
+  bool read(T *msg, std::atomic<uint32_t> *pos) {
+    while (true) {
+      if (counter() <= *pos) {
+        return false;
+      }
+      Elem *elem = elem_at(*pos);
+      uint64_t seq = elem->seq.load(std::memory_order_acquire);
+      if (seq == Elem::written(*pos)) {
+        std::memcpy(msg, elem->msg, sizeof(T));
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (elem->seq.load(std::memory_order_relaxed) == seq) {
+          return true;
+        }
+      }
+      // Lapped, while reading or before.
+      *pos = jumpahead(counter(), queue_size());
+    }
+  }
+
+  // Sleeps until `counter()` moves past `seen`, see `SharedQueue::wait`.
+  bool wait(uint32_t seen, std::chrono::nanoseconds timeout) {
+    return memory_.shared_queue_->wait(seen, timeout);
+  }
+
+  // Wakes every reader sleeping in `wait`.
+  void wake_all() { concurrent::futex_wake(&memory_.shared_queue_->counter); }
+
+  inline __attribute__((always_inline)) uint32_t counter() const {
+    return memory_.shared_queue_->counter.load();
+  }
+
+  size_t queue_size() const { return memory_.queue_size(); }
+
+ private:
+  static memory::Options typed_options(memory::Options options) {
+    options.buffer_size = 0;
+    options.mirrored = false;
+    return options;
+  }
+
+  /*
+   * The claim `seq` on the head is only held for a copy, so spin first.
+   * If it takes long, the claimant may have died: then its claim becomes
+   * ours, and true is returned. Its message is lost, its position isn't.
+   */
+  bool take_over(Elem *elem, uint64_t seq, uint32_t pos, uint32_t pid,
+                 uint32_t *spins) {
+    if (++(*spins) < 1024) {
+      concurrent::cpu_relax();
+      return false;
+    }
+    *spins = 0;
+    if (Elem::pos_of(seq) != pos || !proc_dead(Elem::claim_pid_of(seq))) {
+      std::this_thread::yield();
+      return false;
+    }
+    return elem->seq.compare_exchange_strong(seq, Elem::claimed(pos, pid),
+                                             std::memory_order_relaxed);
+  }
+
+  // Moves the counter past the written `pos`, unless someone else did.
+  void publish(uint32_t pos) {
+    if (memory_.shared_queue_->counter.compare_exchange_strong(pos,
+                                                               pos + 1)) {
+      memory_.shared_queue_->notify();
+    }
+  }
+
+  inline __attribute__((always_inline)) Elem *elem_at(uint32_t pos) {
+    return &(memory_.shared_queue_->elements()[pos & (queue_size() - 1)]);
+  }
+
+  memory::Memory<Elem, NoAllocator> memory_;
+};
+
+}  // namespace shm::pubsub
+#endif  // INCLUDE_SHADESMAR_PUBSUB_TYPED_TOPIC_H_
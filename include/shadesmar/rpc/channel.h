@@ -25,10 +25,13 @@ SOFTWARE.
 #define INCLUDE_SHADESMAR_RPC_CHANNEL_H_
 
 #include <atomic>
+#include <chrono>
 #include <memory>
 #include <string>
 
 #include "shadesmar/concurrency/cond_var.h"
+#include "shadesmar/concurrency/fd_bridge.h"
+#include "shadesmar/concurrency/futex.h"
 #include "shadesmar/concurrency/lock.h"
 #include "shadesmar/concurrency/scope.h"
 #include "shadesmar/macros.h"
@@ -39,7 +42,7 @@ SOFTWARE.
 
 namespace shm::rpc {
 
-struct ChannelElem {
+struct alignas(CACHELINE_SIZE) ChannelElem {
   memory::Element req;
   memory::Element resp;
   concurrent::PthreadWriteLock mutex;
@@ -70,8 +73,9 @@ class Channel {
  public:
   explicit Channel(const std::string &channel)
       : Channel(channel, std::make_shared<memory::DefaultCopier>()) {}
-  Channel(const std::string &channel, std::shared_ptr<memory::Copier> copier)
-      : memory_(channel) {
+  Channel(const std::string &channel, std::shared_ptr<memory::Copier> copier,
+          const memory::Options &options = memory::Options())
+      : memory_(channel, options) {
     if (copier == nullptr) {
       copier = std::make_shared<memory::DefaultCopier>();
     }
@@ -81,46 +85,49 @@ class Channel {
   ~Channel() = default;
 
   bool write_client(memory::Memblock memblock, uint32_t *pos) {
-    if (memblock.size > memory_.allocator_->req.get_free_memory()) {
-      std::cerr << "Increase buffer_size" << std::endl;
-      return false;
-    }
-    *pos = counter();
-    auto q_pos = *pos & (queue_size() - 1);
-    ChannelElem *elem = &(memory_.shared_queue_->elements[q_pos]);
-
-    {
-      Scope _(&elem->mutex);
-      if (!elem->req.empty) {
-        std::cerr << "Queue is full, try again." << std::endl;
+    // Small requests are copied into the element, see `memory::Element`.
+    bool is_inline = memory::Element::fits_inline(memblock.size);
+    uint8_t *new_address = nullptr;
+    if (!is_inline) {
+      if (memblock.size > memory_.allocator_->req.get_free_memory()) {
+        std::cerr << "Increase buffer_size" << std::endl;
+        return false;
+      }
+      new_address = memory_.allocator_->req.alloc(memblock.size);
+      if (new_address == nullptr) {
         return false;
       }
-      inc_counter();  // move this after successful alloc? It'll prevent empty
-                      // req cells.
-      elem->req.empty = false;
+      copier_->user_to_shm(new_address, memblock.ptr, memblock.size);
     }
 
-    // With the code-block, when a thread reaches here, it is the only one that
-    // can access `elem`. No need for lock.
+    *pos = counter();
+    auto q_pos = *pos & (queue_size() - 1);
+    ChannelElem *elem = &(memory_.shared_queue_->elements()[q_pos]);
 
-    uint8_t *new_address = memory_.allocator_->req.alloc(memblock.size);
-    if (new_address == nullptr) {
-      elem->req.reset();
+    // The request is complete before `counter` moves, servers waiting on
+    // it can read it right away.
+    Scope _(&elem->mutex);
+    if (!elem->req.empty) {
+      std::cerr << "Queue is full, try again." << std::endl;
+      memory_.allocator_->req.free(new_address);
       return false;
     }
-
-    copier_->user_to_shm(new_address, memblock.ptr, memblock.size);
-    {
+    if (is_inline) {
+      copier_->user_to_shm(elem->req.payload, memblock.ptr, memblock.size);
+    } else {
       elem->req.address_handle =
           memory_.allocator_->req.ptr_to_handle(new_address);
-      elem->req.size = memblock.size;
     }
+    elem->req.is_inline = is_inline;
+    elem->req.size = memblock.size;
+    elem->req.empty = false;
+    inc_counter();
     return true;
   }
 
   bool read_client(uint32_t pos, memory::Memblock *memblock) {
     uint32_t q_pos = pos & (queue_size() - 1);
-    ChannelElem *elem = &(memory_.shared_queue_->elements[q_pos]);
+    ChannelElem *elem = &(memory_.shared_queue_->elements()[q_pos]);
 
     Scope _(&elem->mutex);
     while (elem->resp.empty) {
@@ -128,7 +135,7 @@ class Channel {
     }
 
     auto clean_up = [this](ChannelElem *elem) {
-      if (elem->req.size != 0) {
+      if (!elem->req.is_inline && elem->req.size != 0) {
         auto address =
             memory_.allocator_->req.handle_to_ptr(elem->req.address_handle);
         memory_.allocator_->req.free(address);
@@ -137,13 +144,15 @@ class Channel {
       elem->req.reset();
     };
 
-    if (elem->resp.address_handle == 0) {
+    if (!elem->resp.is_inline && elem->resp.address_handle == 0) {
       clean_up(elem);
       return false;
     }
 
     uint8_t *address =
-        memory_.allocator_->resp.handle_to_ptr(elem->resp.address_handle);
+        elem->resp.is_inline
+            ? elem->resp.payload
+            : memory_.allocator_->resp.handle_to_ptr(elem->resp.address_handle);
     memblock->size = elem->resp.size;
     memblock->ptr = copier_->alloc(memblock->size);
     copier_->shm_to_user(memblock->ptr, address, memblock->size);
@@ -153,7 +162,7 @@ class Channel {
 
   bool write_server(memory::Memblock memblock, uint32_t pos) {
     uint32_t q_pos = pos & (queue_size() - 1);
-    ChannelElem *elem = &(memory_.shared_queue_->elements[q_pos]);
+    ChannelElem *elem = &(memory_.shared_queue_->elements()[q_pos]);
 
     auto signal_error = [](ChannelElem *elem) {
       // This is how we convey an error: We mark that the result is written,
@@ -165,6 +174,16 @@ class Channel {
       elem->cond_var.signal();
     };
 
+    if (memory::Element::fits_inline(memblock.size)) {
+      Scope _(&elem->mutex);
+      copier_->user_to_shm(elem->resp.payload, memblock.ptr, memblock.size);
+      elem->resp.is_inline = true;
+      elem->resp.size = memblock.size;
+      elem->resp.empty = false;
+      elem->cond_var.signal();
+      return true;
+    }
+
     if (memblock.size > memory_.allocator_->resp.get_free_memory()) {
       std::cerr << "Increase buffer_size" << std::endl;
       signal_error(elem);
@@ -181,6 +200,7 @@ class Channel {
     copier_->user_to_shm(resp_address, memblock.ptr, memblock.size);
     Scope _(&elem->mutex);
     elem->resp.empty = false;
+    elem->resp.is_inline = false;
     elem->resp.address_handle =
         memory_.allocator_->resp.ptr_to_handle(resp_address);
     elem->resp.size = memblock.size;
@@ -190,14 +210,16 @@ class Channel {
 
   bool read_server(uint32_t pos, memory::Memblock *memblock) {
     uint32_t q_pos = pos & (queue_size() - 1);
-    ChannelElem *elem = &(memory_.shared_queue_->elements[q_pos]);
+    ChannelElem *elem = &(memory_.shared_queue_->elements()[q_pos]);
     Scope _(&elem->mutex);
 
     if (elem->req.empty) {
       return false;
     }
     uint8_t *address =
-        memory_.allocator_->req.handle_to_ptr(elem->req.address_handle);
+        elem->req.is_inline
+            ? elem->req.payload
+            : memory_.allocator_->req.handle_to_ptr(elem->req.address_handle);
     memblock->size = elem->req.size;
     memblock->ptr = copier_->alloc(memblock->size);
     copier_->shm_to_user(memblock->ptr, address, memblock->size);
@@ -206,7 +228,24 @@ class Channel {
 
   inline __attribute__((always_inline)) void inc_counter() {
     memory_.shared_queue_->counter++;
+    memory_.shared_queue_->notify();
+  }
+
+  // Sleeps until `counter()` moves past `seen`, see `SharedQueue::wait`.
+  bool wait(uint32_t seen, std::chrono::nanoseconds timeout) {
+    return memory_.shared_queue_->wait(seen, timeout);
+  }
+
+  // Wakes every server sleeping in `wait`.
+  void wake_all() { concurrent::futex_wake(&memory_.shared_queue_->counter); }
+
+  // An eventfd that is signalled when `counter()` moves, see
+  // `concurrent::FdBridge`. Release it with `close_fd`.
+  int open_fd() {
+    return concurrent::FdBridge::add(&memory_.shared_queue_->counter,
+                                     &memory_.shared_queue_->waiters);
   }
+  void close_fd(int fd) { concurrent::FdBridge::remove(fd); }
 
   inline __attribute__((always_inline)) uint32_t counter() const {
     return memory_.shared_queue_->counter.load();
@@ -37,7 +37,8 @@ class Client {
  public:
   explicit Client(const std::string &channel_name);
   Client(const std::string &channel_name,
-         std::shared_ptr<memory::Copier> copier);
+         std::shared_ptr<memory::Copier> copier,
+         const memory::Options &options = memory::Options());
   Client(const Client &) = delete;
   Client(Client &&);
 
@@ -56,9 +57,10 @@ Client::Client(const std::string &channel_name) : channel_name_(channel_name) {
 }
 
 Client::Client(const std::string &channel_name,
-               std::shared_ptr<memory::Copier> copier)
+               std::shared_ptr<memory::Copier> copier,
+               const memory::Options &options)
     : channel_name_(channel_name) {
-  channel_ = std::make_unique<Channel>(channel_name, copier);
+  channel_ = std::make_unique<Channel>(channel_name, copier, options);
 }
 
 Client::Client(Client &&other) {
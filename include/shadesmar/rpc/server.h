@@ -24,12 +24,15 @@ SOFTWARE.
 #ifndef INCLUDE_SHADESMAR_RPC_SERVER_H_
 #define INCLUDE_SHADESMAR_RPC_SERVER_H_
 
+#include <unistd.h>
+
 #include <atomic>
 #include <functional>
 #include <memory>
 #include <string>
 #include <utility>
 
+#include "shadesmar/concurrency/wait_strategy.h"
 #include "shadesmar/memory/memory.h"
 #include "shadesmar/rpc/channel.h"
 
@@ -52,19 +55,36 @@ class Server {
   Server(const std::string& channel_name, Callback cb);
   Server(const std::string& channel_name, Callback cb, Cleanup cln);
   Server(const std::string& channel_name, Callback cb, Cleanup cln,
-         std::shared_ptr<memory::Copier> copier);
+         std::shared_ptr<memory::Copier> copier,
+         const memory::Options& options = memory::Options());
   Server(const Server& other) = delete;
   Server(Server&& other);
+  ~Server();
 
   bool serve_once();
+  // Serves requests until `stop()`, waiting for new ones as set by
+  // `set_wait_strategy` (blocking by default).
   void serve();
   void stop();
 
+  void set_wait_strategy(const concurrent::WaitStrategy& wait_strategy) {
+    wait_strategy_ = wait_strategy;
+  }
+
+  // A file descriptor that polls readable when there may be new requests,
+  // see `Subscriber::fd()`. When it's readable, call `serve_ready()`.
+  int fd();
+  // Serves the requests that are already there, and re-arms `fd()`.
+  void serve_ready();
+
  private:
   bool process(uint32_t pos) const;
   void cleanup_req(memory::Memblock*) const;
   std::atomic_uint32_t pos_{0};
   std::atomic_bool running_{false};
+  int fd_ = -1;
+  concurrent::WaitStrategy wait_strategy_ =
+      concurrent::WaitStrategy::blocking();
   Callback callback_;
   Cleanup cleanup_;
   std::string channel_name_;
@@ -86,17 +106,27 @@ Server::Server(const std::string& channel_name, Callback cb, Cleanup cleanup)
 }
 
 Server::Server(const std::string& channel_name, Callback cb, Cleanup cleanup,
-               std::shared_ptr<memory::Copier> copier)
+               std::shared_ptr<memory::Copier> copier,
+               const memory::Options& options)
     : channel_name_(channel_name),
       callback_(std::move(cb)),
       cleanup_(cleanup) {
-  channel_ = std::make_unique<Channel>(channel_name, copier);
+  channel_ = std::make_unique<Channel>(channel_name, copier, options);
 }
 
 Server::Server(Server&& other) {
   callback_ = std::move(other.callback_);
   cleanup_ = std::move(other.cleanup_);
   channel_ = std::move(other.channel_);
+  wait_strategy_ = other.wait_strategy_;
+  fd_ = other.fd_;
+  other.fd_ = -1;
+}
+
+Server::~Server() {
+  if (fd_ >= 0) {
+    channel_->close_fd(fd_);
+  }
 }
 
 void Server::cleanup_req(memory::Memblock* req) const {
@@ -132,13 +162,45 @@ bool Server::serve_once() {
 }
 
 void Server::serve() {
+  // Only moves on to positions that clients have taken, and waits for
+  // them otherwise. See `Subscriber::spin` on the wake-up from `stop()`.
+  concurrent::Waiter waiter(wait_strategy_);
   running_ = true;
   while (running_.load()) {
+    uint32_t seen = channel_->counter();
+    if (seen == pos_.load()) {
+      waiter.idle([this, seen](std::chrono::nanoseconds timeout) {
+        channel_->wait(seen, timeout);
+      });
+      continue;
+    }
+    serve_once();
+    waiter.reset();
+  }
+}
+
+int Server::fd() {
+  if (fd_ < 0) {
+    fd_ = channel_->open_fd();
+  }
+  return fd_;
+}
+
+void Server::serve_ready() {
+  uint64_t value;
+  if (fd_ >= 0) {
+    while (read(fd_, &value, sizeof(value)) > 0) {
+    }
+  }
+  while (channel_->counter() != pos_.load()) {
     serve_once();
   }
 }
 
-void Server::stop() { running_ = false; }
+void Server::stop() {
+  running_ = false;
+  channel_->wake_all();
+}
 
 }  // namespace shm::rpc
 
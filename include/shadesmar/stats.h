@@ -24,9 +24,11 @@ SOFTWARE.
 #ifndef INCLUDE_SHADESMAR_STATS_H_
 #define INCLUDE_SHADESMAR_STATS_H_
 
+#include <algorithm>
 #include <cmath>
 #include <cstdlib>
 #include <iostream>
+#include <vector>
 
 namespace shm::stats {
 
@@ -83,6 +85,39 @@ std::ostream& operator<<(std::ostream& o, const Welford& w) {
   return o << w.mean() << " ± " << w.std_dev() << " (" << w.size() << ")";
 }
 
+// Keeps every sample, for tail latencies which `Welford` can't provide.
+class Percentile {
+ public:
+  void clear() {
+    values_.clear();
+    sorted_ = true;
+  }
+
+  void add(double value) {
+    values_.push_back(value);
+    sorted_ = false;
+  }
+
+  size_t size() const { return values_.size(); }
+
+  // `p` in [0, 100].
+  double get(double p) {
+    if (values_.empty()) {
+      return 0.0;
+    }
+    if (!sorted_) {
+      std::sort(values_.begin(), values_.end());
+      sorted_ = true;
+    }
+    auto idx = static_cast<size_t>(p / 100.0 * (values_.size() - 1));
+    return values_[idx];
+  }
+
+ private:
+  std::vector<double> values_;
+  bool sorted_{true};
+};
+
 }  // namespace shm::stats
 
 #endif  // INCLUDE_SHADESMAR_STATS_H_
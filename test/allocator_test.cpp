@@ -21,6 +21,12 @@ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
 SOFTWARE.
 ==============================================================================*/
 
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <csignal>
 #include <cstdlib>
 #include <cstring>
 #include <numeric>
@@ -31,20 +37,64 @@ SOFTWARE.
 #include "shadesmar.h"
 #else
 #include "shadesmar/memory/allocator.h"
+#include "shadesmar/memory/buddy_allocator.h"
+#include "shadesmar/memory/lockless_allocator.h"
+#include "shadesmar/memory/slab_allocator.h"
 #endif
 
 #define CATCH_CONFIG_MAIN
 #include "catch.hpp"
 
-shm::memory::Allocator *new_alloc(size_t size) {
-  auto *memory = malloc(size + sizeof(shm::memory::Allocator));
-  auto *alloc = new (memory)
-      shm::memory::Allocator(sizeof(shm::memory::Allocator), size);
+// The exact limits of some tests assume 4 byte block headers.
+#define ALLOCATORS_32 shm::memory::Allocator, shm::memory::LocklessAllocator
+#define ALLOCATORS ALLOCATORS_32, shm::memory::Allocator64
+#define ALL_ALLOCATORS \
+  ALLOCATORS, shm::memory::SlabAllocator, shm::memory::BuddyAllocator
+
+template <class AllocatorT = shm::memory::Allocator>
+AllocatorT *new_alloc(size_t size) {
+  return shm::memory::new_local_allocator<AllocatorT>(size);
+}
+
+// Shared between processes, unlike `new_alloc`.
+template <class AllocatorT>
+AllocatorT *new_shared_alloc(size_t size) {
+  auto *memory = mmap(nullptr, size + sizeof(AllocatorT),
+                      PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  auto *alloc = new (memory) AllocatorT(sizeof(AllocatorT), size);
   return alloc;
 }
 
-TEST_CASE("basic") {
-  auto *alloc = new_alloc(1024 * 1024);
+template <class AllocatorT>
+void free_shared_alloc(AllocatorT *alloc, size_t size) {
+  munmap(alloc, size + sizeof(AllocatorT));
+}
+
+// The heap is mapped twice, back to back, like the buffer of a mirrored
+// segment. The allocator sits on the page in front of it.
+template <class AllocatorT>
+AllocatorT *new_mirrored_alloc(size_t size) {
+  size_t page_size = sysconf(_SC_PAGESIZE);
+  int fd = memfd_create("mirrored_alloc", 0);
+  REQUIRE(ftruncate(fd, page_size + size) == 0);
+  auto *base = reinterpret_cast<uint8_t *>(
+      mmap(nullptr, page_size + 2 * size, PROT_NONE,
+           MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+  REQUIRE(mmap(base, page_size + size, PROT_READ | PROT_WRITE,
+               MAP_SHARED | MAP_FIXED, fd, 0) != MAP_FAILED);
+  REQUIRE(mmap(base + page_size + size, size, PROT_READ | PROT_WRITE,
+               MAP_SHARED | MAP_FIXED, fd, page_size) != MAP_FAILED);
+  close(fd);
+  return new (base) AllocatorT(page_size, size, true);
+}
+
+template <class AllocatorT>
+void free_mirrored_alloc(AllocatorT *alloc, size_t size) {
+  munmap(alloc, sysconf(_SC_PAGESIZE) + 2 * size);
+}
+
+TEMPLATE_TEST_CASE("basic", "", ALLOCATORS) {
+  auto *alloc = new_alloc<TestType>(1024 * 1024);
 
   auto *x = alloc->alloc(100);
   auto *y = alloc->alloc(250);
@@ -57,19 +107,292 @@ TEST_CASE("basic") {
   REQUIRE(yh - xh > 100);
   REQUIRE(zh - yh > 250);
 
-  REQUIRE(!alloc->free(z));
+  REQUIRE(alloc->free(x));
+  REQUIRE(alloc->free(y));
+  REQUIRE(alloc->free(z));
+
+  REQUIRE(alloc->get_free_memory() == 1024 * 1024);
+
+  free(alloc);
+}
+
+TEMPLATE_TEST_CASE("out_of_order_free", "", ALLOCATORS) {
+  auto *alloc = new_alloc<TestType>(1024);
+
+  auto *x = alloc->alloc(100);
+  auto *y = alloc->alloc(100);
+  auto *z = alloc->alloc(100);
+  auto free_memory = alloc->get_free_memory();
+
+  // `x` is still in use, nothing can be reclaimed yet.
+  REQUIRE(alloc->free(y));
+  REQUIRE(alloc->get_free_memory() == free_memory);
+
+  REQUIRE(alloc->free(z));
+  REQUIRE(alloc->free(x));
+  REQUIRE(alloc->get_free_memory() == 1024);
+
+  free(alloc);
+}
+
+TEMPLATE_TEST_CASE("double_free", "", ALL_ALLOCATORS) {
+  // Room for a chunk of `SlabAllocator`.
+  auto *alloc = new_alloc<TestType>(256 * 1024);
+
+  auto *x = alloc->alloc(100);
+  auto *y = alloc->alloc(100);
+
+  REQUIRE(alloc->free(y));
   REQUIRE(!alloc->free(y));
   REQUIRE(alloc->free(x));
 
-  REQUIRE(!alloc->free(z));
+  free(alloc);
+}
+
+TEMPLATE_TEST_CASE("free_most_recent", "", shm::memory::Allocator,
+                   shm::memory::Allocator64) {
+  auto *alloc = new_alloc<TestType>(1024);
+
+  auto *x = alloc->alloc(100);
+  auto free_memory = alloc->get_free_memory();
+
+  // The most recent block goes back to the head even though `x` is live.
+  for (int i = 0; i < 100; ++i) {
+    auto *y = alloc->alloc(512);
+    REQUIRE(y != nullptr);
+    REQUIRE(alloc->free(y));
+    REQUIRE(!alloc->free(y));
+    REQUIRE(alloc->get_free_memory() == free_memory);
+  }
+
+  REQUIRE(alloc->free(x));
+  REQUIRE(alloc->get_free_memory() == 1024);
+
+  free(alloc);
+}
+
+TEMPLATE_TEST_CASE("alloc_batch", "", ALL_ALLOCATORS) {
+  auto *alloc = new_alloc<TestType>(1024 * 1024);
+  auto free_memory = alloc->get_free_memory();
+
+  size_t sizes[] = {64, 100, 1000, 64};
+  uint8_t *ptrs[4];
+  REQUIRE(shm::memory::alloc_batch(alloc, sizes, 4, ptrs));
+  for (int i = 0; i < 4; ++i) {
+    REQUIRE(ptrs[i] != nullptr);
+    std::memset(ptrs[i], i, sizes[i]);
+  }
+  for (int i = 0; i < 4; ++i) {
+    REQUIRE(std::all_of(ptrs[i], ptrs[i] + sizes[i],
+                        [i](uint8_t v) { return v == i; }));
+  }
+
+  // All or nothing, the blocks of a batch that doesn't fit are given back,
+  // nothing is left over once the first batch is freed.
+  size_t too_large[] = {64, 64, 2 * 1024 * 1024};
+  uint8_t *unused[3];
+  REQUIRE(!shm::memory::alloc_batch(alloc, too_large, 3, unused));
+
+  for (auto *ptr : ptrs) {
+    REQUIRE(alloc->free(ptr));
+  }
+  REQUIRE(alloc->get_free_memory() == free_memory);
+
+  free(alloc);
+}
+
+TEST_CASE("aligned") {
+  auto *alloc = new_alloc(1024);
+
+  for (size_t alignment : {4, 16, 64, 128}) {
+    auto *x = alloc->alloc(10);
+    auto *y = alloc->alloc(100, alignment);
+    REQUIRE(x != nullptr);
+    REQUIRE(y != nullptr);
+    REQUIRE(reinterpret_cast<uintptr_t>(y) % alignment == 0);
+    REQUIRE(alloc->free(y));
+    REQUIRE(alloc->free(x));
+  }
+  REQUIRE(alloc->get_free_memory() == 1024);
+
+  free(alloc);
+}
+
+TEMPLATE_TEST_CASE("mirrored_wrap_around", "", ALLOCATORS) {
+  size_t size = 4096;
+  auto *alloc = new_mirrored_alloc<TestType>(size);
+
+  auto *x = alloc->alloc(2000);
+  auto *y = alloc->alloc(1500);
+  REQUIRE(x != nullptr);
+  REQUIRE(y != nullptr);
+  REQUIRE(alloc->free(x));
+
+  // Doesn't fit before the end of the heap, nor in front of `y` after a
+  // restart at 0. It does fit across the end.
+  auto *z = alloc->alloc(2000);
+  REQUIRE(z != nullptr);
+  auto *heap = alloc->handle_to_ptr(0);
+  REQUIRE(z < heap + size);
+  REQUIRE(z + 2000 > heap + size);
+
+  for (int i = 0; i < 2000; ++i) {
+    z[i] = static_cast<uint8_t>(i);
+  }
+  size_t wrapped = heap + size - z;
+  for (int i = wrapped; i < 2000; ++i) {
+    REQUIRE(heap[i - wrapped] == static_cast<uint8_t>(i));
+  }
+
   REQUIRE(alloc->free(y));
   REQUIRE(alloc->free(z));
+  REQUIRE(alloc->get_free_memory() == size);
+
+  free_mirrored_alloc(alloc, size);
+}
+
+TEMPLATE_TEST_CASE("mirrored_large_messages", "", ALLOCATORS) {
+  // Two messages of a bit less than half the heap are always in flight,
+  // half of them cross the end of the heap.
+  size_t size = 64 * 1024;
+  uint32_t bytes = 0.45 * size;
+  auto *alloc = new_mirrored_alloc<TestType>(size);
+
+  auto *prev = alloc->alloc(bytes);
+  REQUIRE(prev != nullptr);
+  for (int i = 0; i < 100; ++i) {
+    auto *next = alloc->alloc(bytes);
+    REQUIRE(next != nullptr);
+    std::memset(next, i, bytes);
+    REQUIRE(alloc->free(prev));
+    prev = next;
+  }
+  REQUIRE(alloc->free(prev));
+
+  free_mirrored_alloc(alloc, size);
+}
+
+TEST_CASE("allocator64_large_heap") {
+  using shm::memory::Allocator64;
+  // Only the pages that are touched are backed.
+  size_t size = 20ull << 30;
+  auto *memory = mmap(nullptr, size + sizeof(Allocator64),
+                      PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  REQUIRE(memory != MAP_FAILED);
+  auto *alloc = new (memory) Allocator64(sizeof(Allocator64), size);
+
+  size_t bytes = 5ull << 30;
+  std::vector<uint8_t *> ptrs;
+  for (int i = 0; i < 3; ++i) {
+    auto *ptr = alloc->alloc(bytes);
+    REQUIRE(ptr != nullptr);
+    ptr[0] = ptr[bytes - 1] = i;
+    ptrs.push_back(ptr);
+  }
+  REQUIRE(alloc->ptr_to_handle(ptrs[2]) > (10ull << 30));
+  REQUIRE(alloc->alloc(bytes) == nullptr);
+
+  REQUIRE(alloc->free(ptrs[1]));
+  REQUIRE(alloc->free(ptrs[0]));
+  // Doesn't fit before the end of the heap, restarts at 0.
+  auto *ptr = alloc->alloc(8ull << 30);
+  REQUIRE(ptr != nullptr);
+  REQUIRE(alloc->ptr_to_handle(ptr) < bytes);
+  REQUIRE(ptrs[2][bytes - 1] == 2);
+
+  REQUIRE(alloc->free(ptrs[2]));
+  REQUIRE(alloc->free(ptr));
+  REQUIRE(alloc->get_free_memory() == size);
+
+  munmap(memory, size + sizeof(Allocator64));
+}
+
+TEST_CASE("slab_size_classes") {
+  using shm::memory::SlabAllocator;
+  auto *alloc = new_alloc<SlabAllocator>(1024 * 1024);
+
+  std::vector<uint32_t> sizes = {1, 64, 65, 4096, 4097, 200 * 1024};
+  std::vector<uint8_t *> ptrs;
+  for (auto size : sizes) {
+    auto *ptr = alloc->alloc(size);
+    REQUIRE(ptr != nullptr);
+    std::memset(ptr, 0xff, size);
+    ptrs.push_back(ptr);
+  }
+  for (int i = 0; i < ptrs.size(); ++i) {
+    for (int j = i + 1; j < ptrs.size(); ++j) {
+      REQUIRE(ptrs[i] != ptrs[j]);
+    }
+  }
+
+  // Freed blocks are reused by the next alloc of the same class.
+  REQUIRE(alloc->free(ptrs[2]));
+  REQUIRE(alloc->alloc(100) == ptrs[2]);
+  REQUIRE(alloc->free(ptrs[4]));
+  REQUIRE(alloc->alloc(8000) == ptrs[4]);
+
+  free(alloc);
+}
+
+TEST_CASE("slab_exhaustion") {
+  using shm::memory::SlabAllocator;
+  auto *alloc = new_alloc<SlabAllocator>(4 * SlabAllocator::CHUNK_SIZE);
+  auto free_memory = alloc->get_free_memory();
+
+  // The class table takes a bit of the first chunk.
+  std::vector<uint8_t *> ptrs;
+  uint8_t *ptr;
+  while ((ptr = alloc->alloc(4096)) != nullptr) {
+    ptrs.push_back(ptr);
+  }
+  REQUIRE(ptrs.size() == 3 * SlabAllocator::CHUNK_SIZE / 4096);
+  REQUIRE(alloc->get_free_memory() == 0);
+  REQUIRE(alloc->alloc(64) == nullptr);
+
+  for (auto *p : ptrs) {
+    REQUIRE(alloc->free(p));
+  }
+  REQUIRE(alloc->get_free_memory() == free_memory);
 
   free(alloc);
 }
 
-TEST_CASE("size_limit") {
-  auto *alloc = new_alloc(100);
+TEST_CASE("buddy_split_and_merge") {
+  using shm::memory::BuddyAllocator;
+  size_t size = 64 * BuddyAllocator::MIN_BLOCK;
+  auto *alloc = new_alloc<BuddyAllocator>(size);
+  auto free_memory = alloc->get_free_memory();
+  // The order table takes the first unit.
+  REQUIRE(free_memory == size - BuddyAllocator::MIN_BLOCK);
+
+  auto *x = alloc->alloc(1);
+  auto *y = alloc->alloc(BuddyAllocator::MIN_BLOCK + 1);
+  auto *z = alloc->alloc(8 * BuddyAllocator::MIN_BLOCK);
+  REQUIRE(x != nullptr);
+  REQUIRE(y != nullptr);
+  REQUIRE(z != nullptr);
+  REQUIRE(alloc->get_free_memory() ==
+          free_memory - 11 * BuddyAllocator::MIN_BLOCK);
+
+  // Buddies merge back regardless of the order they are freed in.
+  REQUIRE(alloc->free(y));
+  REQUIRE(!alloc->free(y));
+  REQUIRE(alloc->free(z));
+  REQUIRE(alloc->free(x));
+  REQUIRE(alloc->get_free_memory() == free_memory);
+
+  // So the largest block is available again.
+  auto *w = alloc->alloc(32 * BuddyAllocator::MIN_BLOCK);
+  REQUIRE(w != nullptr);
+  REQUIRE(alloc->alloc(32 * BuddyAllocator::MIN_BLOCK) == nullptr);
+  REQUIRE(alloc->free(w));
+
+  free(alloc);
+}
+
+TEMPLATE_TEST_CASE("size_limit", "", ALLOCATORS_32) {
+  auto *alloc = new_alloc<TestType>(100);
 
   auto *x = alloc->alloc(50);
   auto *y = alloc->alloc(32);
@@ -82,8 +405,8 @@ TEST_CASE("size_limit") {
   free(alloc);
 }
 
-TEST_CASE("perfect_wrap_around") {
-  auto *alloc = new_alloc(100);
+TEMPLATE_TEST_CASE("perfect_wrap_around", "", ALLOCATORS_32) {
+  auto *alloc = new_alloc<TestType>(100);
 
   auto *x = alloc->alloc(50);
   auto *y = alloc->alloc(32);
@@ -102,8 +425,8 @@ TEST_CASE("perfect_wrap_around") {
   free(alloc);
 }
 
-TEST_CASE("wrap_around") {
-  auto *alloc = new_alloc(100);
+TEMPLATE_TEST_CASE("wrap_around", "", ALLOCATORS_32) {
+  auto *alloc = new_alloc<TestType>(100);
 
   auto *x = alloc->alloc(50);
   auto *y = alloc->alloc(32);
@@ -122,8 +445,8 @@ TEST_CASE("wrap_around") {
   free(alloc);
 }
 
-TEST_CASE("cyclic") {
-  auto *alloc = new_alloc(256);
+TEMPLATE_TEST_CASE("cyclic", "", ALLOCATORS) {
+  auto *alloc = new_alloc<TestType>(256);
 
   auto *it1 = alloc->alloc(40);
   auto *it2 = alloc->alloc(40);
@@ -152,10 +475,10 @@ TEST_CASE("cyclic") {
   free(alloc);
 }
 
-TEST_CASE("multithread", "[!mayfail]") {
+TEMPLATE_TEST_CASE("multithread", "[!mayfail]", ALL_ALLOCATORS) {
   int nthreads = 32;
   std::vector<int> allocs = {10, 200, 3000};
-  auto *alloc = new_alloc(
+  auto *alloc = new_alloc<TestType>(
       2 * std::accumulate(allocs.begin(), allocs.end(), 0) * nthreads);
 
   std::vector<std::thread> threads;
@@ -178,6 +501,14 @@ TEST_CASE("multithread", "[!mayfail]") {
 
         for (int i = 0; i < allocs.size(); ++i) {
           ps[i] = alloc->alloc(allocs[i]);
+          if (ps[i] == nullptr) {
+            // The heap is full, and may stay full as long as this thread
+            // holds on to the tail. Give everything back and start over.
+            for (int j = 0; j < i; ++j) {
+              REQUIRE(alloc->free(ps[j]));
+            }
+            i = -1;
+          }
           rand_sleep(10);
         }
 
@@ -189,24 +520,14 @@ TEST_CASE("multithread", "[!mayfail]") {
         rand_sleep(100);
 
         for (int i = 0; i < ps.size(); ++i) {
-          for (int l = 0; l < allocs[i]; ++i) {
+          for (int l = 0; l < allocs[i]; ++l) {
             REQUIRE(ps[i][l] == static_cast<uint8_t>(ps.size() * t + i));
           }
         }
 
-        int max_tries = std::max(nthreads * nthreads, 100);
-        auto timed_free_loop = [&](uint8_t *p) -> bool {
-          for (int i = 0; i < max_tries; ++i) {
-            if (alloc->free(p)) {
-              return true;
-            }
-            rand_sleep(50);
-          }
-          return false;
-        };
-
         for (auto p : ps) {
-          REQUIRE(timed_free_loop(p));
+          REQUIRE(alloc->free(p));
+          rand_sleep(50);
         }
       }
     });
@@ -217,3 +538,113 @@ TEST_CASE("multithread", "[!mayfail]") {
 
   free(alloc);
 }
+
+TEMPLATE_TEST_CASE("multiprocess", "", ALL_ALLOCATORS) {
+  int nprocs = 8;
+  int iters = 2000;
+  std::vector<int> allocs = {10, 200, 3000};
+  size_t size = 16 * nprocs * std::accumulate(allocs.begin(), allocs.end(), 0);
+  auto *alloc = new_shared_alloc<TestType>(size);
+  size_t free_memory = alloc->get_free_memory();
+
+  std::vector<pid_t> children;
+  for (int p = 0; p < nprocs; ++p) {
+    pid_t pid = fork();
+    if (pid == 0) {
+      // Every process frees its blocks in reverse order, interleaved
+      // with the other processes.
+      bool ok = true;
+      for (int i = 0; i < iters && ok; ++i) {
+        std::vector<uint8_t *> ptrs;
+        while (ptrs.size() < allocs.size()) {
+          uint8_t *ptr = alloc->alloc(allocs[ptrs.size()]);
+          if (ptr == nullptr) {
+            // Don't hold on to the tail of a full heap.
+            for (auto *held : ptrs) {
+              ok &= alloc->free(held);
+            }
+            ptrs.clear();
+            std::this_thread::yield();
+            continue;
+          }
+          std::memset(ptr, static_cast<uint8_t>(p * iters + i),
+                      allocs[ptrs.size()]);
+          ptrs.push_back(ptr);
+        }
+        std::this_thread::yield();
+        for (int a = allocs.size() - 1; a >= 0; --a) {
+          for (int b = 0; b < allocs[a]; ++b) {
+            ok &= ptrs[a][b] == static_cast<uint8_t>(p * iters + i);
+          }
+          ok &= alloc->free(ptrs[a]);
+        }
+      }
+      _exit(ok ? 0 : 1);
+    }
+    children.push_back(pid);
+  }
+
+  for (auto pid : children) {
+    int status;
+    waitpid(pid, &status, 0);
+    REQUIRE(WIFEXITED(status));
+    REQUIRE(WEXITSTATUS(status) == 0);
+  }
+  REQUIRE(alloc->get_free_memory() == free_memory);
+
+  free_shared_alloc(alloc, size);
+}
+
+TEST_CASE("lockless_killed_claim") {
+  using Alloc = shm::memory::LocklessAllocator;
+  size_t page_size = sysconf(_SC_PAGESIZE);
+  size_t size = 16 * page_size;
+  // The heap starts on a page of its own, so a child can write-protect it.
+  auto *base = reinterpret_cast<uint8_t *>(
+      mmap(nullptr, page_size + size, PROT_READ | PROT_WRITE,
+           MAP_SHARED | MAP_ANONYMOUS, -1, 0));
+  auto *alloc = new (base) Alloc(page_size, size);
+  size_t free_memory = alloc->get_free_memory();
+
+  // The child takes the claim, then faults on the header store and is
+  // killed before its commit.
+  pid_t pid = fork();
+  if (pid == 0) {
+    signal(SIGSEGV, [](int) { raise(SIGKILL); });
+    mprotect(base + page_size, size, PROT_READ);
+    alloc->alloc(100);
+    _exit(0);
+  }
+  int status;
+  waitpid(pid, &status, 0);
+  REQUIRE(WIFSIGNALED(status));
+  REQUIRE(WTERMSIG(status) == SIGKILL);
+
+  // The survivors roll the claim back and carry on.
+  std::vector<pid_t> children;
+  for (int p = 0; p < 4; ++p) {
+    pid = fork();
+    if (pid == 0) {
+      bool ok = true;
+      for (int i = 0; i < 1000 && ok; ++i) {
+        uint8_t *ptr = alloc->alloc(100 + p);
+        if (ptr == nullptr) {
+          std::this_thread::yield();
+          continue;
+        }
+        std::memset(ptr, p, 100 + p);
+        ok &= alloc->free(ptr);
+      }
+      _exit(ok ? 0 : 1);
+    }
+    children.push_back(pid);
+  }
+  for (auto child : children) {
+    waitpid(child, &status, 0);
+    REQUIRE(WIFEXITED(status));
+    REQUIRE(WEXITSTATUS(status) == 0);
+  }
+  REQUIRE(alloc->get_free_memory() == free_memory);
+
+  munmap(base, page_size + size);
+}
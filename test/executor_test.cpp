@@ -0,0 +1,169 @@
+/* MIT License
+
+Copyright (c) 2020 Dheeraj R Reddy
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+==============================================================================*/
+
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifdef SINGLE_HEADER
+#include "shadesmar.h"
+#else
+#include "shadesmar/executor.h"
+#include "shadesmar/pubsub/publisher.h"
+#include "shadesmar/pubsub/subscriber.h"
+#include "shadesmar/rpc/client.h"
+#include "shadesmar/rpc/server.h"
+#endif
+
+#define CATCH_CONFIG_MAIN
+#include "catch.hpp"
+
+TEST_CASE("per_topic_ordering") {
+  const int n_topics = 10;
+  const int n_messages = 1000;
+
+  // Catch's assertions aren't thread-safe, workers only count.
+  struct Stats {
+    std::atomic<int> received{0};
+    std::atomic<int> in_flight{0};
+    std::atomic<int> errors{0};
+    int last = -1;
+  };
+  std::vector<Stats> stats(n_topics);
+
+  shm::Executor executor(4);
+  std::vector<std::unique_ptr<shm::pubsub::Publisher>> pubs;
+  for (int t = 0; t < n_topics; ++t) {
+    std::string topic = "per_topic_ordering_" + std::to_string(t);
+    pubs.push_back(std::make_unique<shm::pubsub::Publisher>(topic));
+    Stats *s = &stats[t];
+    REQUIRE(executor.add(std::make_unique<shm::pubsub::Subscriber>(
+        topic, [s](shm::memory::Memblock *memblock) {
+          if (s->in_flight++ != 0) {
+            s->errors++;
+          }
+          int message = *reinterpret_cast<int *>(memblock->ptr);
+          if (message != s->last + 1) {
+            s->errors++;
+          }
+          s->last = message;
+          s->received++;
+          s->in_flight--;
+        })));
+  }
+
+  std::thread th([&executor]() { executor.spin(); });
+  for (int i = 0; i < n_messages; ++i) {
+    for (auto &pub : pubs) {
+      REQUIRE(pub->publish(&i, sizeof(i)));
+    }
+  }
+
+  for (auto &s : stats) {
+    while (s.received < n_messages) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+  }
+  executor.stop();
+  th.join();
+
+  for (auto &s : stats) {
+    REQUIRE(s.received == n_messages);
+    REQUIRE(s.errors == 0);
+  }
+}
+
+TEST_CASE("topics_in_parallel") {
+  const int n_topics = 4;
+  std::atomic<int> received{0};
+
+  shm::Executor executor(4);
+  std::vector<std::unique_ptr<shm::pubsub::Publisher>> pubs;
+  for (int t = 0; t < n_topics; ++t) {
+    std::string topic = "topics_in_parallel_" + std::to_string(t);
+    pubs.push_back(std::make_unique<shm::pubsub::Publisher>(topic));
+    REQUIRE(executor.add(std::make_unique<shm::pubsub::Subscriber>(
+        topic, [&received](shm::memory::Memblock *) {
+          std::this_thread::sleep_for(std::chrono::milliseconds(200));
+          received++;
+        })));
+  }
+
+  std::thread th([&executor]() { executor.spin(); });
+  auto start = std::chrono::steady_clock::now();
+  for (int t = 0; t < n_topics; ++t) {
+    REQUIRE(pubs[t]->publish(&t, sizeof(t)));
+  }
+  while (received < n_topics) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  auto elapsed = std::chrono::steady_clock::now() - start;
+  executor.stop();
+  th.join();
+
+  // One after the other would take 800ms.
+  REQUIRE(elapsed < std::chrono::milliseconds(600));
+}
+
+TEST_CASE("server") {
+  std::string channel_name = "executor_server";
+
+  shm::Executor executor(2);
+  REQUIRE(executor.add(std::make_unique<shm::rpc::Server>(
+      channel_name,
+      [](const shm::memory::Memblock &req, shm::memory::Memblock *resp) {
+        resp->ptr = malloc(req.size);
+        resp->size = req.size;
+        std::memset(resp->ptr, 2 * (static_cast<char *>(req.ptr)[0]),
+                    req.size);
+        return true;
+      },
+      [](shm::memory::Memblock *resp) {
+        free(resp->ptr);
+        resp->ptr = nullptr;
+        resp->size = 0;
+      })));
+  std::thread th([&executor]() { executor.spin(); });
+
+  shm::rpc::Client client(channel_name);
+  for (char message = 1; message <= 5; ++message) {
+    shm::memory::Memblock req, resp;
+    req.ptr = &message;
+    req.size = sizeof(char);
+    REQUIRE(client.call(req, &resp));
+    REQUIRE(static_cast<char *>(resp.ptr)[0] == 2 * message);
+    client.free_resp(&resp);
+  }
+  executor.stop();
+  th.join();
+}
+
+TEST_CASE("stop_before_spin") {
+  shm::Executor executor(2);
+  executor.stop();
+  executor.spin();
+}
@@ -21,9 +21,25 @@ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
 SOFTWARE.
 ==============================================================================*/
 
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <ctime>
 #include <iostream>
+#include <memory>
 #include <mutex>
+#include <numeric>
+#include <stdexcept>
 #include <thread>
+#include <utility>
 #include <vector>
 
 #ifdef SINGLE_HEADER
@@ -31,6 +47,9 @@ SOFTWARE.
 #else
 #include "shadesmar/pubsub/publisher.h"
 #include "shadesmar/pubsub/subscriber.h"
+#include "shadesmar/pubsub/typed_publisher.h"
+#include "shadesmar/pubsub/typed_subscriber.h"
+#include "shadesmar/rpc/channel.h"
 #endif
 
 #define CATCH_CONFIG_MAIN
@@ -97,11 +116,22 @@ TEST_CASE("alternating_pub_sub") {
   }
 }
 
+// Topics are run with and without `Options::seqlock`.
+shm::memory::Options read_mode_options(std::string *topic) {
+  shm::memory::Options options;
+  options.seqlock = GENERATE(false, true);
+  if (options.seqlock) {
+    *topic += "_seqlock";
+  }
+  return options;
+}
+
 TEST_CASE("single_pub_multiple_sub") {
   std::string topic = "single_pub_multiple_sub";
+  auto options = read_mode_options(&topic);
 
   std::vector<int> messages = {1, 2, 3, 4, 5};
-  shm::pubsub::Publisher pub(topic);
+  shm::pubsub::Publisher pub(topic, nullptr, options);
 
   int n_subs = 3;
   std::vector<std::vector<int>> vec_answers;
@@ -153,13 +183,14 @@ TEST_CASE("single_pub_multiple_sub") {
 
 TEST_CASE("multiple_pub_single_sub") {
   std::string topic = "multiple_pub_single_sub";
+  auto options = read_mode_options(&topic);
 
   int n_pubs = 3;
   int n_messages = 5;
 
   std::vector<shm::pubsub::Publisher> pubs;
   for (int i = 0; i < n_pubs; ++i) {
-    shm::pubsub::Publisher pub(topic);
+    shm::pubsub::Publisher pub(topic, nullptr, options);
     pubs.push_back(std::move(pub));
   }
 
@@ -201,13 +232,14 @@ TEST_CASE("multiple_pub_single_sub") {
 
 TEST_CASE("multiple_pub_multiple_sub") {
   std::string topic = "multiple_pub_multiple_sub";
+  auto options = read_mode_options(&topic);
 
   int n_pubs = 3, n_subs = 3, n_messages = 5;
   REQUIRE(n_pubs == n_subs);
 
   std::vector<shm::pubsub::Publisher> pubs;
   for (int i = 0; i < n_pubs; ++i) {
-    shm::pubsub::Publisher pub(topic);
+    shm::pubsub::Publisher pub(topic, nullptr, options);
     pubs.push_back(std::move(pub));
   }
 
@@ -305,6 +337,1424 @@ TEST_CASE("sub_counter_jump") {
   REQUIRE(answer == moveahead);
 }
 
+TEST_CASE("topic_options") {
+  std::string topic = "topic_options";
+
+  shm::memory::Options options;
+  options.queue_size = 16;
+  options.buffer_size = 4096;
+  shm::pubsub::Publisher pub(topic, nullptr, options);
+
+  int answer;
+  auto callback = [&answer](shm::memory::Memblock *memblock) {
+    answer = *(reinterpret_cast<int *>(memblock->ptr));
+  };
+  // Joins with the default options, the geometry is read from the segment.
+  shm::pubsub::Subscriber sub(topic, callback);
+
+  for (int i = 0; i < options.queue_size; ++i) {
+    pub.publish(reinterpret_cast<void *>(&i), sizeof(int));
+  }
+
+  sub.spin_once();
+  REQUIRE(answer ==
+          shm::pubsub::jumpahead(options.queue_size, options.queue_size));
+}
+
+TEST_CASE("buffer_too_big") {
+  std::string topic = "buffer_too_big";
+
+  shm::memory::Options options;
+  options.buffer_size = shm::memory::Allocator::max_size() + 4096;
+  REQUIRE_THROWS_AS(shm::pubsub::Publisher(topic, nullptr, options),
+                    std::invalid_argument);
+
+  using SlabPublisher = shm::pubsub::PublisherT<shm::memory::SlabAllocator>;
+  options.buffer_size = shm::memory::SlabAllocator::max_size() + 4096;
+  REQUIRE_THROWS_AS(SlabPublisher(topic, nullptr, options),
+                    std::invalid_argument);
+}
+
+TEST_CASE("huge_pages") {
+  std::string topic = "huge_pages";
+
+  // Falls back to regular pages if huge pages aren't available.
+  shm::memory::Options options;
+  options.buffer_size = 4 * 1024 * 1024;
+  options.huge_pages = true;
+  shm::pubsub::Publisher pub(topic, nullptr, options);
+
+  std::vector<int> messages = {1, 2, 3, 4, 5};
+  std::vector<int> answers;
+  auto callback = [&answers](shm::memory::Memblock *memblock) {
+    answers.push_back(*(reinterpret_cast<int *>(memblock->ptr)));
+  };
+  shm::pubsub::Subscriber sub(topic, callback);
+
+  for (int message : messages) {
+    pub.publish(reinterpret_cast<void *>(&message), sizeof(int));
+    sub.spin_once();
+  }
+  REQUIRE(answers == messages);
+  unlink((options.hugetlbfs_mount + "/SHM_" + topic).c_str());
+}
+
+TEST_CASE("prefault_and_lock") {
+  std::string topic = "prefault_and_lock";
+
+  shm::memory::Options options;
+  options.buffer_size = 1024 * 1024;
+  options.prefault = true;
+  options.lock_memory = true;
+
+  int message = 3, answer = 0;
+  auto callback = [&answer](shm::memory::Memblock *memblock) {
+    answer = *(reinterpret_cast<int *>(memblock->ptr));
+  };
+  shm::pubsub::Publisher pub(topic, nullptr, options);
+  // Pre-faulting a joined segment must not clobber its contents.
+  pub.publish(reinterpret_cast<void *>(&message), sizeof(int));
+  shm::pubsub::Subscriber sub(topic, callback, nullptr, options);
+
+  sub.spin_once();
+  REQUIRE(answer == message);
+}
+
+TEST_CASE("concurrent_open") {
+  std::string topic = "concurrent_open";
+
+  int n_pubs = 16;
+  std::vector<std::unique_ptr<shm::pubsub::Publisher>> pubs(n_pubs);
+  std::vector<std::thread> threads;
+  for (int p = 0; p < n_pubs; ++p) {
+    threads.emplace_back([&, p]() {
+      pubs[p] = std::make_unique<shm::pubsub::Publisher>(topic);
+    });
+  }
+  for (auto &th : threads) {
+    th.join();
+  }
+
+  std::vector<int> answers;
+  auto callback = [&answers](shm::memory::Memblock *memblock) {
+    answers.push_back(*(reinterpret_cast<int *>(memblock->ptr)));
+  };
+  shm::pubsub::Subscriber sub(topic, callback);
+
+  std::vector<int> messages;
+  for (int p = 0; p < n_pubs; ++p) {
+    messages.push_back(p);
+    pubs[p]->publish(reinterpret_cast<void *>(&p), sizeof(int));
+    sub.spin_once();
+  }
+  REQUIRE(answers == messages);
+}
+
+// Leaves a segment of `size` bytes behind, as a process of another version
+// or one that crashed would, `fill` writes its header.
+void leave_segment(const std::string &topic, size_t size,
+                   const std::function<void(shm::memory::SegmentHeader *)>
+                       &fill = nullptr) {
+  std::string name = "/SHM_" + topic;
+  shm_unlink(name.c_str());
+  int fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0644);
+  REQUIRE(fd >= 0);
+  if (size > 0) {
+    REQUIRE(ftruncate(fd, size) == 0);
+    auto *header = reinterpret_cast<shm::memory::SegmentHeader *>(
+        mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0));
+    if (fill) {
+      fill(header);
+    }
+    munmap(header, size);
+  }
+  close(fd);
+}
+
+pid_t dead_pid() {
+  pid_t pid = fork();
+  if (pid == 0) {
+    _exit(0);
+  }
+  waitpid(pid, nullptr, 0);
+  return pid;
+}
+
+void pub_sub_once(const std::string &topic) {
+  int answer = 0;
+  auto callback = [&answer](shm::memory::Memblock *memblock) {
+    answer = *(reinterpret_cast<int *>(memblock->ptr));
+  };
+  shm::pubsub::Publisher pub(topic);
+  shm::pubsub::Subscriber sub(topic, callback);
+  int message = 7;
+  REQUIRE(pub.publish(&message, sizeof(int)));
+  sub.spin_once();
+  REQUIRE(answer == message);
+}
+
+TEST_CASE("stale_segment") {
+  std::string topic = "stale_segment";
+  pid_t dead = dead_pid();
+
+  SECTION("older version") {
+    leave_segment(topic, 1 << 20, [dead](shm::memory::SegmentHeader *header) {
+      header->magic = shm::memory::SEGMENT_MAGIC;
+      header->version = shm::memory::STABLE_PREFIX_VERSION - 1;
+      header->creator_pid = dead;
+      header->state = shm::memory::READY;
+    });
+  }
+  SECTION("newer version") {
+    leave_segment(topic, 1 << 20, [dead](shm::memory::SegmentHeader *header) {
+      header->magic = shm::memory::SEGMENT_MAGIC;
+      header->version = shm::memory::SEGMENT_VERSION + 1;
+      header->creator_pid = dead;
+      header->pid_set_offset = 4096;
+      auto *pid_set = new (reinterpret_cast<uint8_t *>(header) + 4096)
+          shm::memory::PIDSet();
+      pid_set->insert(dead);
+      header->state = shm::memory::READY;
+    });
+  }
+  SECTION("other type") {
+    // An rpc channel of the same name, left by a process that exited.
+    shm_unlink(("/SHM_" + topic).c_str());
+    pid_t pid = fork();
+    if (pid == 0) {
+      shm::rpc::Channel channel(topic);
+      _exit(0);
+    }
+    waitpid(pid, nullptr, 0);
+  }
+  SECTION("no header") {
+    leave_segment(topic, 1 << 20, [dead](shm::memory::SegmentHeader *header) {
+      new (header) shm::memory::PIDSet();
+      reinterpret_cast<shm::memory::PIDSet *>(header)->insert(dead);
+    });
+  }
+  SECTION("creator died before truncating") { leave_segment(topic, 0); }
+  SECTION("creator died before claiming") { leave_segment(topic, 1 << 20); }
+  SECTION("creator died while initializing") {
+    leave_segment(topic, 1 << 20, [dead](shm::memory::SegmentHeader *header) {
+      header->magic = shm::memory::SEGMENT_MAGIC;
+      header->version = shm::memory::SEGMENT_VERSION;
+      header->creator_pid = dead;
+      header->pid_set_offset = 4096;
+      new (reinterpret_cast<uint8_t *>(header) + 4096) shm::memory::PIDSet();
+      header->state = shm::memory::INITIALIZING;
+    });
+  }
+
+  pub_sub_once(topic);
+}
+
+TEST_CASE("incompatible_segment_in_use") {
+  std::string topic = "incompatible_segment_in_use";
+  leave_segment(topic, 1 << 20, [](shm::memory::SegmentHeader *header) {
+    header->magic = shm::memory::SEGMENT_MAGIC;
+    header->version = shm::memory::STABLE_PREFIX_VERSION - 1;
+    header->creator_pid = getpid();
+    header->state = shm::memory::READY;
+  });
+  REQUIRE_THROWS_AS(shm::pubsub::Publisher(topic), std::runtime_error);
+  shm_unlink(("/SHM_" + topic).c_str());
+}
+
+template <class AllocatorT>
+void multiple_publishers(const std::string &topic) {
+  using Publisher = shm::pubsub::PublisherT<AllocatorT>;
+  using Subscriber = shm::pubsub::SubscriberT<AllocatorT>;
+
+  int n_pubs = 3, n_messages = 5;
+  std::vector<Publisher> pubs;
+  for (int i = 0; i < n_pubs; ++i) {
+    pubs.emplace_back(topic);
+  }
+
+  std::vector<int> answers;
+  auto callback = [&answers](shm::memory::Memblock *memblock) {
+    answers.push_back(*(reinterpret_cast<int *>(memblock->ptr)));
+  };
+  Subscriber sub(topic, callback);
+
+  std::vector<int> messages;
+  for (int m = 0; m < n_messages; ++m) {
+    for (int p = 0; p < n_pubs; ++p) {
+      int msg = m * n_pubs + p;
+      messages.push_back(msg);
+      pubs[p].publish(reinterpret_cast<void *>(&msg), sizeof(int));
+    }
+  }
+  for (int i = 0; i < messages.size(); ++i) {
+    sub.spin_once();
+  }
+  REQUIRE(answers == messages);
+}
+
+TEST_CASE("allocator64") {
+  multiple_publishers<shm::memory::Allocator64>("allocator64");
+}
+
+TEST_CASE("lockless_allocator") {
+  multiple_publishers<shm::memory::LocklessAllocator>("lockless_allocator");
+}
+
+TEST_CASE("slab_allocator") {
+  multiple_publishers<shm::memory::SlabAllocator>("slab_allocator");
+}
+
+TEST_CASE("buddy_allocator") {
+  multiple_publishers<shm::memory::BuddyAllocator>("buddy_allocator");
+}
+
+TEST_CASE("loan") {
+  std::string topic = "loan";
+
+  std::vector<std::string> answers;
+  auto callback = [&answers](shm::memory::Memblock *memblock) {
+    answers.emplace_back(reinterpret_cast<char *>(memblock->ptr),
+                         memblock->size);
+  };
+  shm::memory::Options options;
+  options.buffer_size = 1024 * 1024;
+  shm::pubsub::Publisher pub(topic, nullptr, options);
+  shm::pubsub::Subscriber sub(topic, callback);
+
+  // Too large for the buffer, and the empty loan can't be committed.
+  auto failed = pub.borrow(2 * options.buffer_size);
+  REQUIRE(failed.is_empty());
+  REQUIRE(!pub.commit(failed));
+  sub.spin_once();
+  REQUIRE(answers.empty());
+
+  // A loan can shrink, but not grow.
+  {
+    auto loan = pub.borrow(64);
+    REQUIRE(!loan.is_empty());
+    loan.size = 65;
+    REQUIRE(!pub.commit(loan));
+    pub.abort(loan);
+  }
+
+  std::vector<std::string> messages = {"zero", "copy", "publish"};
+  for (auto &message : messages) {
+    auto loan = pub.borrow(64);
+    REQUIRE(!loan.is_empty());
+    std::memcpy(loan.ptr, message.data(), message.size());
+    loan.size = message.size();
+    REQUIRE(pub.commit(loan));
+    sub.spin_once();
+  }
+  REQUIRE(answers == messages);
+
+  // Aborted loans aren't published, and their memory is reused.
+  for (int i = 0; i < 100; ++i) {
+    auto loan = pub.borrow(options.buffer_size / 2);
+    REQUIRE(!loan.is_empty());
+    pub.abort(loan);
+  }
+  sub.spin_once();
+  REQUIRE(answers == messages);
+}
+
+template <class AllocatorT>
+void publish_batch(const std::string &topic) {
+  using Publisher = shm::pubsub::PublisherT<AllocatorT>;
+  using Subscriber = shm::pubsub::SubscriberT<AllocatorT>;
+
+  shm::memory::Options options;
+  options.queue_size = 16;
+  Publisher pub(topic, nullptr, options);
+
+  std::vector<int> answers;
+  auto callback = [&answers](shm::memory::Memblock *memblock) {
+    answers.push_back(*(reinterpret_cast<int *>(memblock->ptr)));
+  };
+  Subscriber sub(topic, callback);
+
+  std::vector<int> messages(10);
+  std::iota(messages.begin(), messages.end(), 0);
+  std::vector<shm::memory::Memblock> batch;
+  for (auto &message : messages) {
+    batch.emplace_back(&message, sizeof(message));
+  }
+
+  REQUIRE(pub.publish_batch(batch));
+  for (size_t i = 0; i < messages.size(); ++i) {
+    sub.spin_once();
+  }
+  REQUIRE(answers == messages);
+
+  // Longer than the queue, the subscriber jumps ahead to the newest half.
+  answers.clear();
+  messages.resize(40);
+  std::iota(messages.begin(), messages.end(), 0);
+  batch.clear();
+  for (auto &message : messages) {
+    batch.emplace_back(&message, sizeof(message));
+  }
+  REQUIRE(pub.publish_batch(batch));
+  for (size_t i = 0; i < options.queue_size / 2; ++i) {
+    sub.spin_once();
+  }
+  REQUIRE(answers == std::vector<int>(messages.end() - options.queue_size / 2,
+                                      messages.end()));
+}
+
+TEST_CASE("publish_batch") { publish_batch<shm::memory::Allocator>("batch"); }
+
+TEST_CASE("publish_batch_slab_allocator") {
+  publish_batch<shm::memory::SlabAllocator>("batch_slab");
+}
+
+// Calls `hook` before copying each message into the topic.
+class HookCopier : public shm::memory::DefaultCopier {
+ public:
+  std::function<void()> hook;
+
+  void user_to_shm(void *dst, void *src, size_t size) override {
+    if (hook) {
+      hook();
+    }
+    DefaultCopier::user_to_shm(dst, src, size);
+  }
+};
+
+TEST_CASE("publish_batch_lagging_reader") {
+  std::string topic = "batch_lagging_reader";
+  auto options = read_mode_options(&topic);
+  options.queue_size = 16;
+
+  // Too big to be stored inline, so each one goes through the copier.
+  using Message = std::array<uint32_t, 64>;
+  auto copier = std::make_shared<HookCopier>();
+  shm::pubsub::Publisher pub(topic, copier, options);
+
+  std::vector<std::pair<uint32_t, uint32_t>> reads;
+  shm::pubsub::Subscriber sub(
+      topic, [&reads, &sub](shm::memory::Memblock *memblock) {
+        uint32_t value = reinterpret_cast<Message *>(memblock->ptr)->at(0);
+        reads.emplace_back(value, sub.counter_.load());
+      });
+
+  // The subscriber stays at message 0, one slot short of being lapped.
+  std::vector<Message> messages(options.queue_size + 2);
+  for (uint32_t i = 0; i < messages.size(); ++i) {
+    messages[i].fill(i);
+  }
+  for (uint32_t i = 0; i < options.queue_size - 1; ++i) {
+    REQUIRE(pub.publish(&messages[i], sizeof(Message)));
+  }
+
+  // The batch wraps around: message 16 replaces message 0, and the
+  // subscriber reads while message 17 is being copied.
+  std::vector<shm::memory::Memblock> batch;
+  for (uint32_t i = options.queue_size - 1; i < messages.size(); ++i) {
+    batch.emplace_back(&messages[i], sizeof(Message));
+  }
+  int copies = 0;
+  copier->hook = [&copies, &sub]() {
+    if (++copies == 3) {
+      sub.spin_once();
+    }
+  };
+  REQUIRE(pub.publish_batch(batch));
+  copier->hook = nullptr;
+
+  // The subscriber got the message at the position it read.
+  REQUIRE(reads.size() == 1);
+  REQUIRE(reads[0].first == reads[0].second);
+}
+
+TEST_CASE("spin_some") {
+  std::string topic = "spin_some";
+
+  shm::memory::Options options;
+  options.queue_size = 16;
+  shm::pubsub::Publisher pub(topic, nullptr, options);
+
+  std::vector<int> answers;
+  auto callback = [&answers](shm::memory::Memblock *memblock) {
+    answers.push_back(*(reinterpret_cast<int *>(memblock->ptr)));
+  };
+  shm::pubsub::Subscriber sub(topic, callback, nullptr, options);
+
+  REQUIRE(sub.spin_some(10) == 0);
+
+  std::vector<int> messages(10);
+  std::iota(messages.begin(), messages.end(), 0);
+  for (auto &message : messages) {
+    pub.publish(&message, sizeof(message));
+  }
+  REQUIRE(sub.spin_some(4) == 4);
+  REQUIRE(sub.spin_some(100) == 6);
+  REQUIRE(sub.spin_some(100) == 0);
+  REQUIRE(answers == messages);
+
+  // Lapped, it resumes at the oldest message left instead of jumping ahead.
+  answers.clear();
+  messages.resize(40);
+  std::iota(messages.begin(), messages.end(), 0);
+  for (auto &message : messages) {
+    pub.publish(&message, sizeof(message));
+  }
+  REQUIRE(sub.spin_some(100) == options.queue_size - 1);
+  REQUIRE(answers == std::vector<int>(messages.end() - answers.size(),
+                                      messages.end()));
+}
+
+TEST_CASE("spin_batch") {
+  std::string topic = "spin_batch";
+
+  shm::memory::Options options;
+  options.queue_size = 16;
+  shm::pubsub::Publisher pub(topic, nullptr, options);
+  shm::pubsub::Subscriber sub(
+      topic, [](shm::memory::Memblock *) {}, nullptr, options);
+
+  std::vector<int> answers;
+  int calls = 0;
+  auto callback = [&](shm::memory::Memblock *messages, size_t count) {
+    calls++;
+    for (size_t i = 0; i < count; ++i) {
+      answers.push_back(*(reinterpret_cast<int *>(messages[i].ptr)));
+    }
+  };
+
+  REQUIRE(sub.spin_batch(callback) == 0);
+  REQUIRE(calls == 0);
+
+  std::vector<int> messages(12);
+  std::iota(messages.begin(), messages.end(), 0);
+  for (auto &message : messages) {
+    pub.publish(&message, sizeof(message));
+  }
+  REQUIRE(sub.spin_batch(callback, 5) == 5);
+  REQUIRE(sub.spin_batch(callback) == 7);
+  REQUIRE(calls == 2);
+  REQUIRE(answers == messages);
+
+  // Zero-copy views of a whole queue at once. Messages that are stored
+  // inline are always copied, these are too large for that.
+  sub.set_zero_copy(true);
+  answers.clear();
+  for (auto &message : messages) {
+    std::vector<int> padded(shm::memory::Element::INLINE_SIZE, message);
+    pub.publish(padded.data(), padded.size() * sizeof(int));
+  }
+  REQUIRE(sub.spin_batch([&](shm::memory::Memblock *views, size_t count) {
+    for (size_t i = 0; i < count; ++i) {
+      REQUIRE(!views[i].free);
+    }
+    callback(views, count);
+  }) == messages.size());
+  REQUIRE(answers == messages);
+
+  // The views are released, the publisher can lap them.
+  for (int i = 0; i < 100; ++i) {
+    REQUIRE(pub.publish(&i, sizeof(i)));
+  }
+}
+
+// Message `i` is its index, followed by a run of `i & 0xff`.
+size_t seqlock_message_size(uint32_t i) { return 64 + (i % 64) * 509; }
+
+TEST_CASE("seqlock_multiprocess") {
+  std::string topic = "seqlock_multiprocess";
+  const uint32_t n_messages = 10000;
+
+  // A small queue and buffer, so the publisher keeps overwriting elements
+  // and reusing memory while they're read.
+  shm::memory::Options options;
+  options.queue_size = 8;
+  options.buffer_size = 1024 * 1024;
+  options.seqlock = true;
+
+  uint32_t last = 0;
+  bool first = true, valid = true;
+  auto callback = [&](shm::memory::Memblock *memblock) {
+    auto *bytes = reinterpret_cast<uint8_t *>(memblock->ptr);
+    uint32_t i;
+    std::memcpy(&i, bytes, sizeof(i));
+    valid = valid && (first || i > last) &&
+            memblock->size == seqlock_message_size(i) &&
+            std::all_of(bytes + sizeof(i), bytes + memblock->size,
+                        [i](uint8_t v) { return v == (i & 0xff); });
+    first = false;
+    last = i;
+  };
+  shm::pubsub::Subscriber sub(topic, callback, nullptr, options);
+
+  pid_t pid = fork();
+  if (pid == 0) {
+    shm::pubsub::Publisher pub(topic);
+    std::vector<uint8_t> message(seqlock_message_size(63));
+    for (uint32_t i = 0; i < n_messages; ++i) {
+      std::memcpy(message.data(), &i, sizeof(i));
+      std::fill(message.begin() + sizeof(i), message.end(), i & 0xff);
+      while (!pub.publish(message.data(), seqlock_message_size(i))) {
+      }
+    }
+    _exit(0);
+  }
+
+  while (last != n_messages - 1) {
+    sub.spin_once(std::chrono::milliseconds(1));
+  }
+  int status;
+  waitpid(pid, &status, 0);
+  REQUIRE(WIFEXITED(status));
+  REQUIRE(WEXITSTATUS(status) == 0);
+  REQUIRE(valid);
+}
+
+struct Pose {
+  uint32_t seq;
+  double x, y, z;
+};
+
+// Fields are derived from `seq`, so a torn read shows up.
+Pose make_pose(uint32_t seq) { return Pose{seq, seq * 1.0, seq * 2.0, -1.0}; }
+
+bool consistent(const Pose &pose) {
+  return pose.x == pose.seq * 1.0 && pose.y == pose.seq * 2.0 &&
+         pose.z == -1.0;
+}
+
+TEST_CASE("typed") {
+  std::string topic = "typed";
+
+  shm::memory::Options options;
+  options.queue_size = 16;
+  shm::pubsub::TypedPublisher<Pose> pub(topic, options);
+
+  std::vector<uint32_t> answers;
+  auto callback = [&answers](const Pose &pose) {
+    REQUIRE(consistent(pose));
+    answers.push_back(pose.seq);
+  };
+  shm::pubsub::TypedSubscriber<Pose> sub(topic, callback);
+
+  sub.spin_once();
+  REQUIRE(answers.empty());
+
+  std::vector<uint32_t> messages(10);
+  std::iota(messages.begin(), messages.end(), 0);
+  for (auto seq : messages) {
+    pub.publish(make_pose(seq));
+  }
+  for (size_t i = 0; i < messages.size(); ++i) {
+    sub.spin_once();
+  }
+  REQUIRE(answers == messages);
+
+  // Lapped, the subscriber jumps ahead like an untyped one.
+  answers.clear();
+  for (uint32_t seq = 10; seq < 50; ++seq) {
+    pub.publish(make_pose(seq));
+  }
+  for (size_t i = 0; i < options.queue_size / 2; ++i) {
+    sub.spin_once();
+  }
+  REQUIRE(answers.front() == 50 - options.queue_size / 2);
+  REQUIRE(answers.back() == 49);
+}
+
+TEST_CASE("typed_multiprocess") {
+  std::string topic = "typed_multiprocess";
+  const int n_pubs = 2;
+  const uint32_t n_messages = 20000;
+
+  shm::memory::Options options;
+  options.queue_size = 8;
+
+  uint32_t received = 0;
+  bool valid = true;
+  auto callback = [&](const Pose &pose) {
+    valid = valid && consistent(pose);
+    received++;
+  };
+  shm::pubsub::TypedSubscriber<Pose> sub(topic, callback, options);
+
+  std::vector<pid_t> pids;
+  for (int p = 0; p < n_pubs; ++p) {
+    pid_t pid = fork();
+    if (pid == 0) {
+      shm::pubsub::TypedPublisher<Pose> pub(topic);
+      for (uint32_t i = 0; i < n_messages; ++i) {
+        pub.publish(make_pose(p * n_messages + i));
+      }
+      _exit(0);
+    }
+    pids.push_back(pid);
+  }
+
+  // Read while the publishers are writing.
+  int running = n_pubs;
+  while (running > 0) {
+    sub.spin_once();
+    int status;
+    for (auto pid : pids) {
+      if (waitpid(pid, &status, WNOHANG) == pid) {
+        REQUIRE(WIFEXITED(status));
+        REQUIRE(WEXITSTATUS(status) == 0);
+        running--;
+      }
+    }
+  }
+  while (sub.counter_ < n_pubs * n_messages) {
+    sub.spin_once();
+  }
+
+  // No message was lost between the publishers, or torn for the reader.
+  REQUIRE(sub.counter_ == n_pubs * n_messages);
+  REQUIRE(valid);
+  REQUIRE(received > 0);
+}
+
+TEST_CASE("typed_crashed_publisher") {
+  std::string topic = "typed_crashed_publisher";
+  using Elem = shm::pubsub::TypedElem<Pose>;
+  // Each section starts from a fresh segment.
+  shm_unlink(("/SHM_" + topic).c_str());
+
+  shm::memory::Options options;
+  options.queue_size = 16;
+  options.buffer_size = 0;
+  shm::pubsub::TypedPublisher<Pose> pub(topic, options);
+
+  std::vector<uint32_t> answers;
+  auto callback = [&answers](const Pose &pose) {
+    REQUIRE(consistent(pose));
+    answers.push_back(pose.seq);
+  };
+  shm::pubsub::TypedSubscriber<Pose> sub(topic, callback);
+
+  // The elements, to leave one as a publisher that crashed would.
+  shm::memory::Memory<Elem, shm::pubsub::NoAllocator> memory(topic, options);
+  Elem *elem = &memory.shared_queue_->elements()[1];
+  pid_t dead = dead_pid();
+
+  pub.publish(make_pose(0));
+  std::vector<uint32_t> expected;
+  SECTION("while writing") {
+    // Its message is lost, the next one takes its place.
+    elem->seq = Elem::claimed(1, dead);
+    expected = {0, 2};
+  }
+  SECTION("before bumping the counter") {
+    Pose pose = make_pose(1);
+    std::memcpy(elem->msg, &pose, sizeof(Pose));
+    elem->seq = Elem::written(1);
+    expected = {0, 1, 2};
+  }
+  pub.publish(make_pose(2));
+
+  for (int i = 0; i < 3; ++i) {
+    sub.spin_once();
+  }
+  REQUIRE(answers == expected);
+}
+
+TEST_CASE("inline_messages") {
+  std::string topic = "inline_messages";
+
+  // Messages around the inline limit, and a lapped queue so inline and
+  // buffered messages replace each other.
+  shm::memory::Options options;
+  options.queue_size = 4;
+  options.buffer_size = 64 * 1024;
+  shm::pubsub::Publisher pub(topic, nullptr, options);
+
+  std::vector<std::string> answers;
+  auto callback = [&answers](shm::memory::Memblock *memblock) {
+    answers.emplace_back(reinterpret_cast<char *>(memblock->ptr),
+                         memblock->size);
+  };
+  shm::pubsub::Subscriber sub(topic, callback);
+
+  const size_t limit = shm::memory::Element::INLINE_SIZE;
+  std::vector<std::string> messages;
+  for (size_t size : {size_t(0), size_t(1), limit - 1, limit, limit + 1,
+                      4 * limit}) {
+    messages.emplace_back(size, 'a' + messages.size());
+  }
+  for (int round = 0; round < 100; ++round) {
+    answers.clear();
+    for (auto &message : messages) {
+      REQUIRE(pub.publish(const_cast<char *>(message.data()), message.size()));
+      sub.spin_once();
+    }
+    REQUIRE(answers == messages);
+  }
+}
+
+template <class AllocatorT>
+void keep_last(const std::string &topic) {
+  // Messages too large to be inline, so they live in the small buffer. Odd
+  // ones are smaller, of another size class.
+  const size_t message_size = 256;
+  auto size_of = [message_size](uint32_t seq) {
+    return seq % 2 ? message_size / 2 : message_size;
+  };
+  auto options =
+      shm::memory::Options::keep_last<AllocatorT>(2, message_size);
+  REQUIRE(options.queue_size == 2);
+  shm::pubsub::PublisherT<AllocatorT> pub(topic, nullptr, options);
+
+  std::vector<uint32_t> message(message_size / sizeof(uint32_t));
+  auto publish = [&](uint32_t seq) {
+    std::fill(message.begin(), message.end(), seq);
+    return pub.publish(message.data(), size_of(seq));
+  };
+
+  std::vector<uint32_t> answers;
+  bool zero_copy = GENERATE(false, true);
+  auto callback = [&](shm::memory::Memblock *memblock) {
+    auto *data = reinterpret_cast<uint32_t *>(memblock->ptr);
+    REQUIRE(memblock->size == size_of(data[0]));
+    answers.push_back(data[0]);
+    // The buffer has room to keep publishing while a view is held.
+    if (zero_copy) {
+      REQUIRE(publish(1000 + data[0]));
+    }
+    REQUIRE(std::all_of(data, data + memblock->size / sizeof(uint32_t),
+                        [&](uint32_t word) { return word == data[0]; }));
+  };
+  shm::pubsub::SubscriberT<AllocatorT> sub(topic, callback);
+  sub.set_latest_only(true);
+  sub.set_zero_copy(zero_copy);
+
+  for (uint32_t seq = 0; seq < 100; ++seq) {
+    REQUIRE(publish(seq));
+  }
+  sub.spin_once();
+  REQUIRE(answers == std::vector<uint32_t>{99});
+
+  answers.clear();
+  sub.spin_once();
+  if (zero_copy) {
+    // The message published from the callback.
+    REQUIRE(answers == std::vector<uint32_t>{1099});
+  } else {
+    REQUIRE(answers.empty());
+  }
+
+  answers.clear();
+  for (uint32_t seq = 100; seq < 10000; ++seq) {
+    REQUIRE(publish(seq));
+    if (seq % 7 == 0) {
+      REQUIRE(sub.spin_some(10) == 1);
+    }
+  }
+  REQUIRE(sub.spin_some(10) == 1);
+  REQUIRE(answers.back() == 9999);
+}
+
+TEST_CASE("keep_last") { keep_last<shm::memory::Allocator>("keep_last"); }
+
+TEST_CASE("keep_last_lockless_allocator") {
+  keep_last<shm::memory::LocklessAllocator>("keep_last_lockless");
+}
+
+TEST_CASE("keep_last_slab_allocator") {
+  keep_last<shm::memory::SlabAllocator>("keep_last_slab");
+}
+
+TEST_CASE("keep_last_buddy_allocator") {
+  keep_last<shm::memory::BuddyAllocator>("keep_last_buddy");
+}
+
+TEST_CASE("keep_last_typed") {
+  std::string topic = "keep_last_typed";
+
+  auto options = shm::memory::Options::keep_last(2, sizeof(Pose));
+  shm::pubsub::TypedPublisher<Pose> pub(topic, options);
+
+  std::vector<uint32_t> answers;
+  auto callback = [&answers](const Pose &pose) {
+    REQUIRE(consistent(pose));
+    answers.push_back(pose.seq);
+  };
+  shm::pubsub::TypedSubscriber<Pose> sub(topic, callback);
+  sub.set_latest_only(true);
+
+  for (uint32_t seq = 0; seq < 100; ++seq) {
+    pub.publish(make_pose(seq));
+  }
+  sub.spin_once();
+  sub.spin_once();
+  REQUIRE(answers == std::vector<uint32_t>{99});
+
+  pub.publish(make_pose(100));
+  sub.spin_once();
+  REQUIRE(answers == std::vector<uint32_t>{99, 100});
+}
+
+TEST_CASE("reliable") {
+  std::string topic = "reliable";
+
+  shm::memory::Options options;
+  options.queue_size = 8;
+  options.buffer_size = 64 * 1024;
+  shm::pubsub::Publisher pub(topic, nullptr, options);
+  pub.set_back_pressure(shm::pubsub::BackPressure::fail());
+
+  std::vector<int> answers;
+  auto callback = [&answers](shm::memory::Memblock *memblock) {
+    answers.push_back(*reinterpret_cast<int *>(memblock->ptr));
+  };
+  shm::pubsub::Subscriber sub(topic, callback);
+  REQUIRE(sub.set_reliable(true));
+
+  // The queue fills up (but for the slot at the head), and then the
+  // publisher refuses to overwrite.
+  const uint32_t capacity = options.queue_size - 1;
+  std::vector<int> messages(2 * options.queue_size);
+  std::iota(messages.begin(), messages.end(), 0);
+  for (uint32_t i = 0; i < capacity; ++i) {
+    REQUIRE(pub.publish(&messages[i], sizeof(int)));
+  }
+  REQUIRE(!pub.publish(&messages[capacity], sizeof(int)));
+
+  // Every message read makes room for one more.
+  for (uint32_t i = capacity; i < messages.size(); ++i) {
+    sub.spin_once();
+    REQUIRE(pub.publish(&messages[i], sizeof(int)));
+    REQUIRE(!pub.publish(&messages[i], sizeof(int)));
+  }
+  REQUIRE(sub.spin_some(messages.size()) == capacity);
+  REQUIRE(answers == messages);
+
+  // A timeout fails once it runs out.
+  pub.set_back_pressure(shm::pubsub::BackPressure::wait(
+      shm::concurrent::WaitStrategy::blocking(),
+      std::chrono::milliseconds(1)));
+  for (uint32_t i = 0; i < capacity; ++i) {
+    REQUIRE(pub.publish(&messages[i], sizeof(int)));
+  }
+  REQUIRE(!pub.publish(&messages[0], sizeof(int)));
+
+  // Unreliable again, the publisher laps it.
+  REQUIRE(sub.set_reliable(false));
+  REQUIRE(pub.publish(&messages[0], sizeof(int)));
+}
+
+TEST_CASE("reliable_multiprocess") {
+  std::string topic = "reliable_multiprocess";
+  const int n_messages = 20000;
+
+  shm::memory::Options options;
+  options.queue_size = 16;
+  options.buffer_size = 64 * 1024;
+
+  std::vector<int> answers;
+  auto callback = [&answers](shm::memory::Memblock *memblock) {
+    answers.push_back(*reinterpret_cast<int *>(memblock->ptr));
+  };
+  shm::pubsub::Subscriber sub(topic, callback, nullptr, options);
+  sub.set_wait_strategy(shm::concurrent::WaitStrategy::yielding());
+  REQUIRE(sub.set_reliable(true));
+
+  // Batches and inline messages wait too.
+  pid_t pid = fork();
+  if (pid == 0) {
+    shm::pubsub::Publisher pub(topic);
+    for (int i = 0; i < n_messages; i += 4) {
+      std::vector<std::vector<int>> payloads;
+      std::vector<shm::memory::Memblock> batch;
+      for (int j = i; j < i + 4; ++j) {
+        payloads.emplace_back(j % 3 == 0 ? 64 : 1, j);
+        batch.emplace_back(payloads.back().data(),
+                           payloads.back().size() * sizeof(int));
+      }
+      if (!(i % 8 == 0 ? pub.publish_batch(batch)
+                       : pub.publish(batch[0].ptr, batch[0].size) &&
+                             pub.publish(batch[1].ptr, batch[1].size) &&
+                             pub.publish(batch[2].ptr, batch[2].size) &&
+                             pub.publish(batch[3].ptr, batch[3].size))) {
+        _exit(1);
+      }
+    }
+    _exit(0);
+  }
+
+  while (answers.size() < n_messages) {
+    sub.spin_once(std::chrono::milliseconds(1));
+  }
+  int status;
+  waitpid(pid, &status, 0);
+  REQUIRE(WIFEXITED(status));
+  REQUIRE(WEXITSTATUS(status) == 0);
+
+  std::vector<int> messages(n_messages);
+  std::iota(messages.begin(), messages.end(), 0);
+  REQUIRE(answers == messages);
+}
+
+TEST_CASE("reliable_dead_subscriber") {
+  std::string topic = "reliable_dead_subscriber";
+
+  shm::memory::Options options;
+  options.queue_size = 4;
+  options.buffer_size = 64 * 1024;
+  shm::pubsub::Publisher pub(topic, nullptr, options);
+
+  // The subscriber crashes without unregistering.
+  pid_t pid = fork();
+  if (pid == 0) {
+    shm::pubsub::Subscriber sub(topic, [](shm::memory::Memblock *) {});
+    _exit(sub.set_reliable(true) ? 0 : 1);
+  }
+  int status;
+  waitpid(pid, &status, 0);
+  REQUIRE(WIFEXITED(status));
+  REQUIRE(WEXITSTATUS(status) == 0);
+
+  pub.set_back_pressure(shm::pubsub::BackPressure::wait(
+      shm::concurrent::WaitStrategy::blocking(), std::chrono::seconds(10)));
+  for (int i = 0; i < 4 * options.queue_size; ++i) {
+    REQUIRE(pub.publish(&i, sizeof(int)));
+  }
+}
+
+TEST_CASE("registry") {
+  std::string topic = "registry";
+
+  shm::memory::Options options;
+  options.queue_size = 8;
+  options.buffer_size = 64 * 1024;
+  shm::pubsub::Publisher pub(topic, nullptr, options);
+  REQUIRE(pub.subscribers().empty());
+
+  auto callback = [](shm::memory::Memblock *) {};
+  shm::pubsub::Subscriber fast(topic, callback);
+  auto slow = std::make_unique<shm::pubsub::Subscriber>(topic, callback);
+
+  // Oldest first.
+  auto subscribers = [&pub]() {
+    auto infos = pub.subscribers();
+    std::sort(infos.begin(), infos.end(),
+              [](const shm::pubsub::SubscriberInfo &a,
+                 const shm::pubsub::SubscriberInfo &b) { return a.id < b.id; });
+    return infos;
+  };
+  auto infos = subscribers();
+  REQUIRE(infos.size() == 2);
+  REQUIRE(infos[0].id != infos[1].id);
+  for (auto &info : infos) {
+    REQUIRE(info.pid == static_cast<uint32_t>(getpid()));
+    REQUIRE(!info.reliable);
+    REQUIRE(info.position == 0);
+    REQUIRE(info.lag == 0);
+    REQUIRE(info.drops == 0);
+  }
+  auto joined = infos[1].last_read;
+
+  int message = 0;
+  for (int i = 0; i < 4; ++i) {
+    REQUIRE(pub.publish(&message, sizeof(int)));
+  }
+  REQUIRE(fast.spin_some(10) == 4);
+  slow->spin_once();
+  // The slow one hasn't run out of messages yet, its entry may trail.
+  infos = subscribers();
+  REQUIRE(infos[0].position == 4);
+  REQUIRE(infos[0].lag == 0);
+  REQUIRE(infos[1].lag >= 3);
+
+  // Lapped, the slow one skips ahead and counts what it missed.
+  for (int i = 0; i < 20; ++i) {
+    REQUIRE(pub.publish(&message, sizeof(int)));
+  }
+  slow->spin_once();
+  REQUIRE(slow->spin_some(0) == 0);
+  infos = subscribers();
+  uint32_t head = 24;
+  uint32_t skipped_to = shm::pubsub::jumpahead(head, options.queue_size);
+  REQUIRE(infos[1].position == skipped_to + 1);
+  REQUIRE(infos[1].lag == head - skipped_to - 1);
+  REQUIRE(infos[1].drops == skipped_to - 1);
+  REQUIRE(infos[1].last_read > joined);
+
+  // Turning reliable, the fast one moves to the oldest message left.
+  REQUIRE(fast.set_reliable(true));
+  infos = subscribers();
+  REQUIRE(infos[0].reliable);
+  REQUIRE(infos[0].position == head - options.queue_size + 1);
+  REQUIRE(infos[0].drops == head - options.queue_size + 1 - 4);
+
+  slow.reset();
+  REQUIRE(subscribers().size() == 1);
+
+  // Crashed subscribers are evicted.
+  pid_t pid = fork();
+  if (pid == 0) {
+    shm::pubsub::Subscriber sub(topic, callback);
+    _exit(0);
+  }
+  int status;
+  waitpid(pid, &status, 0);
+  REQUIRE(WIFEXITED(status));
+  infos = subscribers();
+  REQUIRE(infos.size() == 1);
+  REQUIRE(infos[0].pid == static_cast<uint32_t>(getpid()));
+}
+
+TEST_CASE("zero_copy") {
+  std::string topic = "zero_copy";
+
+  // Every callback laps the queue, the message it views is replaced while
+  // the view is held.
+  shm::memory::Options options;
+  options.queue_size = 2;
+  options.buffer_size = 1024 * 1024;
+  shm::pubsub::Publisher pub(topic, nullptr, options);
+
+  std::vector<uint8_t> message(0.15 * options.buffer_size);
+  int received = 0;
+  auto callback = [&](shm::memory::Memblock *memblock) {
+    REQUIRE(!memblock->free);
+    REQUIRE(memblock->size == message.size());
+    auto *view = reinterpret_cast<uint8_t *>(memblock->ptr);
+    uint8_t value = view[0];
+    for (int i = 0; i < 2; ++i) {
+      std::fill(message.begin(), message.end(), value + 100);
+      REQUIRE(pub.publish(message.data(), message.size()));
+    }
+    REQUIRE(std::all_of(view, view + memblock->size,
+                        [value](uint8_t v) { return v == value; }));
+    received++;
+  };
+  shm::pubsub::Subscriber sub(topic, callback);
+  sub.set_zero_copy(true);
+
+  for (int i = 0; i < 50; ++i) {
+    std::fill(message.begin(), message.end(), i);
+    REQUIRE(pub.publish(message.data(), message.size()));
+    sub.spin_once();
+  }
+  REQUIRE(received == 50);
+}
+
+TEST_CASE("zero_copy_laps") {
+  std::string topic = "zero_copy_laps";
+
+  // The view is held while the publisher laps the queue twice.
+  shm::memory::Options options;
+  options.queue_size = 2;
+  options.buffer_size = 1024 * 1024;
+  shm::pubsub::Publisher pub(topic, nullptr, options);
+
+  std::vector<uint8_t> message(0.15 * options.buffer_size);
+  int received = 0;
+  auto callback = [&](shm::memory::Memblock *memblock) {
+    auto *view = reinterpret_cast<uint8_t *>(memblock->ptr);
+    uint8_t value = view[0];
+    for (uint32_t i = 0; i < 2 * options.queue_size; ++i) {
+      std::fill(message.begin(), message.end(), value + 1 + i);
+      REQUIRE(pub.publish(message.data(), message.size()));
+    }
+    REQUIRE(std::all_of(view, view + memblock->size,
+                        [value](uint8_t v) { return v == value; }));
+    received++;
+  };
+  shm::pubsub::Subscriber sub(topic, callback);
+  sub.set_zero_copy(true);
+
+  for (int i = 0; i < 20; ++i) {
+    std::fill(message.begin(), message.end(), i);
+    REQUIRE(pub.publish(message.data(), message.size()));
+    sub.spin_once();
+  }
+  REQUIRE(received == 20);
+}
+
+TEST_CASE("zero_copy_crashed_reader") {
+  std::string topic = "zero_copy_crashed_reader";
+
+  shm::memory::Options options;
+  options.queue_size = 2;
+  options.buffer_size = 1024 * 1024;
+  shm::pubsub::Publisher pub(topic, nullptr, options);
+
+  std::vector<uint8_t> message(0.15 * options.buffer_size);
+  REQUIRE(pub.publish(message.data(), message.size()));
+
+  // The reader dies while viewing the first message.
+  pid_t pid = fork();
+  if (pid == 0) {
+    shm::pubsub::Subscriber sub(
+        topic, [](shm::memory::Memblock *) { _exit(0); });
+    sub.set_zero_copy(true);
+    sub.spin_once();
+    _exit(1);
+  }
+  int status;
+  waitpid(pid, &status, 0);
+  REQUIRE(WIFEXITED(status));
+  REQUIRE(WEXITSTATUS(status) == 0);
+
+  // Its view doesn't hold on to the message.
+  for (int i = 0; i < 50; ++i) {
+    REQUIRE(pub.publish(message.data(), message.size()));
+  }
+}
+
+TEST_CASE("spin_once_timeout") {
+  std::string topic = "spin_once_timeout";
+
+  int received = 0;
+  auto callback = [&received](shm::memory::Memblock *) { received++; };
+  shm::pubsub::Publisher pub(topic);
+  shm::pubsub::Subscriber sub(topic, callback);
+
+  auto start = std::chrono::steady_clock::now();
+  sub.spin_once(std::chrono::milliseconds(50));
+  REQUIRE(std::chrono::steady_clock::now() - start >=
+          std::chrono::milliseconds(50));
+  REQUIRE(received == 0);
+
+  // Woken up by the publisher, long before the timeout.
+  std::thread pub_thread([&pub]() {
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    int message = 1;
+    pub.publish(&message, sizeof(message));
+  });
+  start = std::chrono::steady_clock::now();
+  sub.spin_once(std::chrono::seconds(10));
+  REQUIRE(std::chrono::steady_clock::now() - start < std::chrono::seconds(5));
+  REQUIRE(received == 1);
+  pub_thread.join();
+}
+
+TEST_CASE("spin_sleeps") {
+  std::string topic = "spin_sleeps";
+
+  std::atomic<int> received{0};
+  auto callback = [&received](shm::memory::Memblock *) { received++; };
+  shm::pubsub::Publisher pub(topic);
+  shm::pubsub::Subscriber sub(topic, callback);
+
+  struct timespec cpu_time {};
+  std::thread sub_thread([&sub, &cpu_time]() {
+    sub.spin();
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu_time);
+  });
+
+  for (int i = 0; i < 10; ++i) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    pub.publish(&i, sizeof(i));
+  }
+  while (received < 10) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  sub.stop();
+  sub_thread.join();
+
+  // Idle for half a second, the subscriber should have slept through it.
+  REQUIRE(cpu_time.tv_sec == 0);
+  REQUIRE(cpu_time.tv_nsec < 100 * 1000 * 1000);
+}
+
+TEST_CASE("crashed_sleeper") {
+  std::string topic = "crashed_sleeper";
+
+  shm::memory::Options options;
+  options.queue_size = 4;
+  options.buffer_size = 64 * 1024;
+  shm::pubsub::Publisher pub(topic, nullptr, options);
+  using Elem = shm::pubsub::TopicElemT<shm::pubsub::LockType>;
+  shm::memory::Memory<Elem, shm::memory::Allocator> memory(topic, options);
+  auto &waiters = memory.shared_queue_->waiters;
+
+  // The subscriber is killed while it sleeps.
+  pid_t pid = fork();
+  if (pid == 0) {
+    shm::pubsub::Subscriber sub(topic, [](shm::memory::Memblock *) {});
+    sub.spin_once(std::chrono::seconds(30));
+    _exit(0);
+  }
+  auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+  while (!waiters.any() && std::chrono::steady_clock::now() < deadline) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  REQUIRE(waiters.any());
+  kill(pid, SIGKILL);
+  waitpid(pid, nullptr, 0);
+  REQUIRE(waiters.any());
+
+  // Its count is taken back, and publishers skip the syscall again.
+  for (uint32_t i = 0; i < shm::concurrent::Waiters::REAP_INTERVAL; ++i) {
+    REQUIRE(pub.publish(&i, sizeof(i)));
+  }
+  REQUIRE(!waiters.any());
+}
+
+TEST_CASE("spin_wait_strategies") {
+  std::vector<std::pair<std::string, shm::concurrent::WaitStrategy>>
+      strategies = {
+          {"spin_busy_spin", shm::concurrent::WaitStrategy::busy_spin()},
+          {"spin_yielding", shm::concurrent::WaitStrategy::yielding(10)},
+          {"spin_blocking", shm::concurrent::WaitStrategy::blocking(10, 10)},
+      };
+
+  for (auto &strategy : strategies) {
+    std::atomic<int> received{0};
+    auto callback = [&received](shm::memory::Memblock *) { received++; };
+    shm::pubsub::Publisher pub(strategy.first);
+    shm::pubsub::Subscriber sub(strategy.first, callback);
+    sub.set_wait_strategy(strategy.second);
+
+    std::thread sub_thread([&sub]() { sub.spin(); });
+    for (int i = 0; i < 100; ++i) {
+      pub.publish(&i, sizeof(i));
+      while (received <= i) {
+        std::this_thread::yield();
+      }
+    }
+    sub.stop();
+    sub_thread.join();
+    REQUIRE(received == 100);
+  }
+}
+
+TEST_CASE("epoll") {
+  // One thread, many topics.
+  const int n_topics = 8;
+  std::vector<int> received(n_topics, 0);
+  std::vector<std::unique_ptr<shm::pubsub::Publisher>> pubs;
+  std::vector<std::unique_ptr<shm::pubsub::Subscriber>> subs;
+
+  int epfd = epoll_create1(0);
+  REQUIRE(epfd >= 0);
+  for (int t = 0; t < n_topics; ++t) {
+    std::string topic = "epoll_" + std::to_string(t);
+    pubs.push_back(std::make_unique<shm::pubsub::Publisher>(topic));
+    subs.push_back(std::make_unique<shm::pubsub::Subscriber>(
+        topic, [&received, t](shm::memory::Memblock *) { received[t]++; }));
+
+    struct epoll_event event {};
+    event.events = EPOLLIN;
+    event.data.u32 = t;
+    REQUIRE(subs[t]->fd() >= 0);
+    REQUIRE(epoll_ctl(epfd, EPOLL_CTL_ADD, subs[t]->fd(), &event) == 0);
+  }
+
+  auto poll = [&]() {
+    struct epoll_event events[n_topics];
+    int n = epoll_wait(epfd, events, n_topics, 1000);
+    for (int i = 0; i < n; ++i) {
+      subs[events[i].data.u32]->spin_ready();
+    }
+    return n;
+  };
+
+  // Fresh fds are readable, but there's nothing to read yet.
+  poll();
+  REQUIRE(std::all_of(received.begin(), received.end(),
+                      [](int r) { return r == 0; }));
+
+  // Only the topics that were published to come up.
+  for (int t = 0; t < n_topics; t += 2) {
+    pubs[t]->publish(&t, sizeof(t));
+  }
+  while (poll() != 0 &&
+         std::count(received.begin(), received.end(), 1) < n_topics / 2) {
+  }
+  for (int t = 0; t < n_topics; ++t) {
+    REQUIRE(received[t] == (t % 2 == 0 ? 1 : 0));
+  }
+
+  // Published to from another thread while waiting.
+  std::thread pub_thread([&pubs]() {
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    int message = 3;
+    pubs[3]->publish(&message, sizeof(message));
+  });
+  while (received[3] == 0) {
+    REQUIRE(poll() > 0);
+  }
+  pub_thread.join();
+
+  close(epfd);
+}
+
+TEST_CASE("epoll_crashed") {
+  std::string topic = "epoll_crashed";
+
+  shm::memory::Options options;
+  options.queue_size = 4;
+  options.buffer_size = 64 * 1024;
+  shm::pubsub::Publisher pub(topic, nullptr, options);
+  using Elem = shm::pubsub::TopicElemT<shm::pubsub::LockType>;
+  shm::memory::Memory<Elem, shm::memory::Allocator> memory(topic, options);
+  auto &waiters = memory.shared_queue_->waiters;
+
+  auto wait_for_sleeper = [&waiters]() {
+    auto deadline =
+        std::chrono::steady_clock::now() + std::chrono::seconds(10);
+    while (!waiters.any() && std::chrono::steady_clock::now() < deadline) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    return waiters.any();
+  };
+
+  // The bridge only counts itself while it sleeps.
+  {
+    shm::pubsub::Subscriber sub(topic, [](shm::memory::Memblock *) {});
+    REQUIRE(sub.fd() >= 0);
+    REQUIRE(wait_for_sleeper());
+  }
+  REQUIRE(!waiters.any());
+
+  // A process killed with an fd open is reaped like any sleeper.
+  pid_t pid = fork();
+  if (pid == 0) {
+    shm::pubsub::Subscriber sub(topic, [](shm::memory::Memblock *) {});
+    sub.fd();
+    std::this_thread::sleep_for(std::chrono::seconds(30));
+    _exit(0);
+  }
+  REQUIRE(wait_for_sleeper());
+  kill(pid, SIGKILL);
+  waitpid(pid, nullptr, 0);
+  for (uint32_t i = 0; i < shm::concurrent::Waiters::REAP_INTERVAL; ++i) {
+    REQUIRE(pub.publish(&i, sizeof(i)));
+  }
+  REQUIRE(!waiters.any());
+}
+
+TEST_CASE("mirrored") {
+  std::string topic = "mirrored";
+
+  // With two elements in the queue, three messages are in the buffer
+  // while publishing. Those of 30% of the buffer only fit every time if
+  // they can cross the end of the buffer.
+  shm::memory::Options options;
+  options.queue_size = 2;
+  options.buffer_size = 1024 * 1024;
+  options.mirrored = true;
+
+  std::vector<uint8_t> message(0.3 * options.buffer_size);
+  int received = 0;
+  auto callback = [&](shm::memory::Memblock *memblock) {
+    REQUIRE(memblock->size == message.size());
+    REQUIRE(std::memcmp(memblock->ptr, message.data(), message.size()) == 0);
+    received++;
+  };
+  shm::pubsub::Publisher pub(topic, nullptr, options);
+  shm::pubsub::Subscriber sub(topic, callback);
+
+  for (int i = 0; i < 20; ++i) {
+    std::fill(message.begin(), message.end(), i);
+    REQUIRE(pub.publish(message.data(), message.size()));
+    sub.spin_once();
+  }
+  REQUIRE(received == 20);
+}
+
 TEST_CASE("sub_after_pub_dtor") {
   std::string topic = "sub_after_pub_dtor";
 
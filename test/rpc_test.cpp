@@ -82,8 +82,9 @@ TEST_CASE("failure") {
 
 TEST_CASE("single_message") {
   char value = 127;
-  size_t size = 10;
-  std::string channel_name = "single_message";
+  // Stored inline in the channel, and in its buffers.
+  size_t size = GENERATE(10, 1000);
+  std::string channel_name = "single_message_" + std::to_string(size);
   shm::rpc::Client client(channel_name);
   shm::rpc::Server server(
       channel_name,
@@ -191,8 +192,8 @@ TEST_CASE("mutliple_clients") {
   REQUIRE(returns == expected);
 }
 
-TEST_CASE("serve_on_separate_thread") {
-  std::string channel_name = "serve_on_separate_thread";
+void serve_on_separate_thread(const std::string &channel_name,
+                              const shm::concurrent::WaitStrategy &strategy) {
 
   std::vector<char> messages = {1, 2, 3, 4, 5};
   std::vector<char> returns;
@@ -208,6 +209,7 @@ TEST_CASE("serve_on_separate_thread") {
         return true;
       },
       free_cleanup);
+  server.set_wait_strategy(strategy);
   std::thread th([&]() { server.serve(); });
 
   shm::rpc::Client client(channel_name);
@@ -224,3 +226,18 @@ TEST_CASE("serve_on_separate_thread") {
   th.join();
   REQUIRE(returns == expected);
 }
+
+TEST_CASE("serve_on_separate_thread") {
+  serve_on_separate_thread("serve_on_separate_thread",
+                           shm::concurrent::WaitStrategy::blocking());
+}
+
+TEST_CASE("serve_busy_spin") {
+  serve_on_separate_thread("serve_busy_spin",
+                           shm::concurrent::WaitStrategy::busy_spin());
+}
+
+TEST_CASE("serve_yielding") {
+  serve_on_separate_thread("serve_yielding",
+                           shm::concurrent::WaitStrategy::yielding());
+}